@@ -0,0 +1,65 @@
+/*
+ * Copyright 2022 Yury Gribov
+ *
+ * Use of this source code is governed by MIT license that can be
+ * found in the LICENSE.txt file.
+ */
+
+// Measures latency of posix_spawn for different sizes of argv.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <unistd.h>
+#include <spawn.h>
+#include <sys/wait.h>
+
+extern char **environ;
+
+static double now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+int main(int argc, char **argv) {
+  if(argc < 4) {
+    fprintf(stderr, "Usage: %s MODE NUM_ARGS NUM_ITERS\n", argv[0]);
+    return 1;
+  }
+
+  const char *mode = argv[1];
+  int num_args = atoi(argv[2]);
+  int num_iters = atoi(argv[3]);
+
+  char **child_argv = malloc((num_args + 2) * sizeof(char *));
+  child_argv[0] = "./child";
+  int i;
+  for(i = 1; i <= num_args; ++i) {
+    char buf[32];
+    snprintf(buf, sizeof(buf), "arg%d", i);
+    child_argv[i] = strdup(buf);
+  }
+  child_argv[num_args + 1] = NULL;
+
+  double start = now();
+  for(i = 0; i < num_iters; ++i) {
+    pid_t pid;
+    if(0 != posix_spawn(&pid, "./child", NULL, NULL, child_argv, environ)) {
+      perror("bench: failed to spawn child");
+      return 1;
+    }
+    int wstatus;
+    if(waitpid(pid, &wstatus, 0) < 0 || !WIFEXITED(wstatus) || WEXITSTATUS(wstatus)) {
+      fprintf(stderr, "bench: child failed\n");
+      return 1;
+    }
+  }
+  double us = (now() - start) * 1e6 / num_iters;
+
+  printf("argv mode=%s args=%d spawn_us=%.1f\n", mode, num_args, us);
+
+  return 0;
+}
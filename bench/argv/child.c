@@ -0,0 +1,10 @@
+/*
+ * Copyright 2022 Yury Gribov
+ *
+ * Use of this source code is governed by MIT license that can be
+ * found in the LICENSE.txt file.
+ */
+
+int main() {
+  return 0;
+}
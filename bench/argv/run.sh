@@ -0,0 +1,35 @@
+#!/bin/sh
+
+# Copyright 2022 Yury Gribov
+#
+# The MIT License (MIT)
+# 
+# Use of this source code is governed by MIT license that can be
+# found in the LICENSE.txt file.
+
+# Benchmark of exec latency vs. size of argv.
+
+set -eu
+
+cd $(dirname $0)
+
+if test -n "${GITHUB_ACTIONS:-}"; then
+  set -x
+fi
+
+CFLAGS="-g -O2 -Wall -Wextra -Werror"
+
+ROOT=$PWD/../..
+
+${CC:-gcc} $CFLAGS bench.c -o bench
+${CC:-gcc} $CFLAGS child.c -o child
+${CC:-gcc} $CFLAGS valgrind.c -o valgrind
+
+# Use fake Valgrind to measure only our overhead
+export PATH=$PWD:$PATH
+
+for n in 10 1000 10000 20000; do
+  ./bench native $n 200
+  PREGRIND_DISABLE=1 LD_PRELOAD=$ROOT/bin/libpregrind.so ./bench disabled $n 200
+  LD_PRELOAD=$ROOT/bin/libpregrind.so ./bench instrumented $n 200
+done
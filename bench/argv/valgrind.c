@@ -0,0 +1,33 @@
+/*
+ * Copyright 2022 Yury Gribov
+ *
+ * Use of this source code is governed by MIT license that can be
+ * found in the LICENSE.txt file.
+ */
+
+// Trivial replacement of Valgrind which runs program natively.
+// Startup cost of real Valgrind can be emulated via STUB_DELAY_US.
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <unistd.h>
+#include <sys/syscall.h>
+
+extern char **environ;
+
+int main(int argc, char **argv) {
+  int i;
+  for(i = 1; i < argc && argv[i][0] == '-'; ++i);
+  if(i == argc) {
+    fprintf(stderr, "valgrind: no program\n");
+    return 1;
+  }
+  const char *delay = getenv("STUB_DELAY_US");
+  if(delay)
+    usleep(atoi(delay));
+  // Bypass Pregrind interceptors
+  syscall(SYS_execve, argv[i], argv + i, environ);
+  perror("valgrind: failed to exec");
+  return 1;
+}
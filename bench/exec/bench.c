@@ -0,0 +1,96 @@
+/*
+ * Copyright 2022 Yury Gribov
+ *
+ * Use of this source code is governed by MIT license that can be
+ * found in the LICENSE.txt file.
+ */
+
+// Measures round-trip latency of starting a trivial child
+// via posix_spawn or fork+exec.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <unistd.h>
+#include <spawn.h>
+#include <sys/wait.h>
+
+extern char **environ;
+
+static double now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static pid_t start(const char *api, char **child_argv) {
+  pid_t pid;
+  if(0 == strcmp(api, "spawn") || 0 == strcmp(api, "spawnp")) {
+    int (*spawn)(pid_t *, const char *, const posix_spawn_file_actions_t *,
+                 const posix_spawnattr_t *, char *const *, char *const *)
+      = api[5] ? posix_spawnp : posix_spawn;
+    if(0 != spawn(&pid, child_argv[0], NULL, NULL, child_argv, environ)) {
+      perror("bench: failed to spawn child");
+      exit(1);
+    }
+    return pid;
+  }
+
+  pid = fork();
+  if(pid < 0) {
+    perror("bench: fork failed");
+    exit(1);
+  }
+  if(!pid) {
+    if(0 == strcmp(api, "execvp"))
+      execvp(child_argv[0], child_argv);
+    else
+      execv(child_argv[0], child_argv);
+    perror("bench: failed to exec child");
+    _exit(1);
+  }
+  return pid;
+}
+
+int main(int argc, char **argv) {
+  if(argc < 5) {
+    fprintf(stderr, "Usage: %s spawn|spawnp|execv|execvp MODE NUM_ARGS NUM_ITERS [LABEL=VALUE...]\n", argv[0]);
+    return 1;
+  }
+
+  const char *api = argv[1];
+  const char *mode = argv[2];
+  int num_args = atoi(argv[3]);
+  int num_iters = atoi(argv[4]);
+
+  char **child_argv = malloc((num_args + 2) * sizeof(char *));
+  // Search PATH for p-variants
+  child_argv[0] = api[strlen(api) - 1] == 'p' ? "child" : "./child";
+  int i;
+  for(i = 1; i <= num_args; ++i) {
+    char buf[32];
+    snprintf(buf, sizeof(buf), "arg%d", i);
+    child_argv[i] = strdup(buf);
+  }
+  child_argv[num_args + 1] = NULL;
+
+  double start_time = now();
+  for(i = 0; i < num_iters; ++i) {
+    pid_t pid = start(api, child_argv);
+    int wstatus;
+    if(waitpid(pid, &wstatus, 0) < 0 || !WIFEXITED(wstatus) || WEXITSTATUS(wstatus)) {
+      fprintf(stderr, "bench: child failed\n");
+      return 1;
+    }
+  }
+  double elapsed = now() - start_time;
+
+  printf("exec api=%s mode=%s args=%d", api, mode, num_args);
+  for(i = 5; i < argc; ++i)
+    printf(" %s", argv[i]);
+  printf(" latency_us=%.1f ops_per_s=%.1f\n", elapsed * 1e6 / num_iters, num_iters / elapsed);
+
+  return 0;
+}
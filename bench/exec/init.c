@@ -0,0 +1,51 @@
+/*
+ * Copyright 2022 Yury Gribov
+ *
+ * Use of this source code is governed by MIT license that can be
+ * found in the LICENSE.txt file.
+ */
+
+// Measures time of Pregrind initialization by repeatedly
+// loading and unloading the library.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include <dlfcn.h>
+
+static double now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+int main(int argc, char **argv) {
+  if(argc < 3) {
+    fprintf(stderr, "Usage: %s LIB NUM_ITERS [LABEL=VALUE...]\n", argv[0]);
+    return 1;
+  }
+
+  const char *lib = argv[1];
+  int num_iters = atoi(argv[2]);
+
+  double total = 0;
+  int i;
+  for(i = 0; i < num_iters; ++i) {
+    double start = now();
+    void *h = dlopen(lib, RTLD_NOW | RTLD_LOCAL);
+    total += now() - start;
+    if(!h) {
+      fprintf(stderr, "init: %s\n", dlerror());
+      return 1;
+    }
+    dlclose(h);
+  }
+
+  printf("init");
+  for(i = 3; i < argc; ++i)
+    printf(" %s", argv[i]);
+  printf(" init_us=%.1f\n", total * 1e6 / num_iters);
+
+  return 0;
+}
@@ -0,0 +1,89 @@
+#!/bin/sh
+
+# Copyright 2022 Yury Gribov
+#
+# The MIT License (MIT)
+# 
+# Use of this source code is governed by MIT license that can be
+# found in the LICENSE.txt file.
+
+# Benchmark of interception overhead in exec and posix_spawn.
+# Prints one line of NAME=VALUE pairs per measurement.
+
+set -eu
+
+cd $(dirname $0)
+
+if test -n "${GITHUB_ACTIONS:-}"; then
+  set -x
+fi
+
+CFLAGS="-g -O2 -Wall -Wextra -Werror"
+
+ROOT=$PWD/../..
+LIB=$ROOT/bin/libpregrind.so
+ITERS=${ITERS:-200}
+
+${CC:-gcc} $CFLAGS bench.c -o bench
+${CC:-gcc} $CFLAGS init.c -o init -ldl
+${CC:-gcc} $CFLAGS ../argv/child.c -o child
+${CC:-gcc} $CFLAGS ../argv/valgrind.c -o valgrind
+
+TMP=$(mktemp -d)
+trap "rm -rf $TMP" EXIT INT TERM
+
+# Blacklist of N patterns which do not match anything
+gen_blacklist() {
+  seq 1 $1 | sed 's!.*!/nonexistent/&/*!'
+}
+
+# PATH with N-1 empty directories before the one with child
+gen_path() {
+  for i in $(seq 2 $1); do
+    mkdir -p $TMP/path/$i
+    printf '%s:' $TMP/path/$i
+  done
+  echo $PWD
+}
+
+for n in 0 100 10000; do
+  gen_blacklist $n > $TMP/blacklist.$n
+done
+echo '*' > $TMP/blacklist.all
+
+# Uses fake Valgrind (first in PATH) to measure only our overhead
+run() {
+  api=$1
+  args=$2
+  dirs=$3
+  bl=$4
+  labels="path_dirs=$dirs blacklist=$bl"
+  path=$(gen_path $dirs):$PATH
+  PATH=$path ./bench $api native $args $ITERS $labels
+  PATH=$path PREGRIND_DISABLE=1 LD_PRELOAD=$LIB ./bench $api disabled $args $ITERS $labels
+  PATH=$path PREGRIND_BLACKLIST=$TMP/blacklist.all LD_PRELOAD=$LIB ./bench $api blacklisted $args $ITERS $labels
+  PATH=$path PREGRIND_BLACKLIST=$TMP/blacklist.$bl LD_PRELOAD=$LIB ./bench $api instrumented $args $ITERS $labels
+}
+
+for api in spawn spawnp execv execvp; do
+  for args in 10 1000 10000; do
+    run $api $args 1 0
+  done
+done
+
+for api in spawnp execvp; do
+  for dirs in 16 64; do
+    run $api 10 $dirs 0
+  done
+done
+
+for api in spawn execv; do
+  for bl in 100 10000; do
+    run $api 10 1 $bl
+  done
+done
+
+# Constructor alone
+for bl in 0 100 10000; do
+  PREGRIND_BLACKLIST=$TMP/blacklist.$bl ./init $LIB $ITERS blacklist=$bl
+done
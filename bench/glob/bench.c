@@ -0,0 +1,138 @@
+/*
+ * Copyright 2022 Yury Gribov
+ *
+ * Use of this source code is governed by MIT license that can be
+ * found in the LICENSE.txt file.
+ */
+
+// Compares compiled blacklist matcher with naive per-pattern matching.
+
+#include "async_safe.h"
+#include "glob_set.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <unistd.h>
+
+#define NUM_QUERIES 64
+
+// Newer Glibc's do not allow linking sys_errlist to executables
+const char *const sys_errlist[1];
+
+static double now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static char *gen_pattern(unsigned i) {
+  char buf[128];
+  switch(i % 4) {
+  case 0:
+    snprintf(buf, sizeof(buf), "/usr/lib/pkg%u/bin/tool%u", i, i);
+    break;
+  case 1:
+    snprintf(buf, sizeof(buf), "/opt/vendor%u/*", i);
+    break;
+  case 2:
+    snprintf(buf, sizeof(buf), "/usr/bin/*-tool%u", i);
+    break;
+  default:
+    snprintf(buf, sizeof(buf), "*/share/pkg%u/lib?/*.so", i);
+    break;
+  }
+  return strdup(buf);
+}
+
+static char *gen_query(unsigned i, unsigned num_patterns) {
+  char buf[128];
+  unsigned j = (i * 7919u) % num_patterns;
+  switch(i % 4) {
+  case 0:
+    // Hit
+    snprintf(buf, sizeof(buf), "/usr/lib/pkg%u/bin/tool%u", j & ~3u, j & ~3u);
+    break;
+  case 1:
+    // Hit (if pattern exists)
+    snprintf(buf, sizeof(buf), "/usr/bin/x86_64-linux-gnu-tool%u", (j & ~3u) + 2);
+    break;
+  case 2:
+    snprintf(buf, sizeof(buf), "/home/user/build/tests/test_%u", i);
+    break;
+  default:
+    snprintf(buf, sizeof(buf), "/usr/bin/gcc-%u", i);
+    break;
+  }
+  return strdup(buf);
+}
+
+int main(int argc, char **argv) {
+  if(argc < 2) {
+    fprintf(stderr, "Usage: %s NUM_PATTERNS [NUM_ITERS]\n", argv[0]);
+    return 1;
+  }
+
+  unsigned num_patterns = atoi(argv[1]);
+  unsigned num_iters = argc > 2 ? (unsigned)atoi(argv[2]) : 100;
+
+  char **patterns = malloc(num_patterns * sizeof(char *));
+  GlobSet gs;
+  glob_set_init(&gs);
+  unsigned i;
+  for(i = 0; i < num_patterns; ++i) {
+    patterns[i] = gen_pattern(i);
+    glob_set_add(&gs, patterns[i]);
+  }
+  glob_set_finalize(&gs);
+
+  char *queries[NUM_QUERIES];
+  for(i = 0; i < NUM_QUERIES; ++i)
+    queries[i] = gen_query(i, num_patterns);
+
+  // Check that both matchers agree
+  for(i = 0; i < NUM_QUERIES; ++i) {
+    int naive = -1;
+    unsigned j;
+    for(j = 0; j < num_patterns && naive < 0; ++j) {
+      if(safe_fnmatch(patterns[j], queries[i]))
+        naive = j;
+    }
+    int compiled = glob_set_match(&gs, queries[i], STDERR_FILENO);
+    if(naive != compiled) {
+      fprintf(stderr, "mismatch on %s: naive %d, compiled %d\n", queries[i], naive, compiled);
+      return 1;
+    }
+  }
+
+  volatile int sink = 0;
+
+  double start = now();
+  unsigned iter;
+  for(iter = 0; iter < num_iters; ++iter) {
+    for(i = 0; i < NUM_QUERIES; ++i) {
+      unsigned j;
+      for(j = 0; j < num_patterns; ++j) {
+        if(safe_fnmatch(patterns[j], queries[i])) {
+          ++sink;
+          break;
+        }
+      }
+    }
+  }
+  double naive_ns = (now() - start) * 1e9 / (num_iters * NUM_QUERIES);
+
+  start = now();
+  for(iter = 0; iter < num_iters; ++iter) {
+    for(i = 0; i < NUM_QUERIES; ++i)
+      sink += glob_set_match(&gs, queries[i], STDERR_FILENO) >= 0;
+  }
+  double compiled_ns = (now() - start) * 1e9 / (num_iters * NUM_QUERIES);
+
+  printf("glob patterns=%u nodes=%u naive_ns=%.0f compiled_ns=%.0f speedup=%.1f\n",
+         num_patterns, gs.num_nodes, naive_ns, compiled_ns, naive_ns / compiled_ns);
+
+  return 0;
+}
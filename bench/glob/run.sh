@@ -0,0 +1,28 @@
+#!/bin/sh
+
+# Copyright 2022 Yury Gribov
+#
+# The MIT License (MIT)
+# 
+# Use of this source code is governed by MIT license that can be
+# found in the LICENSE.txt file.
+
+# Benchmark of blacklist matching.
+
+set -eu
+
+cd $(dirname $0)
+
+if test -n "${GITHUB_ACTIONS:-}"; then
+  set -x
+fi
+
+CFLAGS="-g -O2 -Wall -Wextra -Werror -D_GNU_SOURCE"
+
+ROOT=$PWD/../..
+
+${CC:-gcc} $CFLAGS -I$ROOT/src bench.c $ROOT/src/glob_set.c $ROOT/src/async_safe.c -o bench
+
+for n in 10 1000 10000; do
+  ./bench $n
+done
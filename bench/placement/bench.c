@@ -0,0 +1,83 @@
+/*
+ * Copyright 2022 Yury Gribov
+ *
+ * Use of this source code is governed by MIT license that can be
+ * found in the LICENSE.txt file.
+ */
+
+// Starts many CPU-bound instrumented jobs and, concurrently with them,
+// a sequence of uninstrumented ones which model critical path
+// of the build. Measures throughput of instrumented jobs
+// and latency of critical path.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <unistd.h>
+#include <spawn.h>
+#include <sys/wait.h>
+
+extern char **environ;
+
+static double now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static pid_t start(const char *prog, const char *ms) {
+  char *argv[] = { (char *)prog, (char *)ms, NULL };
+  pid_t pid;
+  if(0 != posix_spawn(&pid, prog, NULL, NULL, argv, environ)) {
+    perror("bench: failed to spawn child");
+    exit(1);
+  }
+  return pid;
+}
+
+static void wait_child(pid_t pid) {
+  int wstatus;
+  if(waitpid(pid, &wstatus, 0) < 0 || !WIFEXITED(wstatus) || WEXITSTATUS(wstatus)) {
+    fprintf(stderr, "bench: child failed\n");
+    exit(1);
+  }
+}
+
+int main(int argc, char **argv) {
+  if(argc < 5) {
+    fprintf(stderr, "Usage: %s NUM_JOBS JOB_MS NUM_STEPS STEP_MS [LABEL=VALUE...]\n", argv[0]);
+    return 1;
+  }
+
+  int num_jobs = atoi(argv[1]);
+  const char *job_ms = argv[2];
+  int num_steps = atoi(argv[3]);
+  const char *step_ms = argv[4];
+
+  pid_t *pids = malloc(num_jobs * sizeof(pid_t));
+
+  double start_time = now();
+
+  int i;
+  for(i = 0; i < num_jobs; ++i)
+    pids[i] = start("./spin", job_ms);
+
+  // Critical path runs natively (binary is blacklisted)
+  for(i = 0; i < num_steps; ++i)
+    wait_child(start("./critical", step_ms));
+  double critical_time = now() - start_time;
+
+  for(i = 0; i < num_jobs; ++i)
+    wait_child(pids[i]);
+  double elapsed = now() - start_time;
+
+  printf("placement jobs=%d job_ms=%s steps=%d step_ms=%s", num_jobs, job_ms, num_steps, step_ms);
+  for(i = 5; i < argc; ++i)
+    printf(" %s", argv[i]);
+  printf(" critical_ms=%.1f total_ms=%.1f jobs_per_s=%.2f\n",
+         critical_time * 1e3, elapsed * 1e3, num_jobs / elapsed);
+
+  return 0;
+}
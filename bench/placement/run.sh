@@ -0,0 +1,63 @@
+#!/bin/sh
+
+# Copyright 2022 Yury Gribov
+#
+# The MIT License (MIT)
+# 
+# Use of this source code is governed by MIT license that can be
+# found in the LICENSE.txt file.
+
+# Benchmark of placement policies (PREGRIND_PLACEMENT, PREGRIND_NICE, etc.):
+# throughput of CPU-bound instrumented jobs and latency of uninstrumented
+# critical path which runs concurrently with them. Results are only
+# meaningful on many-core hosts.
+# Prints one line of NAME=VALUE pairs per measurement.
+
+set -eu
+
+cd $(dirname $0)
+
+if test -n "${GITHUB_ACTIONS:-}"; then
+  set -x
+fi
+
+CFLAGS="-g -O2 -Wall -Wextra -Werror"
+
+ROOT=$PWD/../..
+LIB=$ROOT/bin/libpregrind.so
+NCPU=$(nproc)
+JOBS=${JOBS:-$((2 * NCPU))}
+JOB_MS=${JOB_MS:-500}
+STEPS=${STEPS:-20}
+STEP_MS=${STEP_MS:-20}
+
+${CC:-gcc} $CFLAGS bench.c -o bench
+${CC:-gcc} $CFLAGS spin.c -o spin
+cp spin critical
+${CC:-gcc} $CFLAGS ../argv/valgrind.c -o valgrind
+
+TMP=$(mktemp -d)
+trap "rm -rf $TMP" EXIT INT TERM
+
+echo '*/critical' > $TMP/blacklist
+
+# Fake Valgrind (first in PATH) runs jobs natively
+# so only effects of scheduling are measured
+run() {
+  labels="cpus=$NCPU $1"
+  shift
+  env PATH=$PWD:$PATH PREGRIND_STATE_DIR=$TMP PREGRIND_BLACKLIST=$TMP/blacklist "$@" \
+    LD_PRELOAD=$LIB ./bench $JOBS $JOB_MS $STEPS $STEP_MS $labels
+}
+
+run mode=none
+run mode=rr PREGRIND_PLACEMENT=rr
+run mode=least-loaded PREGRIND_PLACEMENT=least-loaded
+run mode=nice PREGRIND_NICE=10
+run mode=nice+idle PREGRIND_NICE=10 PREGRIND_IONICE=idle
+run mode=least-loaded+nice PREGRIND_PLACEMENT=least-loaded PREGRIND_NICE=10
+
+# Leave one CPU for uninstrumented processes
+if test $NCPU -gt 1; then
+  run mode=least-loaded+reserved PREGRIND_PLACEMENT=least-loaded PREGRIND_CPUS=1-$((NCPU - 1))
+fi
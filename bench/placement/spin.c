@@ -0,0 +1,35 @@
+/*
+ * Copyright 2022 Yury Gribov
+ *
+ * Use of this source code is governed by MIT license that can be
+ * found in the LICENSE.txt file.
+ */
+
+// Burns given amount of CPU time (in milliseconds).
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+static double cpu_time() {
+  struct timespec ts;
+  clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+int main(int argc, char **argv) {
+  if(argc < 2) {
+    fprintf(stderr, "Usage: %s MS\n", argv[0]);
+    return 1;
+  }
+
+  double end = cpu_time() + atoi(argv[1]) * 1e-3;
+  volatile unsigned long x = 0;
+  while(cpu_time() < end) {
+    int i;
+    for(i = 0; i < 10000; ++i)
+      ++x;
+  }
+
+  return 0;
+}
@@ -0,0 +1,58 @@
+/*
+ * Copyright 2022 Yury Gribov
+ *
+ * Use of this source code is governed by MIT license that can be
+ * found in the LICENSE.txt file.
+ */
+
+// Shell-heavy workload: runs commands via `sh -c` like build systems do.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <unistd.h>
+#include <spawn.h>
+#include <sys/wait.h>
+
+extern char **environ;
+
+static double now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+int main(int argc, char **argv) {
+  if(argc < 4) {
+    fprintf(stderr, "Usage: %s MODE NUM_ITERS COMMAND\n", argv[0]);
+    return 1;
+  }
+
+  const char *mode = argv[1];
+  int num_iters = atoi(argv[2]);
+  char *cmd = argv[3];
+
+  char *sh_argv[] = { "sh", "-c", cmd, NULL };
+
+  double start = now();
+  int i;
+  for(i = 0; i < num_iters; ++i) {
+    pid_t pid;
+    if(0 != posix_spawn(&pid, "/bin/sh", NULL, NULL, sh_argv, environ)) {
+      perror("bench: failed to spawn shell");
+      return 1;
+    }
+    int wstatus;
+    if(waitpid(pid, &wstatus, 0) < 0 || !WIFEXITED(wstatus) || WEXITSTATUS(wstatus)) {
+      fprintf(stderr, "bench: command failed\n");
+      return 1;
+    }
+  }
+  double us = (now() - start) * 1e6 / num_iters;
+
+  printf("shell mode=%s cmd='%s' latency_us=%.1f\n", mode, cmd, us);
+
+  return 0;
+}
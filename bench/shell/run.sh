@@ -0,0 +1,38 @@
+#!/bin/sh
+
+# Copyright 2022 Yury Gribov
+#
+# The MIT License (MIT)
+# 
+# Use of this source code is governed by MIT license that can be
+# found in the LICENSE.txt file.
+
+# Benchmark of PREGRIND_SHELL_BYPASS on `sh -c` workload.
+
+set -eu
+
+cd $(dirname $0)
+
+if test -n "${GITHUB_ACTIONS:-}"; then
+  set -x
+fi
+
+CFLAGS="-g -O2 -Wall -Wextra -Werror"
+
+ROOT=$PWD/../..
+LIB=$ROOT/bin/libpregrind.so
+ITERS=${ITERS:-100}
+
+${CC:-gcc} $CFLAGS bench.c -o bench
+${CC:-gcc} $CFLAGS ../argv/child.c -o child
+${CC:-gcc} $CFLAGS ../argv/valgrind.c -o valgrind
+
+# Use fake Valgrind with startup delay to emulate real one
+export PATH=$PWD:$PATH
+export STUB_DELAY_US=${STUB_DELAY_US:-20000}
+
+for cmd in './child a b' './child a b && ./child c'; do
+  ./bench native $ITERS "$cmd"
+  LD_PRELOAD=$LIB ./bench instrumented $ITERS "$cmd"
+  PREGRIND_SHELL_BYPASS=1 LD_PRELOAD=$LIB ./bench bypass $ITERS "$cmd"
+done
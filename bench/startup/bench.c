@@ -0,0 +1,73 @@
+/*
+ * Copyright 2022 Yury Gribov
+ *
+ * Use of this source code is governed by MIT license that can be
+ * found in the LICENSE.txt file.
+ */
+
+// Measures startup time of processes which do not exec anything
+// (i.e. only pay for Pregrind constructor) by spawning a trivial
+// child with Pregrind preloaded.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <unistd.h>
+#include <sys/wait.h>
+#include <spawn.h>
+
+extern char **environ;
+
+static double now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+int main(int argc, char **argv) {
+  if(argc < 4) {
+    fprintf(stderr, "Usage: %s LIB|- CHILD NUM_ITERS [LABEL=VALUE...]\n", argv[0]);
+    return 1;
+  }
+
+  const char *lib = argv[1];
+  char *child = argv[2];
+  int num_iters = atoi(argv[3]);
+
+  // Preload only to child so that we do not measure ourselves
+  size_t n;
+  for(n = 0; environ[n]; ++n);
+  char **envp = malloc((n + 2) * sizeof(char *));
+  memcpy(envp, environ, n * sizeof(char *));
+  char preload[4096];
+  snprintf(preload, sizeof(preload), "LD_PRELOAD=%s", lib);
+  envp[n] = strcmp(lib, "-") ? preload : NULL;
+  envp[n + 1] = NULL;
+
+  char *child_argv[] = {child, NULL};
+
+  double start = now();
+  int i;
+  for(i = 0; i < num_iters; ++i) {
+    pid_t pid;
+    if(0 != posix_spawn(&pid, child, NULL, NULL, child_argv, envp)) {
+      perror("bench: posix_spawn");
+      return 1;
+    }
+    int status;
+    if(waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status)) {
+      fprintf(stderr, "bench: child failed\n");
+      return 1;
+    }
+  }
+  double total = now() - start;
+
+  printf("startup");
+  for(i = 4; i < argc; ++i)
+    printf(" %s", argv[i]);
+  printf(" process_us=%.1f\n", total * 1e6 / num_iters);
+
+  return 0;
+}
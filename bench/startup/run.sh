@@ -0,0 +1,85 @@
+#!/bin/sh
+
+# Copyright 2022 Yury Gribov
+#
+# The MIT License (MIT)
+# 
+# Use of this source code is governed by MIT license that can be
+# found in the LICENSE.txt file.
+
+# Benchmark of startup overhead for processes which do not exec
+# (configuration from environment vs. precompiled PREGRIND_CONFIG)
+# and for instrumented processes (started by fake Valgrind launcher
+# or fake tool directly).
+# Prints one line of NAME=VALUE pairs per measurement.
+
+set -eu
+
+cd $(dirname $0)
+
+if test -n "${GITHUB_ACTIONS:-}"; then
+  set -x
+fi
+
+CFLAGS="-g -O2 -Wall -Wextra -Werror"
+
+ROOT=$PWD/../..
+LIB=$ROOT/bin/libpregrind.so
+ITERS=${ITERS:-500}
+
+${CC:-gcc} $CFLAGS bench.c -o bench
+${CC:-gcc} $CFLAGS ../exec/init.c -o init -ldl
+${CC:-gcc} $CFLAGS ../argv/child.c -o child
+${CC:-gcc} $CFLAGS ../argv/valgrind.c -o valgrind
+
+TMP=$(mktemp -d)
+trap "rm -rf $TMP" EXIT INT TERM
+
+# Blacklist of N patterns which do not match anything
+gen_blacklist() {
+  seq 1 $1 | sed 's!.*!/nonexistent/&/*!'
+}
+
+# Policy of N rules
+gen_policy() {
+  seq 1 $1 | sed 's!.*!/nonexistent/&/* --leak-check=no --undef-value-errors=no!'
+}
+
+FLAGS='-q --error-exitcode=1 --track-origins=yes'
+
+# Fake tool for direct start
+case $(uname -m) in
+  x86_64) PLATFORM=amd64-linux ;;
+  aarch64) PLATFORM=arm64-linux ;;
+  *) PLATFORM= ;;
+esac
+mkdir $TMP/lib
+if test -n "$PLATFORM"; then
+  cp valgrind $TMP/lib/memcheck-$PLATFORM
+fi
+
+./bench - ./child $ITERS mode=native
+
+for n in 0 100 10000; do
+  gen_blacklist $n > $TMP/blacklist.$n
+  gen_policy $n > $TMP/policy.$n
+  $ROOT/bin/pregrind-compile -f "$FLAGS" -b $TMP/blacklist.$n -p $TMP/policy.$n $TMP/config.$n
+
+  labels="rules=$n"
+  PREGRIND_FLAGS="$FLAGS" PREGRIND_BLACKLIST=$TMP/blacklist.$n PREGRIND_POLICY=$TMP/policy.$n \
+    ./bench $LIB ./child $ITERS mode=env $labels
+  PREGRIND_CONFIG=$TMP/config.$n ./bench $LIB ./child $ITERS mode=compiled $labels
+  PREGRIND_FLAGS="$FLAGS" PREGRIND_BLACKLIST=$TMP/blacklist.$n PREGRIND_POLICY=$TMP/policy.$n \
+    ./init $LIB $ITERS mode=env $labels
+  PREGRIND_CONFIG=$TMP/config.$n ./init $LIB $ITERS mode=compiled $labels
+
+  # Child is instrumented by preloaded benchmark
+  PREGRIND_FLAGS="$FLAGS" PREGRIND_BLACKLIST=$TMP/blacklist.$n PREGRIND_POLICY=$TMP/policy.$n \
+  PREGRIND_VALGRIND=$PWD/valgrind LD_PRELOAD=$LIB \
+    ./bench - ./child $ITERS mode=guest $labels
+  if test -n "$PLATFORM"; then
+    PREGRIND_FLAGS="$FLAGS" PREGRIND_BLACKLIST=$TMP/blacklist.$n PREGRIND_POLICY=$TMP/policy.$n \
+    PREGRIND_VALGRIND=$PWD/valgrind PREGRIND_VALGRIND_LIB=$TMP/lib LD_PRELOAD=$LIB \
+      ./bench - ./child $ITERS mode=guest-direct $labels
+  fi
+done
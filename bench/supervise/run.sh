@@ -0,0 +1,52 @@
+#!/bin/sh
+
+# Copyright 2022 Yury Gribov
+#
+# The MIT License (MIT)
+# 
+# Use of this source code is governed by MIT license that can be
+# found in the LICENSE.txt file.
+
+# Benchmark of exec overhead in preload and supervisor modes.
+# Prints one line of NAME=VALUE pairs per measurement.
+
+set -eu
+
+cd $(dirname $0)
+
+if test -n "${GITHUB_ACTIONS:-}"; then
+  set -x
+fi
+
+if test $(uname -m) != x86_64; then
+  echo "Supervisor mode is only supported on x86_64"
+  exit 0
+fi
+
+CFLAGS="-g -O2 -Wall -Wextra -Werror"
+
+ROOT=$PWD/../..
+LIB=$ROOT/bin/libpregrind.so
+ITERS=${ITERS:-200}
+
+${CC:-gcc} $CFLAGS ../exec/bench.c -o bench
+${CC:-gcc} $CFLAGS ../argv/child.c -o child
+${CC:-gcc} $CFLAGS ../argv/valgrind.c -o valgrind
+
+TMP=$(mktemp -d)
+trap "rm -rf $TMP" EXIT INT TERM
+
+echo '*' > $TMP/blacklist.all
+
+# Use fake Valgrind (first in PATH) to measure only our overhead
+export PATH=$PWD:$PATH
+
+for api in spawn execv; do
+  for args in 10 1000; do
+    ./bench $api native $args $ITERS
+    PREGRIND_BLACKLIST=$TMP/blacklist.all LD_PRELOAD=$LIB ./bench $api preload-skip $args $ITERS
+    PREGRIND_BLACKLIST=$TMP/blacklist.all $ROOT/bin/pregrind-supervise ./bench $api supervisor-skip $args $ITERS
+    LD_PRELOAD=$LIB ./bench $api preload $args $ITERS
+    $ROOT/bin/pregrind-supervise ./bench $api supervisor $args $ITERS
+  done
+done
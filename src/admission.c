@@ -0,0 +1,222 @@
+/*
+ * Copyright 2022 Yury Gribov
+ *
+ * Use of this source code is governed by MIT license that can be
+ * found in the LICENSE.txt file.
+ */
+
+#include "admission.h"
+#include "async_safe.h"
+#include "common.h"
+#include "shm.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+// How often to check for free slots when waiting
+#define POLL_INTERVAL_MS 50
+
+static AdmissionConfig config;
+static unsigned num_slots;
+static char slots_path[256];
+static dev_t slots_dev;
+static ino_t slots_ino;
+static int inherited_slot_fd = -1;
+static char cgroup_dir[256];
+
+// Async-safe reading of small files
+static ssize_t read_file(const char *path, char *buf, size_t buf_sz) {
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if(fd < 0)
+    return -1;
+  ssize_t n = read(fd, buf, buf_sz - 1);
+  close(fd);
+  if(n < 0)
+    return -1;
+  buf[n] = 0;
+  return n;
+}
+
+// Returns value of /proc/meminfo field in megabytes or 0 on error
+static uint64_t read_meminfo_mb(const char *field) {
+  char buf[4096];
+  if(read_file("/proc/meminfo", buf, sizeof(buf)) < 0)
+    return 0;
+  const char *s = strstr(buf, field);
+  return s ? strtoull(s + strlen(field), NULL, 10) / 1024 : 0;
+}
+
+// Returns value of cgroup file in megabytes or 0 if there is no limit or on error
+static uint64_t read_cgroup_mb(const char *name) {
+  if(!cgroup_dir[0])
+    return 0;
+  char path[512], buf[64];
+  snprintf(path, sizeof(path), "%s/%s", cgroup_dir, name);
+  if(read_file(path, buf, sizeof(buf)) <= 0 || 0 == strncmp(buf, "max", 3))
+    return 0;
+  return strtoull(buf, NULL, 10) >> 20;
+}
+
+static uint64_t get_available_mb() {
+  uint64_t avail = read_meminfo_mb("MemAvailable:");
+  uint64_t cg_max = read_cgroup_mb("memory.max");
+  if(cg_max) {
+    uint64_t cg_cur = read_cgroup_mb("memory.current");
+    uint64_t cg_avail = cg_max > cg_cur ? cg_max - cg_cur : 0;
+    if(cg_avail < avail)
+      avail = cg_avail;
+  }
+  return avail;
+}
+
+static void find_cgroup() {
+  // Only cgroup v2 is supported
+  char buf[512];
+  if(read_file("/proc/self/cgroup", buf, sizeof(buf)) <= 0)
+    return;
+  char *s = strstr(buf, "0::");
+  if(!s)
+    return;
+  s += 3;
+  char *nl = strchr(s, '\n');
+  if(nl)
+    *nl = 0;
+  snprintf(cgroup_dir, sizeof(cgroup_dir), "/sys/fs/cgroup%s", s);
+}
+
+void admission_init(const AdmissionConfig *cfg, int verbose, int error_fd) {
+  config = *cfg;
+
+  if(!state_dir) {
+    safe_fprintf(error_fd, PREFIX "admission control needs state directory, disabling\n");
+    return;
+  }
+
+  find_cgroup();
+
+  num_slots = config.max_jobs;
+  if(!num_slots) {
+    long num_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    uint64_t total_mb = read_meminfo_mb("MemTotal:");
+    uint64_t cg_max = read_cgroup_mb("memory.max");
+    if(cg_max && cg_max < total_mb)
+      total_mb = cg_max;
+    uint64_t mem_jobs = config.job_mem_mb ? total_mb / config.job_mem_mb : 0;
+    num_slots = num_cpus > 0 ? num_cpus : 1;
+    if(mem_jobs && mem_jobs < num_slots)
+      num_slots = mem_jobs;
+    if(!num_slots)
+      num_slots = 1;
+  }
+
+  snprintf(slots_path, sizeof(slots_path), "%s/slots.%d", state_dir, (int)getuid());
+
+  int fd = open(slots_path, O_RDWR | O_CREAT | O_CLOEXEC, S_IRUSR | S_IWUSR);
+  struct stat st;
+  if(fd < 0 || 0 != fstat(fd, &st)) {
+    safe_fprintf(error_fd, PREFIX "failed to open %s: %s\n", slots_path, sys_errlist[errno]);
+    slots_path[0] = 0;
+    if(fd >= 0)
+      close(fd);
+    return;
+  }
+  close(fd);
+  slots_dev = st.st_dev;
+  slots_ino = st.st_ino;
+
+  // Check if we have been started as instrumented process
+  const char *slot_fd_str = getenv(SLOT_FD_VAR);
+  if(slot_fd_str) {
+    int slot_fd = atoi(slot_fd_str);
+    // Descriptor is passed without FD_CLOEXEC because this would release
+    // the slot when Valgrind launcher execs the tool but our
+    // uninstrumented children should not hold it
+    if(0 == fstat(slot_fd, &st) && st.st_dev == slots_dev && st.st_ino == slots_ino) {
+      fcntl(slot_fd, F_SETFD, FD_CLOEXEC);
+      inherited_slot_fd = slot_fd;
+    }
+  }
+
+  if(verbose)
+    safe_fprintf(error_fd, PREFIX "admission control: %u slots, inherited slot fd %d\n", num_slots, inherited_slot_fd);
+}
+
+// Returns new descriptor which holds free slot or -1
+static int try_lock_slot() {
+  int fd = open(slots_path, O_RDWR | O_CLOEXEC);
+  if(fd < 0)
+    return -1;
+
+  unsigned i;
+  for(i = 0; i < num_slots; ++i) {
+    struct flock fl;
+    memset(&fl, 0, sizeof(fl));
+    fl.l_type = F_WRLCK;
+    fl.l_whence = SEEK_SET;
+    fl.l_start = i;
+    fl.l_len = 1;
+    if(0 == fcntl(fd, F_OFD_SETLK, &fl))
+      return fd;
+  }
+
+  close(fd);
+  return -1;
+}
+
+int admission_acquire(int *slot_fd, const char **reason, int error_fd) {
+  *slot_fd = -1;
+
+  if(!slots_path[0])
+    return 1;
+
+  int waiting = 0;
+  while(1) {
+    if(config.job_mem_mb && get_available_mb() < config.job_mem_mb) {
+      *reason = "not enough memory";
+    } else {
+      *slot_fd = try_lock_slot();
+      if(*slot_fd >= 0)
+        return 1;
+      *reason = "too many instrumented processes";
+    }
+
+    if(inherited_slot_fd >= 0) {
+      // Share parent's slot
+      *slot_fd = fcntl(inherited_slot_fd, F_DUPFD_CLOEXEC, 0);
+      return *slot_fd >= 0;
+    }
+
+    if(config.action == OVER_LIMIT_SKIP)
+      return 0;
+
+    if(!waiting) {
+      safe_fprintf(error_fd, PREFIX "waiting for free slot: %s\n", *reason);
+      waiting = 1;
+    }
+
+    struct timespec ts = { 0, POLL_INTERVAL_MS * 1000000l };
+    nanosleep(&ts, NULL);
+  }
+}
+
+void admission_pass(int slot_fd) {
+  if(slot_fd >= 0)
+    fcntl(slot_fd, F_SETFD, 0);
+}
+
+void admission_keep(int slot_fd) {
+  if(slot_fd >= 0)
+    fcntl(slot_fd, F_SETFD, FD_CLOEXEC);
+}
+
+void admission_release(int slot_fd) {
+  if(slot_fd >= 0)
+    close(slot_fd);
+}
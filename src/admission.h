@@ -0,0 +1,57 @@
+/*
+ * Copyright 2022 Yury Gribov
+ *
+ * Use of this source code is governed by MIT license that can be
+ * found in the LICENSE.txt file.
+ */
+
+#ifndef ADMISSION_H
+#define ADMISSION_H
+
+// Limits number of concurrently running instrumented processes.
+//
+// Each instrumented process holds a slot: an OFD lock on a byte
+// of slots file in state directory. Lock is inherited by Valgrind
+// across exec and released by kernel when process dies.
+
+typedef enum {
+  OVER_LIMIT_WAIT,
+  OVER_LIMIT_SKIP,
+} OverLimitAction;
+
+typedef struct {
+  unsigned max_jobs;        // 0 to compute from CPU and memory limits
+  unsigned job_mem_mb;      // Memory reserved for each instrumented process
+  OverLimitAction action;
+} AdmissionConfig;
+
+// Environment variable which tells instrumented process which slot it holds
+#define SLOT_FD_VAR "PREGRIND_SLOT_FD"
+
+// Not async-safe, call at startup
+void admission_init(const AdmissionConfig *cfg, int verbose, int error_fd);
+
+// Returns 0 and reason if process should not be instrumented.
+// Otherwise *slot_fd is set to descriptor (with FD_CLOEXEC) which should
+// be inherited by Valgrind (or -1 if admission control is disabled).
+//
+// Processes which already hold a slot (i.e. instrumented process
+// starts instrumented child) never wait: if there are no free slots,
+// child shares parent's one. Otherwise parents would deadlock
+// waiting for their children.
+int admission_acquire(int *slot_fd, const char **reason, int error_fd);
+
+// Async-safe. Makes slot descriptor inheritable, call right before
+// execve of Valgrind (so that other children do not hold it).
+// Posix_spawn should instead make it inheritable only in child
+// via file actions.
+void admission_pass(int slot_fd);
+
+// Async-safe. Makes slot descriptor FD_CLOEXEC again if exec failed.
+void admission_keep(int slot_fd);
+
+// Closes our copy of slot descriptor (after child has been started
+// or if it failed to start)
+void admission_release(int slot_fd);
+
+#endif
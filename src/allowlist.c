@@ -0,0 +1,152 @@
+/*
+ * Copyright 2022 Yury Gribov
+ *
+ * Use of this source code is governed by MIT license that can be
+ * found in the LICENSE.txt file.
+ */
+
+#include "allowlist.h"
+#include "async_safe.h"
+#include "common.h"
+#include "config_file.h"
+#include "glob_set.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include <unistd.h>
+
+_Static_assert(ALLOW_MAX == sizeof(((ConfigBlob *)0)->allow_ids) / sizeof(uint32_t),
+               "ConfigBlob does not match AllowKind");
+
+static const char *const prefixes[ALLOW_MAX] = {
+  "path:",
+  "argv:",
+  "cwd:",
+  "env:",
+};
+
+void allowlist_compile(BlobWriter *w, ConfigBlob *h, const char *name, int error_fd) {
+  FILE *p = config_open(name, "allowlist", error_fd);
+
+  // Predicates are split between automatons so we need to map
+  // pattern ids back to predicates
+  GlobSet matchers[ALLOW_MAX];
+  uint32_t *ids[ALLOW_MAX];
+  unsigned k;
+  for(k = 0; k < ALLOW_MAX; ++k) {
+    glob_set_init(&matchers[k]);
+    ids[k] = NULL;
+  }
+
+  char **preds = NULL;
+  char *buf = NULL, *s;
+  size_t buf_size = 0;
+  unsigned num_preds = 0, max_preds = 0;
+  while((s = config_next_line(p, &buf, &buf_size))) {
+    if(num_preds == max_preds) {
+      max_preds = max_preds ? 2 * max_preds : 16;
+      preds = realloc(preds, max_preds * sizeof(char *));
+      assert(preds && "Failed to allocate allowlist");
+      for(k = 0; k < ALLOW_MAX; ++k) {
+        ids[k] = realloc(ids[k], max_preds * sizeof(uint32_t));
+        assert(ids[k] && "Failed to allocate allowlist");
+      }
+    }
+
+    const char *pattern = s;
+    AllowKind kind = ALLOW_PATH;
+    for(k = 0; k < ALLOW_MAX; ++k) {
+      size_t len = strlen(prefixes[k]);
+      if(0 == strncmp(s, prefixes[k], len)) {
+        kind = k;
+        pattern = s + len;
+        break;
+      }
+    }
+
+    if(kind == ALLOW_ENV && (pattern[0] == '=' || !strchr(pattern, '='))) {
+      dprintf(safe_resolve_fd(error_fd), PREFIX "failed to read allowlist %s: expected NAME=PATTERN in '%s'\n", name, s);
+      abort();
+    }
+
+    preds[num_preds] = strdup(s);
+    ids[kind][glob_set_add(&matchers[kind], pattern)] = num_preds;
+    ++num_preds;
+  }
+
+  free(buf);
+  fclose(p);
+
+  h->num_allowlist = num_preds;
+  h->allowlist = blob_add_strs(w, preds, num_preds);
+  for(k = 0; k < ALLOW_MAX; ++k) {
+    glob_set_finalize(&matchers[k]);
+    h->allow_ids[k] = blob_add(w, ids[k], matchers[k].num_patterns * sizeof(uint32_t));
+    h->allow_matchers[k] = blob_add_glob_set(w, &matchers[k]);
+    free(ids[k]);
+    glob_set_destroy(&matchers[k]);
+  }
+
+  unsigned i;
+  for(i = 0; i < num_preds; ++i)
+    free(preds[i]);
+  free(preds);
+}
+
+static int enabled;
+static const uint32_t *ids[ALLOW_MAX];
+static GlobSet matchers[ALLOW_MAX];
+
+void allowlist_init(const ConfigBlob *b) {
+  if(!b->num_allowlist)
+    return;
+
+  enabled = 1;
+  unsigned k;
+  for(k = 0; k < ALLOW_MAX; ++k) {
+    ids[k] = blob_ptr(b, b->allow_ids[k]);
+    blob_glob_set(b, &b->allow_matchers[k], &matchers[k]);
+  }
+}
+
+int allowlist_enabled() {
+  return enabled;
+}
+
+// Updates best with predicate which matched any of strings
+static void match_strings(AllowKind kind, char *const *strs, int *best, int error_fd) {
+  if(glob_set_empty(&matchers[kind]) || !strs)
+    return;
+  for(; strs[0]; ++strs) {
+    int id = glob_set_match(&matchers[kind], strs[0], error_fd);
+    if(id >= 0 && (*best < 0 || (int)ids[kind][id] < *best))
+      *best = ids[kind][id];
+  }
+}
+
+int allowlist_match(const char *path, char *const *argv, char *const *envp, const char *cwd, int error_fd) {
+  int best = -1;
+
+  int id = glob_set_match(&matchers[ALLOW_PATH], path, error_fd);
+  if(id >= 0)
+    best = ids[ALLOW_PATH][id];
+
+  match_strings(ALLOW_ARGV, argv, &best, error_fd);
+  match_strings(ALLOW_ENV, envp, &best, error_fd);
+
+  if(!glob_set_empty(&matchers[ALLOW_CWD])) {
+    char cwd_buf[4096];
+    if(!cwd)
+      cwd = getcwd(cwd_buf, sizeof(cwd_buf));
+    if(cwd) {
+      id = glob_set_match(&matchers[ALLOW_CWD], cwd, error_fd);
+      if(id >= 0 && (best < 0 || (int)ids[ALLOW_CWD][id] < best))
+        best = ids[ALLOW_CWD][id];
+    }
+  }
+
+  return best;
+}
@@ -0,0 +1,46 @@
+/*
+ * Copyright 2022 Yury Gribov
+ *
+ * Use of this source code is governed by MIT license that can be
+ * found in the LICENSE.txt file.
+ */
+
+#ifndef ALLOWLIST_H
+#define ALLOWLIST_H
+
+#include "config_blob.h"
+
+// Restricts instrumentation to selected processes.
+//
+// Allowlist file consists of predicates (one per line)
+//   [path:]PATTERN     - path of executable
+//   argv:PATTERN       - any of its arguments
+//   cwd:PATTERN        - current directory
+//   env:NAME=PATTERN   - environment variable
+// where PATTERN is a wildcard. Process is instrumented only
+// if it matches at least one predicate.
+//
+// Patterns of each kind are compiled into a separate automaton
+// (see glob_set.h) and stored in compiled configuration.
+
+typedef enum {
+  ALLOW_PATH,
+  ALLOW_ARGV,
+  ALLOW_CWD,
+  ALLOW_ENV,
+  ALLOW_MAX
+} AllowKind;
+
+// Parses allowlist file into configuration (or aborts)
+void allowlist_compile(BlobWriter *w, ConfigBlob *h, const char *name, int error_fd);
+
+// Not async-safe, call at startup
+void allowlist_init(const ConfigBlob *b);
+
+int allowlist_enabled();
+
+// Returns index of first matching predicate or -1.
+// Cwd is directory of process (NULL if it's ours).
+int allowlist_match(const char *path, char *const *argv, char *const *envp, const char *cwd, int error_fd);
+
+#endif
@@ -17,7 +17,20 @@
 #include <errno.h>
 #include <string.h>
 
+static int (*get_lazy_log_fd)(void);
+
+void safe_set_lazy_log(int (*get_fd)(void)) {
+  get_lazy_log_fd = get_fd;
+}
+
+int safe_resolve_fd(int fd) {
+  if(fd != LAZY_LOG_FD)
+    return fd;
+  return get_lazy_log_fd ? get_lazy_log_fd() : STDERR_FILENO;
+}
+
 void safe_fputs(int fd, const char *s) {
+  fd = safe_resolve_fd(fd);
   ssize_t written, rem = strlen(s);
   while(rem) {
     written = write(fd, s, rem);
@@ -48,17 +61,103 @@ void safe_free(void *p, int error_fd) {
   }
 }
 
-char *safe_strdup(const char *s, int error_fd) {
-  char *ss = safe_malloc(strlen(s) + 1, error_fd);
-  strcpy(ss, s);
+// Arena only reserves address space so it can be large
+static size_t arena_size = 64 * 1024 * 1024;
+
+void safe_arena_set_size(size_t size) {
+  arena_size = (size + PAGE_SIZE - 1) & ~(uintptr_t)(PAGE_SIZE - 1);
+}
+
+void *safe_arena_alloc(SafeArena *a, size_t n, int error_fd) {
+  if(!a->base) {
+    void *p = mmap(0, arena_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if(p == MAP_FAILED) {
+      safe_fprintf(error_fd, PREFIX "safe_arena_alloc() failed to reserve %zd bytes: %s\n", arena_size, sys_errlist[errno]);
+      abort();
+    }
+    a->base = p;
+    a->used = 0;
+  }
+
+  n = (n + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
+  if(n > arena_size - a->used) {
+    safe_fprintf(error_fd, PREFIX "safe_arena_alloc() failed to allocate %zd bytes: arena exhausted\n", n);
+    abort();
+  }
+
+  void *ret = a->base + a->used;
+  a->used += n;
+  return ret;
+}
+
+char *safe_arena_strdup(SafeArena *a, const char *s, int error_fd) {
+  size_t n = strlen(s) + 1;
+  char *ss = safe_arena_alloc(a, n, error_fd);
+  memcpy(ss, s, n);
   return ss;
 }
 
-char *safe_basename(char *f) {
-  char *sep = strrchr(f, '/');
+void safe_arena_free(SafeArena *a, int error_fd) {
+  if(a->base && 0 != munmap(a->base, arena_size)) {
+    safe_fprintf(error_fd, PREFIX "safe_arena_free() failed to unmap memory at 0x%p\n", a->base);
+    abort();
+  }
+  a->base = NULL;
+  a->used = 0;
+}
+
+const char *safe_basename(const char *f) {
+  const char *sep = strrchr(f, '/');
   return sep ? sep + 1 : f;
 }
 
+char *safe_append(char *dst, const char *end, const char *s) {
+  for(; *s && dst + 1 < end; ++dst, ++s)
+    *dst = *s;
+  if(dst < end)
+    *dst = 0;
+  return dst;
+}
+
+char *safe_append_uint(char *dst, const char *end, unsigned long v) {
+  char buf[32], *p = buf + sizeof(buf);
+  *--p = 0;
+  do {
+    *--p = '0' + v % 10;
+    v /= 10;
+  } while(v);
+  return safe_append(dst, end, p);
+}
+
+static int is_assigned(const char *var, const char *const *assignments) {
+  for(; assignments[0]; ++assignments) {
+    const char *eq = strchr(assignments[0], '=');
+    size_t name_len = eq ? (size_t)(eq - assignments[0]) : strlen(assignments[0]);
+    if(0 == strncmp(var, assignments[0], name_len) && var[name_len] == '=')
+      return 1;
+  }
+  return 0;
+}
+
+char **safe_setenv(char *const *envp, const char *const *assignments, SafeArena *a, int error_fd) {
+  size_t n, m;
+  for(n = 0; envp[n]; ++n);
+  for(m = 0; assignments[m]; ++m);
+
+  char **new_envp = safe_arena_alloc(a, (n + m + 1) * sizeof(char *), error_fd);
+
+  size_t i, j = 0;
+  for(i = 0; i < n; ++i) {
+    if(!is_assigned(envp[i], assignments))
+      new_envp[j++] = envp[i];
+  }
+  for(i = 0; i < m; ++i)
+    new_envp[j++] = (char *)assignments[i];
+  new_envp[j] = NULL;
+
+  return new_envp;
+}
+
 // Not very efficient but enough for our simple usecase
 int safe_fnmatch(const char *p, const char *s) {
   if(*p == 0 || *s == 0)
@@ -68,14 +167,13 @@ int safe_fnmatch(const char *p, const char *s) {
   case '?':
     return *s && safe_fnmatch(p + 1, s + 1);
   case '*':
+    // Trailing star matches non-empty suffix
     if(p[1] == 0)
       return 1;
-    else if(p[1] == '*')
-      return safe_fnmatch(p + 1, s);
     else {
       size_t i;
       for(i = 0; s[i]; ++i)
-        if(p[1] == s[i] && safe_fnmatch(p + 2, s + i + 1))
+        if(safe_fnmatch(p + 1, s + i))
           return 1;
       return 0;
     }
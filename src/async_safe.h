@@ -13,6 +13,17 @@
 
 // Async-safe analogs of common functions
 
+// Descriptor which may be passed instead of Pregrind's log
+// so that log is opened only when something is reported
+#define LAZY_LOG_FD (-2)
+
+// Sets function which opens log for LAZY_LOG_FD
+// (stderr is used if not set)
+void safe_set_lazy_log(int (*get_fd)(void));
+
+// Returns descriptor to write to (resolves LAZY_LOG_FD)
+int safe_resolve_fd(int fd);
+
 void safe_fputs(int fd, const char *s);
 
 // snprintf isn't officially async-safe but should be if not using floats
@@ -32,9 +43,36 @@ typedef struct {
 
 void *safe_malloc(size_t n, int error_fd);
 void safe_free(void *p, int error_fd);
-char *safe_strdup(const char *s, int error_fd);
 
-char *safe_basename(char *f);
+// Bump allocator for short-lived data (e.g. arguments of exec'd process).
+// Memory is reserved with a single mmap on first allocation
+// and released all at once.
+typedef struct {
+  char *base;
+  size_t used;
+} SafeArena;
+
+#define SAFE_ARENA_INIT { NULL, 0 }
+
+// Must be called at startup (before any arenas are used)
+void safe_arena_set_size(size_t size);
+
+void *safe_arena_alloc(SafeArena *a, size_t n, int error_fd);
+char *safe_arena_strdup(SafeArena *a, const char *s, int error_fd);
+void safe_arena_free(SafeArena *a, int error_fd);
+
+const char *safe_basename(const char *f);
+
+// Append string (or decimal number) to null-terminated string
+// in buffer which ends at end (truncating it if needed).
+// Return new end of string.
+char *safe_append(char *dst, const char *end, const char *s);
+char *safe_append_uint(char *dst, const char *end, unsigned long v);
+
+// Returns copy of envp with variables set according
+// to null-terminated list of assignments ("NAME=VALUE");
+// strings are not copied.
+char **safe_setenv(char *const *envp, const char *const *assignments, SafeArena *a, int error_fd);
 
 int safe_fnmatch(const char *p, const char *s);
 
@@ -0,0 +1,125 @@
+/*
+ * Copyright 2022 Yury Gribov
+ *
+ * Use of this source code is governed by MIT license that can be
+ * found in the LICENSE.txt file.
+ */
+
+#include "cmd_queue.h"
+#include "common.h"
+#include "shm.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+
+#include <unistd.h>
+#include <fcntl.h>
+
+uint64_t cmd_queue_key(const char *path, const char *cwd, char *const *argv,
+                       char *const *envp, const char *const *flags) {
+  uint64_t h = hash_str(HASH_INIT, path);
+  h = hash_str(h, cwd);
+
+  // Separate arguments from environment
+  size_t i;
+  for(i = 1; argv[0] && argv[i]; ++i)
+    h = hash_str(h, argv[i]);
+  h = hash_bytes(h, &i, sizeof(i));
+
+  for(; envp[0]; ++envp) {
+    if(!cmd_queue_volatile_var(envp[0]))
+      h = hash_str(h, envp[0]);
+  }
+
+  // Separate environment from flags
+  h = hash_bytes(h, "", 1);
+  for(; flags && flags[0]; ++flags)
+    h = hash_str(h, flags[0]);
+
+  return h;
+}
+
+static char *append_str(char *p, const char *s) {
+  size_t len = strlen(s) + 1;
+  memcpy(p, s, len);
+  return p + len;
+}
+
+static void write_record(const char *name, const char *buf, size_t size, int error_fd) {
+  char file[256];
+  snprintf(file, sizeof(file), "%s/%s.%d", state_dir, name, (int)getuid());
+  int fd = open(file, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+  if(fd < 0) {
+    safe_fprintf(error_fd, PREFIX "failed to open %s: %s\n", file, sys_errlist[errno]);
+    return;
+  }
+
+  // Partial writes are only possible on errors (e.g. ENOSPC)
+  // and will be detected by reader
+  ssize_t n;
+  while((n = write(fd, buf, size)) < 0 && errno == EINTR);
+  if(n != (ssize_t)size)
+    safe_fprintf(error_fd, PREFIX "failed to write %s\n", file);
+  close(fd);
+}
+
+uint64_t cmd_queue_append(const char *name, const char *path, const char *cwd,
+                          char *const *argv, char *const *envp, const char *const *flags,
+                          int instrument, unsigned reason, int errors,
+                          SafeArena *a, int error_fd) {
+  uint64_t key = cmd_queue_key(path, cwd, argv, envp, flags);
+  if(!state_dir)
+    return key;
+
+  CmdRecord rec;
+  memset(&rec, 0, sizeof(rec));
+  rec.magic = CMD_QUEUE_MAGIC;
+  rec.key = key;
+  rec.instrument = instrument;
+  rec.reason = reason;
+  rec.errors = errors;
+
+  size_t size = sizeof(rec) + strlen(path) + 1 + strlen(cwd) + 1;
+  for(; argv[rec.argc]; ++rec.argc)
+    size += strlen(argv[rec.argc]) + 1;
+  for(; envp[rec.envc]; ++rec.envc)
+    size += strlen(envp[rec.envc]) + 1;
+  for(; flags && flags[rec.flagc]; ++rec.flagc)
+    size += strlen(flags[rec.flagc]) + 1;
+  rec.size = size;
+
+  char *buf = safe_arena_alloc(a, size, error_fd), *p = buf + sizeof(rec);
+  memcpy(buf, &rec, sizeof(rec));
+  p = append_str(p, path);
+  p = append_str(p, cwd);
+  uint32_t i;
+  for(i = 0; i < rec.argc; ++i)
+    p = append_str(p, argv[i]);
+  for(i = 0; i < rec.envc; ++i)
+    p = append_str(p, envp[i]);
+  for(i = 0; i < rec.flagc; ++i)
+    p = append_str(p, flags[i]);
+
+  write_record(name, buf, size, error_fd);
+  return key;
+}
+
+void cmd_queue_append_result(const char *name, uint64_t key, int errors, int error_fd) {
+  if(!state_dir)
+    return;
+
+  // Empty path and cwd
+  char buf[sizeof(CmdRecord) + 2];
+  CmdRecord rec;
+  memset(&rec, 0, sizeof(rec));
+  rec.magic = CMD_QUEUE_MAGIC;
+  rec.size = sizeof(buf);
+  rec.key = key;
+  rec.instrument = 1;
+  rec.errors = errors;
+  memcpy(buf, &rec, sizeof(rec));
+  buf[sizeof(rec)] = buf[sizeof(rec) + 1] = 0;
+
+  write_record(name, buf, sizeof(buf), error_fd);
+}
@@ -0,0 +1,75 @@
+/*
+ * Copyright 2022 Yury Gribov
+ *
+ * Use of this source code is governed by MIT license that can be
+ * found in the LICENSE.txt file.
+ */
+
+#ifndef CMD_QUEUE_H
+#define CMD_QUEUE_H
+
+#include <stdint.h>
+#include <string.h>
+
+#include "async_safe.h"
+
+// Queue of commands which should be (re)run under Valgrind later
+// by pregrind-replay tool.
+//
+// Queue is a file in state directory. Each record is appended
+// with a single write(2) to file opened with O_APPEND so records
+// of different processes do not interleave.
+
+#define CMD_QUEUE_MAGIC 0x50475132  // "PGQ2"
+
+// Runs which reported errors with cheap flags (PREGRIND_ESCALATE)
+#define ESCALATE_QUEUE "escalate"
+
+// Commands which were run natively (PREGRIND_RECORD)
+#define RECORD_QUEUE "record"
+
+// Record, followed by null-terminated path, cwd, arguments,
+// environment and Valgrind flags.
+//
+// Escalated processes append a record when they start and a result
+// record (with empty path and cwd and no other strings) with the same
+// key and number of errors when they exit so runs which crash or do not
+// reach exit otherwise are escalated too.
+typedef struct {
+  uint32_t magic;
+  uint32_t size;       // Including strings
+  uint64_t key;        // Hash of command (see cmd_queue_key)
+  uint32_t argc;
+  uint32_t envc;
+  uint8_t instrument;  // Whether Pregrind would instrument command
+  uint8_t reason;      // Why it would not (see log.h)
+  uint16_t flagc;      // Valgrind flags which command would be run with
+  int32_t errors;      // Number of Valgrind errors or -1 if unknown
+} CmdRecord;
+
+// Variables which differ between runs of the same command
+// and are thus ignored in key and removed on replay
+// (our internal variables and Valgrind's preloads)
+static inline int cmd_queue_volatile_var(const char *var) {
+  return 0 == strncmp(var, "PREGRIND_", 9)
+    || 0 == strncmp(var, "LD_PRELOAD=", 11)
+    || 0 == strncmp(var, "VALGRIND_LAUNCHER=", 18);
+}
+
+// Identifies command by path, cwd, arguments (except argv[0]),
+// environment (except volatile variables) and Valgrind flags
+// (which may be NULL)
+uint64_t cmd_queue_key(const char *path, const char *cwd, char *const *argv,
+                       char *const *envp, const char *const *flags);
+
+// Appends record to queue file in state directory (async-safe).
+// Returns key of record.
+uint64_t cmd_queue_append(const char *name, const char *path, const char *cwd,
+                          char *const *argv, char *const *envp, const char *const *flags,
+                          int instrument, unsigned reason, int errors,
+                          SafeArena *a, int error_fd);
+
+// Appends result of run of command with key (async-safe)
+void cmd_queue_append_result(const char *name, uint64_t key, int errors, int error_fd);
+
+#endif
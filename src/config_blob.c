@@ -0,0 +1,338 @@
+/*
+ * Copyright 2022 Yury Gribov
+ *
+ * Use of this source code is governed by MIT license that can be
+ * found in the LICENSE.txt file.
+ */
+
+#include "config_blob.h"
+#include "async_safe.h"
+#include "common.h"
+#include "allowlist.h"
+#include "config_file.h"
+#include "policy.h"
+#include "shm.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <errno.h>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+void blob_glob_set(const ConfigBlob *b, const BlobGlobSet *bgs, GlobSet *gs) {
+  memset(gs, 0, sizeof(*gs));
+  // Matcher does not modify tables
+  gs->nodes = (GlobNode *)blob_ptr(b, bgs->nodes);
+  gs->edges = (GlobEdge *)blob_ptr(b, bgs->edges);
+  gs->num_nodes = bgs->num_nodes;
+  gs->num_edges = bgs->num_edges;
+  gs->num_patterns = bgs->num_patterns;
+  gs->patterns = (char *)blob_ptr(b, bgs->patterns);
+  gs->patterns_size = bgs->patterns_size;
+}
+
+void blob_writer_init(BlobWriter *w) {
+  memset(w, 0, sizeof(*w));
+  ConfigBlob h;
+  memset(&h, 0, sizeof(h));
+  blob_add(w, &h, sizeof(h));
+}
+
+uint32_t blob_add(BlobWriter *w, const void *p, size_t n) {
+  // Keep all data aligned
+  size_t off = (w->size + 7) & ~(size_t)7;
+  size_t new_size = off + n;
+  if(new_size > UINT32_MAX) {
+    fprintf(stderr, PREFIX "configuration is too large\n");
+    abort();
+  }
+
+  if(new_size > w->capacity) {
+    w->capacity = w->capacity ? 2 * w->capacity : 4096;
+    if(w->capacity < new_size)
+      w->capacity = new_size;
+    w->data = realloc(w->data, w->capacity);
+    assert(w->data && "Failed to allocate blob");
+  }
+
+  memset(w->data + w->size, 0, off - w->size);
+  if(n)
+    memcpy(w->data + off, p, n);
+  w->size = new_size;
+
+  return off;
+}
+
+uint32_t blob_add_str(BlobWriter *w, const char *s) {
+  return blob_add(w, s, strlen(s) + 1);
+}
+
+uint32_t blob_add_strs(BlobWriter *w, char *const *strs, size_t n) {
+  uint32_t *offs = malloc((n + 1) * sizeof(uint32_t));
+  assert(offs && "Failed to allocate blob");
+
+  size_t i;
+  for(i = 0; i < n; ++i)
+    offs[i] = blob_add_str(w, strs[i]);
+
+  uint32_t off = blob_add(w, offs, n * sizeof(uint32_t));
+  free(offs);
+  return off;
+}
+
+BlobGlobSet blob_add_glob_set(BlobWriter *w, const GlobSet *gs) {
+  BlobGlobSet bgs;
+  bgs.nodes = blob_add(w, gs->nodes, gs->num_nodes * sizeof(GlobNode));
+  bgs.edges = blob_add(w, gs->edges, gs->num_edges * sizeof(GlobEdge));
+  bgs.num_nodes = gs->num_nodes;
+  bgs.num_edges = gs->num_edges;
+  bgs.num_patterns = gs->num_patterns;
+  bgs.patterns = blob_add(w, gs->patterns, gs->patterns_size);
+  bgs.patterns_size = gs->patterns_size;
+  return bgs;
+}
+
+ConfigBlob *blob_writer_finish(BlobWriter *w, ConfigBlob *h) {
+  memcpy(h->magic, CONFIG_BLOB_MAGIC, sizeof(h->magic));
+  h->version = CONFIG_BLOB_VERSION;
+  h->size = w->size;
+  memcpy(w->data, h, sizeof(*h));
+  return (ConfigBlob *)w->data;
+}
+
+static void compile_flags(BlobWriter *w, ConfigBlob *h, const char *flags) {
+  char *flags_copy = strdup(flags);
+  int max_flags = strlen(flags_copy) / 2 + 1;
+  char **words = malloc((max_flags + 1) * sizeof(char *));
+  assert(flags_copy && words && "Failed to allocate flags");
+
+  h->num_flags = config_split(flags_copy, words, max_flags);
+  h->flags = blob_add_strs(w, words, h->num_flags);
+
+  free(words);
+  free(flags_copy);
+}
+
+static void compile_blacklist(BlobWriter *w, ConfigBlob *h, const char *name, int error_fd) {
+  FILE *p = config_open(name, "blacklist", error_fd);
+
+  GlobSet matcher;
+  glob_set_init(&matcher);
+
+  char *buf = NULL, *s;
+  size_t buf_size = 0, num_patterns = 0, max_patterns = 0;
+  char **patterns = NULL;
+  while((s = config_next_line(p, &buf, &buf_size))) {
+    if(num_patterns == max_patterns) {
+      max_patterns = max_patterns ? 2 * max_patterns : 16;
+      patterns = realloc(patterns, max_patterns * sizeof(char *));
+      assert(patterns && "Failed to allocate blacklist");
+    }
+    patterns[num_patterns++] = strdup(s);
+    glob_set_add(&matcher, s);
+  }
+
+  free(buf);
+  fclose(p);
+
+  glob_set_finalize(&matcher);
+
+  h->num_blacklist = num_patterns;
+  h->blacklist = blob_add_strs(w, patterns, num_patterns);
+  h->blacklist_matcher = blob_add_glob_set(w, &matcher);
+
+  size_t i;
+  for(i = 0; i < num_patterns; ++i)
+    free(patterns[i]);
+  free(patterns);
+  glob_set_destroy(&matcher);
+}
+
+const ConfigBlob *config_blob_compile(const char *flags, const char *blacklist,
+                                      const char *policy, const char *allowlist,
+                                      int error_fd) {
+  BlobWriter w;
+  blob_writer_init(&w);
+
+  ConfigBlob h;
+  memset(&h, 0, sizeof(h));
+
+  if(flags)
+    compile_flags(&w, &h, flags);
+
+  if(blacklist)
+    compile_blacklist(&w, &h, blacklist, error_fd);
+
+  if(policy)
+    policy_compile(&w, &h, policy, error_fd);
+
+  if(allowlist)
+    allowlist_compile(&w, &h, allowlist, error_fd);
+
+  return blob_writer_finish(&w, &h);
+}
+
+const ConfigBlob *config_blob_map(const char *file, int error_fd) {
+  int fd = open(file, O_RDONLY | O_CLOEXEC);
+  if(fd < 0) {
+    dprintf(safe_resolve_fd(error_fd), PREFIX "failed to open configuration %s: %s\n", file, sys_errlist[errno]);
+    abort();
+  }
+
+  struct stat st;
+  if(0 != fstat(fd, &st)) {
+    dprintf(safe_resolve_fd(error_fd), PREFIX "failed to stat configuration %s: %s\n", file, sys_errlist[errno]);
+    abort();
+  }
+
+  if((size_t)st.st_size < sizeof(ConfigBlob)) {
+    dprintf(safe_resolve_fd(error_fd), PREFIX "configuration %s is truncated\n", file);
+    abort();
+  }
+
+  // Shared read-only mapping so that all processes use the same pages
+  const ConfigBlob *b = mmap(0, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if(b == MAP_FAILED) {
+    dprintf(safe_resolve_fd(error_fd), PREFIX "failed to mmap configuration %s: %s\n", file, sys_errlist[errno]);
+    abort();
+  }
+
+  if(0 != memcmp(b->magic, CONFIG_BLOB_MAGIC, sizeof(b->magic))
+      || b->version != CONFIG_BLOB_VERSION) {
+    dprintf(safe_resolve_fd(error_fd), PREFIX "configuration %s was created by different version of pregrind-compile\n", file);
+    abort();
+  }
+
+  if(b->size != (uint64_t)st.st_size) {
+    dprintf(safe_resolve_fd(error_fd), PREFIX "configuration %s is truncated\n", file);
+    abort();
+  }
+
+  return b;
+}
+
+int config_blob_save(const ConfigBlob *b, const char *file, int error_fd) {
+  // Write to temp file and rename so that running processes
+  // never see partially written configuration
+  char tmp[4096];
+  snprintf(tmp, sizeof(tmp), "%s.%d.tmp", file, (int)getpid());
+
+  int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if(fd < 0) {
+    dprintf(safe_resolve_fd(error_fd), PREFIX "failed to create %s: %s\n", tmp, sys_errlist[errno]);
+    return 0;
+  }
+
+  const char *p = (const char *)b;
+  size_t left = b->size;
+  while(left) {
+    ssize_t n = write(fd, p, left);
+    if(n < 0 && errno == EINTR)
+      continue;
+    if(n < 0) {
+      dprintf(safe_resolve_fd(error_fd), PREFIX "failed to write %s: %s\n", tmp, sys_errlist[errno]);
+      close(fd);
+      unlink(tmp);
+      return 0;
+    }
+    p += n;
+    left -= n;
+  }
+
+  if(0 != close(fd) || 0 != rename(tmp, file)) {
+    dprintf(safe_resolve_fd(error_fd), PREFIX "failed to save %s: %s\n", file, sys_errlist[errno]);
+    unlink(tmp);
+    return 0;
+  }
+
+  return 1;
+}
+
+#define MEMFD_NAME "pregrind-config"
+#define MEMFD_SEALS (F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL)
+
+int config_blob_memfd(const ConfigBlob *b, int error_fd) {
+  int fd = memfd_create(MEMFD_NAME, MFD_CLOEXEC | MFD_ALLOW_SEALING);
+  if(fd < 0) {
+    safe_fprintf(error_fd, PREFIX "failed to create memfd: %s\n", sys_errlist[errno]);
+    return -1;
+  }
+
+  const char *p = (const char *)b;
+  size_t left = b->size;
+  while(left) {
+    ssize_t n = write(fd, p, left);
+    if(n < 0 && errno == EINTR)
+      continue;
+    if(n < 0) {
+      safe_fprintf(error_fd, PREFIX "failed to write memfd: %s\n", sys_errlist[errno]);
+      close(fd);
+      return -1;
+    }
+    p += n;
+    left -= n;
+  }
+
+  // Children may trust contents
+  fcntl(fd, F_ADD_SEALS, MEMFD_SEALS);
+
+  return fd;
+}
+
+int config_blob_is_memfd(int fd) {
+  int seals = fcntl(fd, F_GET_SEALS);
+  if(seals < 0 || (seals & MEMFD_SEALS) != MEMFD_SEALS)
+    return 0;
+
+  char link[64];
+  snprintf(link, sizeof(link), "/proc/self/fd/%d", fd);
+
+  static const char name[] = "/memfd:" MEMFD_NAME " (deleted)";
+  char buf[sizeof(name)];
+  ssize_t len = readlink(link, buf, sizeof(buf));
+  return len == sizeof(name) - 1 && 0 == memcmp(buf, name, len);
+}
+
+const ConfigBlob *config_blob_map_fd(int fd) {
+  struct stat st;
+  if(0 != fstat(fd, &st) || (size_t)st.st_size < sizeof(ConfigBlob))
+    return NULL;
+
+  const ConfigBlob *b = mmap(0, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  if(b == MAP_FAILED)
+    return NULL;
+
+  if(0 != memcmp(b->magic, CONFIG_BLOB_MAGIC, sizeof(b->magic))
+      || b->version != CONFIG_BLOB_VERSION
+      || b->size != (uint64_t)st.st_size) {
+    munmap((void *)b, st.st_size);
+    return NULL;
+  }
+
+  return b;
+}
+
+uint64_t config_blob_env_hash() {
+  static const char *const vars[] = {
+    "PREGRIND_CONFIG",
+    "PREGRIND_FLAGS",
+    "PREGRIND_BLACKLIST",
+    "PREGRIND_POLICY",
+    "PREGRIND_ALLOWLIST",
+  };
+  uint64_t h = HASH_INIT;
+  size_t i;
+  for(i = 0; i < sizeof(vars) / sizeof(vars[0]); ++i) {
+    const char *val = getenv(vars[i]);
+    // Distinguish unset and empty variables
+    h = hash_str(h, val ? val : "");
+    h = hash_bytes(h, val ? "=" : "-", 1);
+  }
+  return h;
+}
@@ -0,0 +1,136 @@
+/*
+ * Copyright 2022 Yury Gribov
+ *
+ * Use of this source code is governed by MIT license that can be
+ * found in the LICENSE.txt file.
+ */
+
+#ifndef CONFIG_BLOB_H
+#define CONFIG_BLOB_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "glob_set.h"
+
+// Compiled configuration (Valgrind flags, blacklist, policy and allowlist).
+//
+// Configuration is a position-independent image (pointers are replaced
+// with offsets from its start) so it can be produced once by
+// pregrind-compile tool and then mapped read-only by all processes
+// (see PREGRIND_CONFIG), sharing page cache and avoiding any parsing
+// in constructor. Configuration from environment variables is compiled
+// to the same form in memory at startup.
+
+#define CONFIG_BLOB_MAGIC "PGCONF01"
+#define CONFIG_BLOB_VERSION 3
+
+typedef struct {
+  uint32_t nodes;  // Array of GlobNode
+  uint32_t edges;  // Array of GlobEdge
+  uint32_t num_nodes;
+  uint32_t num_edges;
+  uint32_t num_patterns;
+  uint32_t patterns;  // NUL-separated strings
+  uint32_t patterns_size;
+} BlobGlobSet;
+
+typedef struct {
+  uint32_t pattern;    // String
+  uint32_t flags;      // Array of strings
+  uint32_t num_flags;
+} BlobRule;
+
+// "Array of strings" is an array of uint32_t string offsets
+typedef struct {
+  char magic[8];
+  uint32_t version;
+  uint32_t size;
+  uint32_t flags;       // PREGRIND_FLAGS (array of strings)
+  uint32_t num_flags;
+  uint32_t blacklist;   // PREGRIND_BLACKLIST (array of strings)
+  uint32_t num_blacklist;
+  BlobGlobSet blacklist_matcher;
+  uint32_t rules;       // PREGRIND_POLICY (array of BlobRule)
+  uint32_t num_rules;
+  uint32_t path_rules;  // Rule indices of patterns (arrays of uint32_t)
+  uint32_t argv_rules;
+  BlobGlobSet path_matcher;
+  BlobGlobSet argv_matcher;
+  uint32_t allowlist;   // PREGRIND_ALLOWLIST (array of strings)
+  uint32_t num_allowlist;
+  uint32_t allow_ids[4];  // Predicate indices of patterns, indexed by AllowKind (see allowlist.h)
+  BlobGlobSet allow_matchers[4];
+} ConfigBlob;
+
+static inline const void *blob_ptr(const ConfigBlob *b, uint32_t off) {
+  return (const char *)b + off;
+}
+
+static inline const char *blob_str(const ConfigBlob *b, uint32_t off) {
+  return (const char *)blob_ptr(b, off);
+}
+
+// Returns i-th element of array of strings
+static inline const char *blob_strs_get(const ConfigBlob *b, uint32_t strs, size_t i) {
+  return blob_str(b, ((const uint32_t *)blob_ptr(b, strs))[i]);
+}
+
+// Makes glob set which refers to tables in blob (no copying)
+void blob_glob_set(const ConfigBlob *b, const BlobGlobSet *bgs, GlobSet *gs);
+
+// Growable buffer for building blobs (not async-safe)
+typedef struct {
+  char *data;
+  size_t size;
+  size_t capacity;
+} BlobWriter;
+
+// Reserves space for header
+void blob_writer_init(BlobWriter *w);
+
+// These return offset of added data
+uint32_t blob_add(BlobWriter *w, const void *p, size_t n);
+uint32_t blob_add_str(BlobWriter *w, const char *s);
+uint32_t blob_add_strs(BlobWriter *w, char *const *strs, size_t n);
+
+BlobGlobSet blob_add_glob_set(BlobWriter *w, const GlobSet *gs);
+
+// Copies header to blob and returns it
+ConfigBlob *blob_writer_finish(BlobWriter *w, ConfigBlob *h);
+
+// Not async-safe, call at startup.
+// Parses configuration (any of arguments may be NULL) or aborts.
+const ConfigBlob *config_blob_compile(const char *flags, const char *blacklist,
+                                      const char *policy, const char *allowlist,
+                                      int error_fd);
+
+// Maps compiled configuration from file or aborts
+const ConfigBlob *config_blob_map(const char *file, int error_fd);
+
+// Returns 0 on error
+int config_blob_save(const ConfigBlob *b, const char *file, int error_fd);
+
+// Set for instrumented children to "FD:HASH:LAUNCHER" where FD is memfd
+// with configuration of parent (or -1), HASH identifies variables
+// which it was compiled from (see config_blob_env_hash) and LAUNCHER
+// is 1 if child is started via Valgrind launcher (which resets it to 0
+// before starting the tool)
+#define GUEST_VAR "PREGRIND_GUEST"
+
+// Hash of variables which configuration is compiled from
+uint64_t config_blob_env_hash();
+
+// Async-safe. Copies configuration to sealed memfd (with FD_CLOEXEC)
+// which can be passed to children. Returns -1 on error.
+int config_blob_memfd(const ConfigBlob *b, int error_fd);
+
+// Returns 1 if descriptor is a sealed memfd created by config_blob_memfd
+// (descriptor passed by parent may have been reused by anything else)
+int config_blob_is_memfd(int fd);
+
+// Maps configuration from descriptor passed by parent
+// or returns NULL if it's not a valid configuration
+const ConfigBlob *config_blob_map_fd(int fd);
+
+#endif
@@ -0,0 +1,80 @@
+/*
+ * Copyright 2022 Yury Gribov
+ *
+ * Use of this source code is governed by MIT license that can be
+ * found in the LICENSE.txt file.
+ */
+
+#include "config_file.h"
+#include "async_safe.h"
+#include "common.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+FILE *config_open(const char *name, const char *what, int error_fd) {
+  FILE *p = fopen(name, "rb");
+  if(!p) {
+    dprintf(safe_resolve_fd(error_fd), PREFIX "failed to open %s file %s\n", what, name);
+    abort();
+  }
+  return p;
+}
+
+static char *trim_whites(char *s) {
+  for(; isspace(*s); ++s);
+
+  char *end = NULL, *p;
+  for(p = s; *p; ++p) {
+    int space = isspace(*p);
+    if(end && !space)
+      end = NULL;
+    else if(!end && space)
+      end = p;
+  }
+
+  if(end)
+    *end = 0;
+
+  return s;
+}
+
+char *config_next_line(FILE *p, char **buf, size_t *buf_size) {
+  while(-1 != getline(buf, buf_size, p)) {
+    char *s = *buf;
+
+    char *nl = strchr(s, '\n');
+    if(nl)
+      *nl = 0;
+
+    // Strip comments
+    char *comment = strchr(s, '#');
+    if(comment)
+      *comment = 0;
+
+    s = trim_whites(s);
+
+    if(*s)
+      return s;
+  }
+
+  return NULL;
+}
+
+int config_split(char *line, char **words, int max_words) {
+  int n = 0;
+  while(1) {
+    for(; isspace(*line); ++line);
+    if(!*line)
+      return n;
+
+    if(n >= max_words)
+      return -1;
+    words[n++] = line;
+
+    for(; *line && !isspace(*line); ++line);
+    if(*line)
+      *line++ = 0;
+  }
+}
@@ -0,0 +1,27 @@
+/*
+ * Copyright 2022 Yury Gribov
+ *
+ * Use of this source code is governed by MIT license that can be
+ * found in the LICENSE.txt file.
+ */
+
+#ifndef CONFIG_FILE_H
+#define CONFIG_FILE_H
+
+#include <stdio.h>
+
+// Reading of line-based configuration files (blacklists, policies, etc.).
+// These are not async-safe and should only be used at startup.
+
+// Opens file or aborts
+FILE *config_open(const char *name, const char *what, int error_fd);
+
+// Returns next non-empty line with comments and surrounding whitespace
+// stripped, or NULL at end of file. Line is valid until next call.
+char *config_next_line(FILE *p, char **buf, size_t *buf_size);
+
+// Splits line into whitespace-separated words (in place).
+// Returns number of words or -1 if there are more than max_words.
+int config_split(char *line, char **words, int max_words);
+
+#endif
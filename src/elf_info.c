@@ -0,0 +1,145 @@
+/*
+ * Copyright 2022 Yury Gribov
+ *
+ * Use of this source code is governed by MIT license that can be
+ * found in the LICENSE.txt file.
+ */
+
+#include "elf_info.h"
+
+#include <string.h>
+#include <elf.h>
+
+#include <unistd.h>
+#include <fcntl.h>
+
+// Only native ELFs are parsed so there is no need to swap bytes
+#if __SIZEOF_POINTER__ == 8
+typedef Elf64_Ehdr Ehdr;
+typedef Elf64_Phdr Phdr;
+typedef Elf64_Nhdr Nhdr;
+# define NATIVE_CLASS ELFCLASS64
+#else
+typedef Elf32_Ehdr Ehdr;
+typedef Elf32_Phdr Phdr;
+typedef Elf32_Nhdr Nhdr;
+# define NATIVE_CLASS ELFCLASS32
+#endif
+
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+# define NATIVE_DATA ELFDATA2LSB
+#else
+# define NATIVE_DATA ELFDATA2MSB
+#endif
+
+#if defined __x86_64__
+# define NATIVE_MACHINE EM_X86_64
+#elif defined __i386__
+# define NATIVE_MACHINE EM_386
+#elif defined __aarch64__
+# define NATIVE_MACHINE EM_AARCH64
+#elif defined __arm__
+# define NATIVE_MACHINE EM_ARM
+#elif defined __powerpc__
+# define NATIVE_MACHINE (__SIZEOF_POINTER__ == 8 ? EM_PPC64 : EM_PPC)
+#elif defined __s390__
+# define NATIVE_MACHINE EM_S390
+#elif defined __mips__
+# define NATIVE_MACHINE EM_MIPS
+#elif defined __riscv
+# define NATIVE_MACHINE EM_RISCV
+#endif
+
+// Type of note with Go build-id
+#define NT_GO_BUILD_ID 4
+
+#define MAX_PHDRS 64
+#define MAX_NOTES_SIZE 4096
+
+static int read_full(int fd, void *buf, size_t n, off_t off) {
+  return pread(fd, buf, n, off) == (ssize_t)n;
+}
+
+static void parse_notes(const char *notes, size_t size, ElfInfo *info) {
+  size_t off = 0;
+  while(off + sizeof(Nhdr) <= size) {
+    const Nhdr *n = (const Nhdr *)(notes + off);
+    size_t name_off = off + sizeof(Nhdr);
+    size_t desc_off = name_off + ((n->n_namesz + 3) & ~3u);
+    size_t next = desc_off + ((n->n_descsz + 3) & ~3u);
+    if(next > size)
+      return;
+
+    if(n->n_type == NT_GNU_BUILD_ID && n->n_namesz == 4
+        && 0 == memcmp(notes + name_off, "GNU", 4)
+        && n->n_descsz <= MAX_BUILD_ID) {
+      memcpy(info->build_id, notes + desc_off, n->n_descsz);
+      info->build_id_len = n->n_descsz;
+    } else if(n->n_type == NT_GO_BUILD_ID && n->n_namesz == 4
+              && 0 == memcmp(notes + name_off, "Go\0\0", 4)) {
+      info->is_go = 1;
+    }
+
+    off = next;
+  }
+}
+
+int elf_read_info(const char *path, ElfInfo *info) {
+  memset(info, 0, sizeof(*info));
+
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if(fd < 0)
+    return 0;
+
+  Ehdr eh;
+  ssize_t nread = pread(fd, &eh, sizeof(eh), 0);
+  if(nread >= 2 && 0 == memcmp(&eh, "#!", 2))
+    info->is_script = 1;
+
+  if(nread != sizeof(eh) || 0 != memcmp(eh.e_ident, ELFMAG, SELFMAG)) {
+    close(fd);
+    return 1;
+  }
+
+  info->is_elf = 1;
+
+  if(eh.e_ident[EI_CLASS] != NATIVE_CLASS
+      || eh.e_ident[EI_DATA] != NATIVE_DATA) {
+    close(fd);
+    return 1;
+  }
+
+#ifdef NATIVE_MACHINE
+  info->is_native = eh.e_machine == NATIVE_MACHINE;
+#else
+  info->is_native = 1;
+#endif
+
+  if(eh.e_phentsize != sizeof(Phdr) || eh.e_phnum > MAX_PHDRS) {
+    close(fd);
+    return 1;
+  }
+
+  Phdr phdrs[MAX_PHDRS];
+  if(!read_full(fd, phdrs, eh.e_phnum * sizeof(Phdr), eh.e_phoff)) {
+    close(fd);
+    return 1;
+  }
+
+  unsigned i;
+  for(i = 0; i < eh.e_phnum; ++i) {
+    const Phdr *ph = &phdrs[i];
+    if(ph->p_type == PT_INTERP)
+      info->has_interp = 1;
+    if(ph->p_type != PT_NOTE)
+      continue;
+
+    char notes[MAX_NOTES_SIZE] __attribute__((aligned(8)));
+    size_t size = ph->p_filesz < sizeof(notes) ? ph->p_filesz : sizeof(notes);
+    if(read_full(fd, notes, size, ph->p_offset))
+      parse_notes(notes, size, info);
+  }
+
+  close(fd);
+  return 1;
+}
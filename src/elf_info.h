@@ -0,0 +1,32 @@
+/*
+ * Copyright 2022 Yury Gribov
+ *
+ * Use of this source code is governed by MIT license that can be
+ * found in the LICENSE.txt file.
+ */
+
+#ifndef ELF_INFO_H
+#define ELF_INFO_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Async-safe parsing of executable headers
+
+#define MAX_BUILD_ID 64
+
+typedef struct {
+  int is_elf;
+  int is_script;   // Starts with "#!"
+  int is_native;   // ELF for same architecture as Pregrind
+  int has_interp;  // Has PT_INTERP i.e. is not static
+  int is_go;       // Has Go build-id note
+  uint8_t build_id[MAX_BUILD_ID];
+  size_t build_id_len;  // 0 if there is no build-id
+} ElfInfo;
+
+// Returns 0 if file could not be read.
+// Program headers are only parsed for native ELFs.
+int elf_read_info(const char *path, ElfInfo *info);
+
+#endif
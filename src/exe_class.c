@@ -0,0 +1,156 @@
+/*
+ * Copyright 2022 Yury Gribov
+ *
+ * Use of this source code is governed by MIT license that can be
+ * found in the LICENSE.txt file.
+ */
+
+#include "exe_class.h"
+#include "common.h"
+#include "elf_info.h"
+#include "shm.h"
+
+#include <string.h>
+
+#define CLASSES_MAGIC 0x50474501u
+#define NUM_ENTRIES 16384
+#define MAX_PROBES 16
+
+// Marks entries which have been filled
+#define CLASS_VALID (1u << 31)
+
+typedef struct {
+  uint64_t key;  // 0 if entry is free
+  uint32_t classes;
+  uint32_t reserved;
+} ClassEntry;
+
+typedef struct {
+  ShmHeader header;
+  ClassEntry entries[NUM_ENTRIES];
+} ClassCache;
+
+static ClassCache *cache;
+static unsigned skip_mask;
+
+static const struct {
+  const char *name;
+  unsigned mask;
+  const char *reason;
+} classes[] = {
+  { "script", EXE_SCRIPT, "script" },
+  { "static", EXE_STATIC, "static binary" },
+  { "foreign", EXE_FOREIGN, "foreign architecture" },
+  { "go", EXE_GO, "Go binary" },
+};
+
+#define NUM_CLASSES (sizeof(classes) / sizeof(classes[0]))
+
+void exe_class_init(unsigned skip_mask_, int error_fd) {
+  skip_mask = skip_mask_;
+  if(skip_mask)
+    cache = shm_map("classes", sizeof(ClassCache), CLASSES_MAGIC, error_fd);
+}
+
+int exe_class_parse(const char *s, unsigned *mask) {
+  *mask = 0;
+  while(*s) {
+    size_t len = strcspn(s, ",");
+    unsigned i;
+    for(i = 0; i < NUM_CLASSES; ++i) {
+      if(len == strlen(classes[i].name) && 0 == strncmp(s, classes[i].name, len))
+        break;
+    }
+    if(i == NUM_CLASSES)
+      return 0;
+    *mask |= classes[i].mask;
+    s += len;
+    if(*s)
+      ++s;
+  }
+  return 1;
+}
+
+static unsigned classify(const char *path) {
+  ElfInfo info;
+  if(!elf_read_info(path, &info))
+    return 0;
+
+  if(info.is_script)
+    return EXE_SCRIPT;
+
+  if(!info.is_elf)
+    return 0;
+
+  if(!info.is_native)
+    return EXE_FOREIGN;
+
+  return (info.has_interp ? 0 : EXE_STATIC) | (info.is_go ? EXE_GO : 0);
+}
+
+// Returns entry for key (inserting it if needed) or NULL if table is full
+static ClassEntry *find_entry(uint64_t key, int *inserted) {
+  unsigned i;
+  *inserted = 0;
+  for(i = 0; i < MAX_PROBES; ++i) {
+    ClassEntry *e = &cache->entries[(key + i) % NUM_ENTRIES];
+    uint64_t old = __atomic_load_n(&e->key, __ATOMIC_ACQUIRE);
+    if(old == key)
+      return e;
+    if(!old) {
+      if(__atomic_compare_exchange_n(&e->key, &old, key, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        *inserted = 1;
+        return e;
+      }
+      if(old == key)
+        return e;
+    }
+  }
+  return NULL;
+}
+
+static unsigned get_classes(const char *path, const struct stat *st) {
+  if(!cache)
+    return classify(path);
+
+  uint64_t key = HASH_INIT;
+  key = hash_bytes(key, &st->st_dev, sizeof(st->st_dev));
+  key = hash_bytes(key, &st->st_ino, sizeof(st->st_ino));
+  key = hash_bytes(key, &st->st_size, sizeof(st->st_size));
+  key = hash_bytes(key, &st->st_mtim, sizeof(st->st_mtim));
+  key += !key;
+
+  int inserted;
+  ClassEntry *e = find_entry(key, &inserted);
+  if(e && !inserted) {
+    unsigned c = __atomic_load_n(&e->classes, __ATOMIC_ACQUIRE);
+    // Entry may still be filled by other process
+    if(c & CLASS_VALID)
+      return c & ~CLASS_VALID;
+  }
+
+  unsigned c = classify(path);
+  if(e && inserted)
+    __atomic_store_n(&e->classes, c | CLASS_VALID, __ATOMIC_RELEASE);
+
+  return c;
+}
+
+int exe_class_allows(const char *path, const struct stat *st, const char **reason) {
+  if(!skip_mask)
+    return 1;
+
+  unsigned c = get_classes(path, st) & skip_mask;
+  if(!c)
+    return 1;
+
+  unsigned i;
+  for(i = 0; i < NUM_CLASSES; ++i) {
+    if(c & classes[i].mask) {
+      *reason = classes[i].reason;
+      break;
+    }
+  }
+
+  return 0;
+}
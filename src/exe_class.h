@@ -0,0 +1,36 @@
+/*
+ * Copyright 2022 Yury Gribov
+ *
+ * Use of this source code is governed by MIT license that can be
+ * found in the LICENSE.txt file.
+ */
+
+#ifndef EXE_CLASS_H
+#define EXE_CLASS_H
+
+#include <sys/stat.h>
+
+// Classification of executables which Valgrind can not handle
+// or which are pointless to instrument.
+//
+// Classes are cached in a lock-free table in state directory
+// (see shm.h) keyed by inode and mtime of executable
+// so each file is parsed once per run.
+
+#define EXE_SCRIPT  (1u << 0)  // Interpreted script (instrumenting it would instrument interpreter)
+#define EXE_STATIC  (1u << 1)  // Static ELF (Valgrind can't intercept malloc)
+#define EXE_FOREIGN (1u << 2)  // ELF for different architecture
+#define EXE_GO      (1u << 3)  // Go binary
+
+// Not async-safe, call at startup.
+// Executables which have any of classes in skip mask are not instrumented.
+void exe_class_init(unsigned skip_mask, int error_fd);
+
+// Parses comma-separated list of class names ("script,static,foreign,go"),
+// returns 0 on error
+int exe_class_parse(const char *s, unsigned *mask);
+
+// Returns 0 and reason if executable should not be instrumented
+int exe_class_allows(const char *path, const struct stat *st, const char **reason);
+
+#endif
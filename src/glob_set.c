@@ -0,0 +1,301 @@
+/*
+ * Copyright 2022 Yury Gribov
+ *
+ * Use of this source code is governed by MIT license that can be
+ * found in the LICENSE.txt file.
+ */
+
+#include "glob_set.h"
+#include "async_safe.h"
+#include "common.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+
+typedef struct {
+  GlobNode node;
+  GlobEdge *kids;
+  uint32_t num_kids;
+  uint32_t max_kids;
+} BuilderNode;
+
+typedef struct {
+  BuilderNode *nodes;
+  uint32_t num_nodes;
+  uint32_t max_nodes;
+  char *patterns;
+  uint32_t patterns_size;
+} Builder;
+
+static void *xrealloc(void *p, size_t n) {
+  p = realloc(p, n);
+  if(!p) {
+    fprintf(stderr, PREFIX "realloc() of %zd bytes failed: %s\n", n, strerror(errno));
+    abort();
+  }
+  return p;
+}
+
+static uint32_t new_node(Builder *b, int loop) {
+  if(b->num_nodes == b->max_nodes) {
+    b->max_nodes = b->max_nodes ? 2 * b->max_nodes : 64;
+    b->nodes = xrealloc(b->nodes, b->max_nodes * sizeof(BuilderNode));
+  }
+
+  BuilderNode *bn = &b->nodes[b->num_nodes];
+  memset(bn, 0, sizeof(*bn));
+  bn->node.pattern = -1;
+  bn->node.loop = loop;
+
+  return b->num_nodes++;
+}
+
+static uint32_t get_literal_kid(Builder *b, uint32_t n, unsigned char c) {
+  uint32_t i;
+  for(i = 0; i < b->nodes[n].num_kids; ++i) {
+    if(b->nodes[n].kids[i].c == c)
+      return b->nodes[n].kids[i].to;
+  }
+
+  uint32_t kid = new_node(b, 0);
+
+  BuilderNode *bn = &b->nodes[n];
+  if(bn->num_kids == bn->max_kids) {
+    bn->max_kids = bn->max_kids ? 2 * bn->max_kids : 2;
+    bn->kids = xrealloc(bn->kids, bn->max_kids * sizeof(GlobEdge));
+  }
+  bn->kids[bn->num_kids].c = c;
+  bn->kids[bn->num_kids].to = kid;
+  ++bn->num_kids;
+
+  return kid;
+}
+
+void glob_set_init(GlobSet *gs) {
+  memset(gs, 0, sizeof(*gs));
+
+  Builder *b = xrealloc(NULL, sizeof(Builder));
+  memset(b, 0, sizeof(*b));
+  new_node(b, 0);
+
+  gs->builder = b;
+}
+
+uint32_t glob_set_add(GlobSet *gs, const char *p) {
+  Builder *b = gs->builder;
+  assert(b && "Adding to finalized glob set");
+
+  size_t len = strlen(p) + 1;
+  b->patterns = xrealloc(b->patterns, b->patterns_size + len);
+  memcpy(b->patterns + b->patterns_size, p, len);
+  b->patterns_size += len;
+
+  uint32_t n = 0;
+  for(; *p; ++p) {
+    uint32_t next;
+    switch(*p) {
+    case '*':
+      // Consecutive stars are equivalent to one
+      for(; p[1] == '*'; ++p);
+      next = b->nodes[n].node.star;
+      if(!next) {
+        next = new_node(b, 1);
+        b->nodes[n].node.star = next;
+      }
+      break;
+    case '?':
+      next = b->nodes[n].node.any;
+      if(!next) {
+        next = new_node(b, 0);
+        b->nodes[n].node.any = next;
+      }
+      break;
+    default:
+      next = get_literal_kid(b, n, (unsigned char)*p);
+      break;
+    }
+    n = next;
+  }
+
+  if(b->nodes[n].node.pattern < 0)
+    b->nodes[n].node.pattern = gs->num_patterns;
+
+  return gs->num_patterns++;
+}
+
+static int compare_edges(const void *a, const void *b) {
+  const GlobEdge *l = a, *r = b;
+  return (int)l->c - (int)r->c;
+}
+
+void glob_set_finalize(GlobSet *gs) {
+  Builder *b = gs->builder;
+  assert(b && "Glob set finalized twice");
+
+  uint32_t i, num_edges = 0;
+  for(i = 0; i < b->num_nodes; ++i)
+    num_edges += b->nodes[i].num_kids;
+
+  gs->nodes = xrealloc(NULL, b->num_nodes * sizeof(GlobNode));
+  gs->edges = xrealloc(NULL, (num_edges ? num_edges : 1) * sizeof(GlobEdge));
+  gs->num_nodes = b->num_nodes;
+  gs->num_edges = num_edges;
+
+  uint32_t e = 0;
+  for(i = 0; i < b->num_nodes; ++i) {
+    BuilderNode *bn = &b->nodes[i];
+
+    qsort(bn->kids, bn->num_kids, sizeof(GlobEdge), compare_edges);
+    memcpy(&gs->edges[e], bn->kids, bn->num_kids * sizeof(GlobEdge));
+
+    gs->nodes[i] = bn->node;
+    gs->nodes[i].edges_begin = e;
+    e += bn->num_kids;
+    gs->nodes[i].edges_end = e;
+
+    free(bn->kids);
+  }
+
+  gs->patterns = b->patterns;
+  gs->patterns_size = b->patterns_size;
+
+  free(b->nodes);
+  free(b);
+  gs->builder = NULL;
+}
+
+void glob_set_destroy(GlobSet *gs) {
+  assert(!gs->builder && "Destroying non-finalized glob set");
+  free(gs->nodes);
+  free(gs->edges);
+  free(gs->patterns);
+  memset(gs, 0, sizeof(*gs));
+}
+
+static uint32_t find_edge(const GlobSet *gs, const GlobNode *n, uint32_t c) {
+  uint32_t lo = n->edges_begin, hi = n->edges_end;
+  while(lo < hi) {
+    uint32_t mid = lo + (hi - lo) / 2;
+    if(gs->edges[mid].c == c)
+      return gs->edges[mid].to;
+    else if(gs->edges[mid].c < c)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return 0;
+}
+
+typedef struct {
+  uint32_t *nodes;
+  uint32_t size;
+} StateList;
+
+#define BITS_PER_WORD (8 * sizeof(unsigned long))
+
+// Add node and its epsilon-closure (i.e. following star) to list
+static void add_state(const GlobSet *gs, StateList *l, unsigned long *seen, uint32_t n) {
+  for(; n; n = gs->nodes[n].star) {
+    unsigned long mask = 1ul << (n % BITS_PER_WORD);
+    if(seen[n / BITS_PER_WORD] & mask)
+      return;
+    seen[n / BITS_PER_WORD] |= mask;
+    l->nodes[l->size++] = n;
+  }
+}
+
+// Automatons of this size are matched without allocations
+#define MAX_STACK_NODES 1024
+
+// Sets of this size are faster to match one by one (see bench/glob)
+#define MAX_LINEAR_PATTERNS 16
+
+static int match_linear(const GlobSet *gs, const char *s) {
+  const char *p = gs->patterns;
+  uint32_t i;
+  for(i = 0; i < gs->num_patterns; ++i) {
+    if(safe_fnmatch(p, s))
+      return i;
+    p += strlen(p) + 1;
+  }
+  return -1;
+}
+
+int glob_set_match(const GlobSet *gs, const char *s, int error_fd) {
+  assert(!gs->builder && "Matching non-finalized glob set");
+
+  if(!gs->num_patterns)
+    return -1;
+
+  if(gs->num_patterns <= MAX_LINEAR_PATTERNS)
+    return match_linear(gs, s);
+
+  size_t seen_words = (gs->num_nodes + BITS_PER_WORD - 1) / BITS_PER_WORD;
+  size_t scratch_size = 2 * gs->num_nodes * sizeof(uint32_t) + seen_words * sizeof(unsigned long);
+
+  unsigned long stack_scratch[(2 * MAX_STACK_NODES * sizeof(uint32_t)) / sizeof(unsigned long)
+                              + (MAX_STACK_NODES + BITS_PER_WORD - 1) / BITS_PER_WORD];
+  void *scratch = gs->num_nodes <= MAX_STACK_NODES ? stack_scratch : safe_malloc(scratch_size, error_fd);
+
+  unsigned long *seen = scratch;
+  StateList cur = { (uint32_t *)(seen + seen_words), 0 };
+  StateList next = { cur.nodes + gs->num_nodes, 0 };
+  memset(seen, 0, seen_words * sizeof(unsigned long));
+
+  // Root is the only node which is not target of any edge
+  // so mark it manually
+  cur.nodes[cur.size++] = 0;
+  add_state(gs, &cur, seen, gs->nodes[0].star);
+
+  int best = -1;
+  for(; *s && cur.size; ++s) {
+    uint32_t c = (unsigned char)*s, i;
+
+    for(i = 0; i < cur.size; ++i)
+      seen[cur.nodes[i] / BITS_PER_WORD] = 0;
+
+    for(i = 0; i < cur.size; ++i) {
+      const GlobNode *n = &gs->nodes[cur.nodes[i]];
+
+      if(n->loop) {
+        // Trailing star accepts any non-empty suffix
+        if(n->pattern >= 0 && (best < 0 || n->pattern < best))
+          best = n->pattern;
+        add_state(gs, &next, seen, cur.nodes[i]);
+      }
+
+      if(n->any)
+        add_state(gs, &next, seen, n->any);
+
+      uint32_t to = find_edge(gs, n, c);
+      if(to)
+        add_state(gs, &next, seen, to);
+    }
+
+    StateList tmp = cur;
+    cur = next;
+    next = tmp;
+    next.size = 0;
+  }
+
+  if(!*s) {
+    uint32_t i;
+    for(i = 0; i < cur.size; ++i) {
+      // Trailing star which has consumed some chars
+      // has already been accepted above
+      if(gs->nodes[cur.nodes[i]].loop)
+        continue;
+      int p = gs->nodes[cur.nodes[i]].pattern;
+      if(p >= 0 && (best < 0 || p < best))
+        best = p;
+    }
+  }
+
+  if(scratch != stack_scratch)
+    safe_free(scratch, error_fd);
+
+  return best;
+}
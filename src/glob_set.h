@@ -0,0 +1,66 @@
+/*
+ * Copyright 2022 Yury Gribov
+ *
+ * Use of this source code is governed by MIT license that can be
+ * found in the LICENSE.txt file.
+ */
+
+#ifndef GLOB_SET_H
+#define GLOB_SET_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Set of wildcard patterns compiled into a single automaton.
+//
+// Patterns are stored in a trie whose '?' and '*' edges are handled
+// specially so matching is a single pass over input string
+// which simulates all patterns at once. Tables are flat arrays
+// so matcher is async-safe (no allocations unless automaton is huge)
+// and can be placed in read-only memory.
+//
+// Simulating automaton has a fixed overhead so small sets are
+// matched by trying patterns one by one.
+//
+// As in safe_fnmatch, trailing '*' matches only non-empty suffix
+// (i.e. "/usr/bin/*" does not match "/usr/bin/").
+
+typedef struct {
+  uint32_t edges_begin;  // Literal transitions (sorted by char)
+  uint32_t edges_end;
+  uint32_t any;          // Transition for '?' (0 if none)
+  uint32_t star;         // Transition for '*' (0 if none)
+  int32_t pattern;       // Smallest id of pattern accepted here or -1
+  uint32_t loop;         // Node loops on any char (i.e. it's target of '*')
+} GlobNode;
+
+typedef struct {
+  uint32_t c;
+  uint32_t to;
+} GlobEdge;
+
+typedef struct {
+  GlobNode *nodes;  // Node 0 is root
+  GlobEdge *edges;
+  uint32_t num_nodes;
+  uint32_t num_edges;
+  uint32_t num_patterns;
+  char *patterns;  // Patterns (NUL-separated, in order of addition)
+  uint32_t patterns_size;
+  void *builder;  // Only used before glob_set_finalize
+} GlobSet;
+
+// These are not async-safe and should only be called at startup
+void glob_set_init(GlobSet *gs);
+uint32_t glob_set_add(GlobSet *gs, const char *pattern);
+void glob_set_finalize(GlobSet *gs);
+void glob_set_destroy(GlobSet *gs);
+
+// Returns id of first pattern (in order of addition) which matches s, or -1
+int glob_set_match(const GlobSet *gs, const char *s, int error_fd);
+
+static inline int glob_set_empty(const GlobSet *gs) {
+  return gs->num_patterns == 0;
+}
+
+#endif
@@ -0,0 +1,252 @@
+/*
+ * Copyright 2022 Yury Gribov
+ *
+ * Use of this source code is governed by MIT license that can be
+ * found in the LICENSE.txt file.
+ */
+
+#include "history.h"
+#include "async_safe.h"
+#include "common.h"
+#include "shm.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/auxv.h>
+#include <sys/resource.h>
+
+#define HISTORY_MAGIC 0x50474801u
+#define NUM_ENTRIES 65536
+#define MAX_PROBES 16
+
+// Slowdown assumed for binaries which have never been instrumented
+#define DEFAULT_SLOWDOWN 30
+
+// Runs which would take larger share of budget are not instrumented
+// so that it's spent on many cheap runs rather than few expensive ones
+#define MAX_BUDGET_SHARE 0.1
+
+enum { NATIVE, INSTRUMENTED };
+
+typedef struct {
+  uint64_t key;    // 0 if entry is free
+  uint64_t stamp;
+  uint64_t runs[2];
+  uint64_t wall_ns[2];
+  uint64_t cpu_ns[2];
+} HistoryEntry;
+
+typedef struct {
+  ShmHeader header;
+  uint64_t run_id;    // Run which budget is being spent
+  uint64_t spent_ns;  // Estimated overhead of instrumented processes in run
+  HistoryEntry entries[NUM_ENTRIES];
+} History;
+
+static History *history;
+static uint64_t budget_ns;
+
+void history_init(double budget_s, int error_fd) {
+  history = shm_map("history", sizeof(History), HISTORY_MAGIC, error_fd);
+  if(!history) {
+    safe_fprintf(error_fd, PREFIX "history needs state directory, disabling\n");
+    return;
+  }
+
+  budget_ns = budget_s > 0 ? (uint64_t)(budget_s * 1e9) : 0;
+  if(!budget_ns)
+    return;
+
+  uint64_t run_id = shm_run_id();
+
+  // Start new budget if previous run has finished
+  uint64_t old = __atomic_load_n(&history->run_id, __ATOMIC_ACQUIRE);
+  if(old != run_id
+      && __atomic_compare_exchange_n(&history->run_id, &old, run_id, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+    __atomic_store_n(&history->spent_ns, 0, __ATOMIC_RELAXED);
+}
+
+int history_enabled() {
+  return history != NULL;
+}
+
+uint64_t history_now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static uint64_t get_stamp(const struct stat *st) {
+  uint64_t h = HASH_INIT;
+  h = hash_bytes(h, &st->st_size, sizeof(st->st_size));
+  h = hash_bytes(h, &st->st_mtim, sizeof(st->st_mtim));
+  return h;
+}
+
+static uint64_t hash_options(uint64_t h, const char *arg) {
+  // Only options determine kind of work, not names of files
+  return arg[0] == '-' ? hash_str(h, arg) : h;
+}
+
+HistoryKey history_key(const struct stat *st, char *const *argv) {
+  HistoryKey k;
+  k.key = HASH_INIT;
+  k.key = hash_bytes(k.key, &st->st_dev, sizeof(st->st_dev));
+  k.key = hash_bytes(k.key, &st->st_ino, sizeof(st->st_ino));
+  for(++argv; argv[0]; ++argv)
+    k.key = hash_options(k.key, argv[0]);
+  k.key += !k.key;
+  k.stamp = get_stamp(st);
+  return k;
+}
+
+// Returns entry for key (inserting it if needed) or NULL if table is full
+static HistoryEntry *find_entry(uint64_t key, int insert) {
+  unsigned i;
+  for(i = 0; i < MAX_PROBES; ++i) {
+    HistoryEntry *e = &history->entries[(key + i) % NUM_ENTRIES];
+    uint64_t old = __atomic_load_n(&e->key, __ATOMIC_ACQUIRE);
+    if(old == key)
+      return e;
+    if(!old) {
+      if(!insert)
+        return NULL;
+      if(__atomic_compare_exchange_n(&e->key, &old, key, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)
+          || old == key)
+        return e;
+    }
+  }
+  return NULL;
+}
+
+static uint64_t average(const HistoryEntry *e, int kind) {
+  uint64_t runs = __atomic_load_n(&e->runs[kind], __ATOMIC_RELAXED);
+  return runs ? __atomic_load_n(&e->wall_ns[kind], __ATOMIC_RELAXED) / runs : 0;
+}
+
+int history_allows(HistoryKey k, const char **reason, uint64_t *estimate_ns) {
+  *estimate_ns = 0;
+
+  if(!history || !budget_ns)
+    return 1;
+
+  const HistoryEntry *e = find_entry(k.key, 0);
+  if(!e || __atomic_load_n(&e->stamp, __ATOMIC_RELAXED) != k.stamp) {
+    // Prefer new and changed binaries
+    *reason = "new or changed binary";
+    return 1;
+  }
+
+  uint64_t native = average(e, NATIVE), instrumented = average(e, INSTRUMENTED);
+  if(instrumented)
+    *estimate_ns = instrumented > native ? instrumented - native : 0;
+  else if(native)
+    *estimate_ns = native * DEFAULT_SLOWDOWN;
+  else {
+    *reason = "no history";
+    return 1;
+  }
+
+  if(*estimate_ns > budget_ns * MAX_BUDGET_SHARE) {
+    *reason = "too expensive for budget";
+    return 0;
+  }
+
+  uint64_t spent = __atomic_add_fetch(&history->spent_ns, *estimate_ns, __ATOMIC_RELAXED);
+  if(spent > budget_ns) {
+    __atomic_fetch_sub(&history->spent_ns, *estimate_ns, __ATOMIC_RELAXED);
+    *reason = "budget exhausted";
+    return 0;
+  }
+
+  *reason = "fits in budget";
+  return 1;
+}
+
+static void record(HistoryKey k, int kind, uint64_t wall_ns, uint64_t cpu_ns) {
+  HistoryEntry *e = find_entry(k.key, 1);
+  if(!e)
+    return;
+
+  // Forget history of old version (races just lose few samples)
+  uint64_t stamp = __atomic_load_n(&e->stamp, __ATOMIC_RELAXED);
+  if(stamp != k.stamp
+      && __atomic_compare_exchange_n(&e->stamp, &stamp, k.stamp, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+    int i;
+    for(i = 0; i < 2; ++i) {
+      __atomic_store_n(&e->runs[i], 0, __ATOMIC_RELAXED);
+      __atomic_store_n(&e->wall_ns[i], 0, __ATOMIC_RELAXED);
+      __atomic_store_n(&e->cpu_ns[i], 0, __ATOMIC_RELAXED);
+    }
+  }
+
+  __atomic_fetch_add(&e->wall_ns[kind], wall_ns, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&e->cpu_ns[kind], cpu_ns, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&e->runs[kind], 1, __ATOMIC_RELAXED);
+}
+
+int history_self_key(HistoryKey *k) {
+  // Parent identifies scripts by script itself rather than interpreter
+  // (which is /proc/self/exe)
+  const char *execfn = (const char *)getauxval(AT_EXECFN);
+  struct stat st, exe_st;
+  if(0 != stat("/proc/self/exe", &exe_st))
+    return 0;
+  if(!execfn || 0 != stat(execfn, &st))
+    st = exe_st;
+  int is_script = st.st_dev != exe_st.st_dev || st.st_ino != exe_st.st_ino;
+
+  int fd = open("/proc/self/cmdline", O_RDONLY | O_CLOEXEC);
+  if(fd < 0)
+    return 0;
+
+  static char buf[64 * 1024];
+  ssize_t n = read(fd, buf, sizeof(buf) - 1);
+  close(fd);
+  if(n <= 0)
+    return 0;
+  buf[n] = 0;
+
+  k->key = HASH_INIT;
+  k->key = hash_bytes(k->key, &st.st_dev, sizeof(st.st_dev));
+  k->key = hash_bytes(k->key, &st.st_ino, sizeof(st.st_ino));
+
+  // Skip argv[0]
+  const char *args = buf + strlen(buf) + 1, *arg;
+
+  // For scripts kernel replaces argv[0] with interpreter,
+  // its optional argument and path of script
+  if(is_script) {
+    for(arg = args; arg < buf + n; arg += strlen(arg) + 1) {
+      if(0 == strcmp(arg, execfn)) {
+        args = arg + strlen(arg) + 1;
+        break;
+      }
+    }
+  }
+
+  for(arg = args; arg < buf + n; arg += strlen(arg) + 1)
+    k->key = hash_options(k->key, arg);
+  k->key += !k->key;
+  k->stamp = get_stamp(&st);
+
+  return 1;
+}
+
+void history_record_self(int instrumented, HistoryKey k, uint64_t start_ns) {
+  if(!history)
+    return;
+
+  struct rusage ru;
+  uint64_t cpu_ns = 0;
+  if(0 == getrusage(RUSAGE_SELF, &ru))
+    cpu_ns = (ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000000000ull
+             + (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) * 1000ull;
+
+  record(k, instrumented ? INSTRUMENTED : NATIVE, history_now_ns() - start_ns, cpu_ns);
+}
@@ -0,0 +1,61 @@
+/*
+ * Copyright 2022 Yury Gribov
+ *
+ * Use of this source code is governed by MIT license that can be
+ * found in the LICENSE.txt file.
+ */
+
+#ifndef HISTORY_H
+#define HISTORY_H
+
+#include <stdint.h>
+
+#include <sys/stat.h>
+
+// Persistent database of run times of executables
+// (native and under Valgrind) which is used to keep
+// instrumentation within slowdown budget.
+//
+// Runs are grouped by executable (inode) and its options
+// (arguments which start with '-'). Database is a lock-free table
+// in state directory (see shm.h). Statistics of executable are reset
+// once it changes.
+
+// Environment variable which passes key of instrumented process
+// and time when it was started ("KEY:STAMP:START_NS" in hex)
+#define HISTORY_VAR "PREGRIND_HISTORY_KEY"
+
+typedef struct {
+  uint64_t key;    // Executable and its options
+  uint64_t stamp;  // Version of executable
+} HistoryKey;
+
+// Not async-safe, call at startup.
+// Budget is the total estimated time (in seconds) which may be added
+// to the run by instrumentation (0 to only collect history).
+void history_init(double budget_s, int error_fd);
+
+int history_enabled();
+
+HistoryKey history_key(const struct stat *st, char *const *argv);
+
+// Returns 0 and reason if instrumenting run would exceed budget.
+// Estimated overhead of run (0 if unknown) is returned in estimate_ns.
+int history_allows(HistoryKey k, const char **reason, uint64_t *estimate_ns);
+
+// Monotonic time for history_record_self
+uint64_t history_now_ns();
+
+// Computes key of native process (should be called at startup,
+// before it changes cwd). Scripts are keyed by script path
+// (from AT_EXECFN) and arguments, rather than by interpreter,
+// so that key matches the one computed by parent.
+// Returns 0 on error.
+int history_self_key(HistoryKey *k);
+
+// Records time of current process (should be called at exit).
+// Key of instrumented process is provided by parent,
+// for native ones it's computed by history_self_key.
+void history_record_self(int instrumented, HistoryKey k, uint64_t start_ns);
+
+#endif
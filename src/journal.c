@@ -0,0 +1,123 @@
+/*
+ * Copyright 2022 Yury Gribov
+ *
+ * Use of this source code is governed by MIT license that can be
+ * found in the LICENSE.txt file.
+ */
+
+#include "journal.h"
+#include "common.h"
+#include "log.h"
+#include "shm.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/resource.h>
+#include <sys/uio.h>
+
+static int journal_fd = -1;
+
+void journal_init(int error_fd) {
+  if(!state_dir) {
+    dprintf(safe_resolve_fd(error_fd), PREFIX "journal needs state directory, disabling\n");
+    return;
+  }
+
+  char path[4096];
+  snprintf(path, sizeof(path), "%s/" JOURNAL_NAME ".%d", state_dir, (int)getuid());
+
+  // Opened at startup so that process which has closed all fds
+  // (e.g. daemon) still has it
+  journal_fd = open(path, O_CREAT | O_WRONLY | O_APPEND | O_CLOEXEC, 0644);
+  if(journal_fd < 0)
+    dprintf(safe_resolve_fd(error_fd), PREFIX "failed to open journal %s: %s\n", path, sys_errlist[errno]);
+}
+
+int journal_enabled() {
+  return journal_fd >= 0;
+}
+
+static uint64_t clock_ns(clockid_t clk) {
+  struct timespec ts;
+  clock_gettime(clk, &ts);
+  return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+uint64_t journal_now_ns() {
+  return clock_ns(CLOCK_REALTIME);
+}
+
+// Returns start time of current process (i.e. time of fork)
+// which is less precise than journal_now_ns (clock ticks)
+static uint64_t process_start_ns() {
+  char buf[1024];
+  int fd = open("/proc/self/stat", O_RDONLY | O_CLOEXEC);
+  if(fd < 0)
+    return 0;
+  ssize_t n = read(fd, buf, sizeof(buf) - 1);
+  close(fd);
+  if(n <= 0)
+    return 0;
+  buf[n] = 0;
+
+  // Skip comm (which may contain spaces) and go to 22-nd field
+  char *p = strrchr(buf, ')');
+  if(!p)
+    return 0;
+  int field;
+  for(field = 2; field < 22 && p; ++field)
+    p = strchr(p + 1, ' ');
+  if(!p)
+    return 0;
+
+  uint64_t ticks = strtoull(p + 1, NULL, 10);
+  long hz = sysconf(_SC_CLK_TCK);
+  if(hz <= 0)
+    return 0;
+
+  // Start time is relative to boot
+  uint64_t since_boot_ns = ticks * (1000000000ull / hz);
+  return journal_now_ns() - (clock_ns(CLOCK_BOOTTIME) - since_boot_ns);
+}
+
+void journal_record_self(int instrumented, pid_t ppid, uint64_t exec_ns) {
+  if(journal_fd < 0)
+    return;
+
+  JournalRecord rec;
+  memset(&rec, 0, sizeof(rec));
+  rec.magic = JOURNAL_MAGIC;
+  rec.instrumented = instrumented;
+  rec.pid = getpid();
+  rec.ppid = ppid;
+  rec.start_ns = process_start_ns();
+  rec.exec_ns = exec_ns;
+  rec.end_ns = journal_now_ns();
+
+  struct rusage ru;
+  if(0 == getrusage(RUSAGE_SELF, &ru)) {
+    rec.user_ns = ru.ru_utime.tv_sec * 1000000000ull + ru.ru_utime.tv_usec * 1000ull;
+    rec.sys_ns = ru.ru_stime.tv_sec * 1000000000ull + ru.ru_stime.tv_usec * 1000ull;
+    rec.maxrss_kb = ru.ru_maxrss;
+  }
+
+  // Valgrind returns path of client here
+  char path[1024];
+  ssize_t path_len = readlink("/proc/self/exe", path, sizeof(path));
+  if(path_len < 0)
+    path_len = 0;
+
+  rec.size = sizeof(rec) + path_len;
+
+  struct iovec iov[2] = {
+    { &rec, sizeof(rec) },
+    { path, path_len },
+  };
+  while(writev(journal_fd, iov, 2) < 0 && errno == EINTR);
+}
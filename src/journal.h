@@ -0,0 +1,51 @@
+/*
+ * Copyright 2022 Yury Gribov
+ *
+ * Use of this source code is governed by MIT license that can be
+ * found in the LICENSE.txt file.
+ */
+
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+// Journal of finished processes (PREGRIND_JOURNAL).
+//
+// Each process which loads Pregrind appends a record at exit
+// to a file in state directory (with a single write to file
+// opened with O_APPEND). Records can be analyzed with pregrind-report.
+
+#define JOURNAL_NAME "journal"
+#define JOURNAL_MAGIC 0x50474a31  // "PGJ1"
+
+// Record, followed by path of executable (not null-terminated)
+typedef struct {
+  uint32_t magic;
+  uint16_t size;          // Including path
+  uint8_t instrumented;   // Ran under Valgrind
+  uint8_t reserved;
+  int32_t pid;
+  int32_t ppid;
+  int32_t reserved2;
+  uint64_t start_ns;      // Start of process (CLOCK_REALTIME, precise to clock tick)
+  uint64_t exec_ns;       // Start of current executable
+  uint64_t end_ns;
+  uint64_t user_ns;
+  uint64_t sys_ns;
+  uint64_t maxrss_kb;
+} JournalRecord;
+
+// Not async-safe, call at startup
+void journal_init(int error_fd);
+
+int journal_enabled();
+
+// Realtime clock in nanoseconds
+uint64_t journal_now_ns();
+
+// Appends record for current process
+void journal_record_self(int instrumented, pid_t ppid, uint64_t exec_ns);
+
+#endif
@@ -0,0 +1,92 @@
+/*
+ * Copyright 2022 Yury Gribov
+ *
+ * Use of this source code is governed by MIT license that can be
+ * found in the LICENSE.txt file.
+ */
+
+#include "launcher.h"
+#include "async_safe.h"
+#include "common.h"
+#include "elf_info.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+
+#include <unistd.h>
+
+// Valgrind's name of our platform
+#if defined __x86_64__
+# define VG_PLATFORM "amd64-linux"
+#elif defined __i386__
+# define VG_PLATFORM "x86-linux"
+#elif defined __aarch64__
+# define VG_PLATFORM "arm64-linux"
+#elif defined __arm__
+# define VG_PLATFORM "arm-linux"
+#elif defined __powerpc64__ && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+# define VG_PLATFORM "ppc64le-linux"
+#elif defined __powerpc64__
+# define VG_PLATFORM "ppc64be-linux"
+#elif defined __s390x__
+# define VG_PLATFORM "s390x-linux"
+#endif
+
+#define DEFAULT_TOOL "memcheck"
+
+static const char *lib_dir;
+static char launcher_var[PATH_MAX + 32];
+
+void launcher_init(const char *lib_dir_, const char *vg_path, int error_fd) {
+#ifdef VG_PLATFORM
+  if(vg_path[0] != '/') {
+    safe_fprintf(error_fd, PREFIX "PREGRIND_VALGRIND_LIB needs absolute path to Valgrind, ignoring\n");
+    return;
+  }
+  lib_dir = lib_dir_;
+  snprintf(launcher_var, sizeof(launcher_var), "VALGRIND_LAUNCHER=%s", vg_path);
+#else
+  (void)lib_dir_;
+  (void)vg_path;
+  safe_fprintf(error_fd, PREFIX "PREGRIND_VALGRIND_LIB is not supported on this platform, ignoring\n");
+#endif
+}
+
+int launcher_enabled() {
+  return lib_dir != NULL;
+}
+
+const char *launcher_select_tool(const char *path, char *const *vg_argv, char *buf, size_t size) {
+#ifdef VG_PLATFORM
+  // Launcher only looks at options before program
+  const char *tool = DEFAULT_TOOL;
+  char *const *arg;
+  for(arg = vg_argv + 1; *arg && (*arg)[0] == '-'; ++arg) {
+    if(0 == strncmp(*arg, "--tool=", 7))
+      tool = *arg + 7;
+  }
+
+  // Launcher selects platform of interpreter for scripts
+  ElfInfo info;
+  if(!elf_read_info(path, &info) || !info.is_native)
+    return NULL;
+
+  if((size_t)snprintf(buf, size, "%s/%s-" VG_PLATFORM, lib_dir, tool) >= size
+      || 0 != access(buf, X_OK))
+    return NULL;
+
+  return buf;
+#else
+  (void)path;
+  (void)vg_argv;
+  (void)buf;
+  (void)size;
+  return NULL;
+#endif
+}
+
+const char *launcher_env() {
+  return launcher_var;
+}
@@ -0,0 +1,35 @@
+/*
+ * Copyright 2022 Yury Gribov
+ *
+ * Use of this source code is governed by MIT license that can be
+ * found in the LICENSE.txt file.
+ */
+
+#ifndef LAUNCHER_H
+#define LAUNCHER_H
+
+#include <stddef.h>
+
+// Direct start of Valgrind tools.
+//
+// Valgrind launcher (the `valgrind` binary) only selects tool
+// and platform and execs e.g. LIBDIR/memcheck-amd64-linux.
+// It's an ordinary dynamic executable so it would also load Pregrind
+// (which is in LD_PRELOAD). We can exec the tool ourselves
+// if we know Valgrind's LIBDIR and client is a native ELF
+// (otherwise launcher is used).
+
+// Not async-safe, call at startup
+void launcher_init(const char *lib_dir, const char *vg_path, int error_fd);
+
+int launcher_enabled();
+
+// Returns tool which runs executable path with Valgrind arguments
+// vg_argv (stored in buf) or NULL if launcher should be used.
+// Tool expects launcher_env() in environment.
+const char *launcher_select_tool(const char *path, char *const *vg_argv, char *buf, size_t size);
+
+// "VALGRIND_LAUNCHER=..." variable (tool needs it to run children)
+const char *launcher_env();
+
+#endif
@@ -0,0 +1,150 @@
+/*
+ * Copyright 2022 Yury Gribov
+ *
+ * Use of this source code is governed by MIT license that can be
+ * found in the LICENSE.txt file.
+ */
+
+#include "log.h"
+#include "common.h"
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+
+static const char *text_dir, *events_file;
+static int text_fd = -1, events_fd = -1;
+
+void log_init(const char *text_dir_, const char *events_file_) {
+  text_dir = text_dir_;
+  events_file = events_file_;
+  safe_set_lazy_log(get_log_fd);
+}
+
+// We delay opening files until we have something to write.
+// Threads may race to open file so publish fd with CAS
+// and close it in losers.
+static int open_lazily(int *fd, const char *file) {
+  int cur = __atomic_load_n(fd, __ATOMIC_ACQUIRE);
+  if(cur >= 0)
+    return cur;
+
+  int new_fd = open(file, O_CREAT | O_WRONLY | O_APPEND | O_CLOEXEC, S_IRWXU | S_IRWXG | S_IRWXO);
+  if(-1 == new_fd) {
+    safe_fprintf(STDERR_FILENO, PREFIX "open() of %s failed: %s\n", file, sys_errlist[errno]);
+    abort();
+  }
+
+  if(!__atomic_compare_exchange_n(fd, &cur, new_fd, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+    close(new_fd);
+    return cur;
+  }
+
+  return new_fd;
+}
+
+// Name of text log depends on program name which needs reading /proc
+// so we compute it only when something is logged
+static void get_text_file(char *buf, size_t size) {
+  char cmdline[128];
+  ssize_t n = -1;
+  int fd = open("/proc/self/cmdline", O_RDONLY | O_CLOEXEC);
+  if(fd >= 0) {
+    n = read(fd, cmdline, sizeof(cmdline) - 1);
+    close(fd);
+  }
+  cmdline[n > 0 ? n : 0] = 0;
+
+  const char *name = n > 0 ? safe_basename(cmdline) : "unknown";
+
+  // This may be called in exec interceptors so avoid snprintf
+  const char *end = buf + size;
+  buf = safe_append(buf, end, text_dir);
+  buf = safe_append(buf, end, "/");
+  buf = safe_append(buf, end, name);
+  buf = safe_append(buf, end, ".");
+  buf = safe_append_uint(buf, end, getuid());
+  buf = safe_append(buf, end, ".");
+  safe_append_uint(buf, end, getpid());
+}
+
+int get_log_fd(void) {
+  if(!text_dir)
+    return STDERR_FILENO;
+
+  int fd = __atomic_load_n(&text_fd, __ATOMIC_ACQUIRE);
+  if(fd >= 0)
+    return fd;
+
+  char text_file[4096];
+  get_text_file(text_file, sizeof(text_file));
+  return open_lazily(&text_fd, text_file);
+}
+
+void log_write(int fd, const char *buf, size_t len) {
+  while(len) {
+    ssize_t written = write(fd, buf, len);
+    if(written < 0 && errno == EINTR)
+      continue;
+    if(written < 0)
+      return;  // Nowhere to report
+    buf += written;
+    len -= written;
+  }
+}
+
+void log_strings(const char *prefix, const char *const *strs, SafeArena *a) {
+  size_t prefix_len = strlen(prefix), len = prefix_len + 1;
+  const char *const *s;
+  for(s = strs; *s; ++s)
+    len += strlen(*s) + 1;
+
+  char *buf = safe_arena_alloc(a, len, get_log_fd());
+  char *out = buf;
+
+  memcpy(out, prefix, prefix_len);
+  out += prefix_len;
+  for(s = strs; *s; ++s) {
+    size_t n = strlen(*s);
+    memcpy(out, *s, n);
+    out += n;
+    *out++ = ' ';
+  }
+  *out++ = '\n';
+
+  log_write(get_log_fd(), buf, out - buf);
+}
+
+void log_event(Decision d, Reason r, const char *path) {
+  if(!events_file)
+    return;
+
+  size_t path_len = strlen(path);
+  if(path_len > UINT16_MAX - sizeof(LogRecord))
+    path_len = UINT16_MAX - sizeof(LogRecord);
+
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+
+  LogRecord rec;
+  rec.magic = LOG_RECORD_MAGIC;
+  rec.size = sizeof(rec) + path_len;
+  rec.decision = d;
+  rec.reason = r;
+  rec.time_ns = ts.tv_sec * 1000000000ull + ts.tv_nsec;
+  rec.pid = getpid();
+  rec.ppid = getppid();
+
+  // Single writev so that record is not split
+  struct iovec iov[2] = {
+    { &rec, sizeof(rec) },
+    { (void *)path, path_len },
+  };
+  writev(open_lazily(&events_fd, events_file), iov, 2);
+}
@@ -0,0 +1,98 @@
+/*
+ * Copyright 2022 Yury Gribov
+ *
+ * Use of this source code is governed by MIT license that can be
+ * found in the LICENSE.txt file.
+ */
+
+#ifndef LOG_H
+#define LOG_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "async_safe.h"
+
+// Async-safe diagnostics.
+//
+// Each record is formatted into a buffer and emitted with a single
+// write(2) to file opened with O_APPEND so records of different
+// processes do not interleave.
+//
+// In addition to text messages Pregrind may log instrumentation
+// decisions in compact binary format (see LogRecord) to a file
+// shared by all processes.
+
+typedef enum {
+  DECISION_SKIP,
+  DECISION_INSTRUMENT,
+} Decision;
+
+typedef enum {
+  REASON_NONE,
+  REASON_DISABLED,
+  REASON_VALGRIND,
+  REASON_NOT_FOUND,
+  REASON_BLACKLIST,
+  REASON_STAT,
+  REASON_SETUID,
+  REASON_SAMPLING,
+  REASON_RESULT_CACHE,
+  REASON_ADMISSION,
+  REASON_SHELL,
+  REASON_CLASS,
+  REASON_BUDGET,
+  REASON_ALLOWLIST,
+  REASON_MAX
+} Reason;
+
+static inline const char *reason_name(unsigned r) {
+  static const char *const names[] = {
+    "none",
+    "disabled",
+    "valgrind",
+    "not-found",
+    "blacklist",
+    "stat",
+    "setuid",
+    "sampling",
+    "result-cache",
+    "admission",
+    "shell",
+    "class",
+    "budget",
+    "allowlist",
+  };
+  return r < REASON_MAX ? names[r] : "unknown";
+}
+
+#define LOG_RECORD_MAGIC 0x50474c31  // "PGL1"
+
+// Binary record, followed by path (not null-terminated)
+typedef struct {
+  uint32_t magic;
+  uint16_t size;      // Including path
+  uint8_t decision;
+  uint8_t reason;
+  uint64_t time_ns;   // CLOCK_REALTIME
+  int32_t pid;
+  int32_t ppid;
+} LogRecord;
+
+// Not async-safe, call at startup.
+// Text messages go to per-process file in text_dir (or stderr if NULL),
+// binary records to events_file (if not NULL).
+void log_init(const char *text_dir, const char *events_file);
+
+// Opens log file on first use
+int get_log_fd(void);
+
+// Writes whole buffer (single write unless interrupted)
+void log_write(int fd, const char *buf, size_t len);
+
+// Prints all strings of array, separated by spaces, as one record
+void log_strings(const char *prefix, const char *const *strs, SafeArena *a);
+
+void log_event(Decision d, Reason r, const char *path);
+
+#endif
@@ -0,0 +1,211 @@
+/*
+ * Copyright 2022 Yury Gribov
+ *
+ * Use of this source code is governed by MIT license that can be
+ * found in the LICENSE.txt file.
+ */
+
+#include "path_cache.h"
+#include "async_safe.h"
+#include "common.h"
+#include "shm.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <time.h>
+
+#include <sys/stat.h>
+
+#define PATH_CACHE_MAGIC 0x50474301u
+#define NUM_ENTRIES 4096
+#define MAX_PROBES 4
+#define MAX_DIRS 64
+#define MAX_RESULT 256
+
+typedef struct {
+  uint64_t seq;
+  uint64_t key;         // Hash of PATH and file name (0 if entry is free)
+  uint64_t stamp;       // Hash of searched directories and their mtimes
+  uint64_t checked_ns;  // When stamp has last been validated
+  uint32_t num_dirs;    // Number of searched directories
+  char result[MAX_RESULT];
+} PathCacheEntry;
+
+typedef struct {
+  ShmHeader header;
+  PathCacheEntry entries[NUM_ENTRIES];
+} PathCache;
+
+static PathCache *cache;
+static uint64_t ttl_ns;
+
+void path_cache_init(unsigned ttl_ms, int error_fd) {
+  cache = shm_map("path-cache", sizeof(PathCache), PATH_CACHE_MAGIC, error_fd);
+  ttl_ns = ttl_ms * 1000000ull;
+}
+
+static uint64_t now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// Splits next directory from PATH, returns NULL when done
+static const char *next_dir(const char *path, size_t *len) {
+  const char *sep = strchr(path, ':');
+  *len = sep ? (size_t)(sep - path) : strlen(path);
+  return sep ? sep + 1 : NULL;
+}
+
+// Computes stamps of leading PATH directories.
+// Returns number of directories which can be cached (relative ones can't).
+static unsigned stamp_dirs(const char *path, unsigned max_dirs, uint64_t *stamps) {
+  uint64_t h = HASH_INIT;
+  unsigned i;
+  for(i = 0; path && i < max_dirs; ++i) {
+    size_t len;
+    const char *dir = path;
+    path = next_dir(path, &len);
+
+    char buf[PATH_MAX];
+    if(!len || dir[0] != '/' || len >= sizeof(buf))
+      break;
+    memcpy(buf, dir, len);
+    buf[len] = 0;
+
+    // Missing directories are stamped too as they may be created later
+    struct stat st;
+    memset(&st, 0, sizeof(st));
+    stat(buf, &st);
+
+    h = hash_bytes(h, &st.st_dev, sizeof(st.st_dev));
+    h = hash_bytes(h, &st.st_ino, sizeof(st.st_ino));
+    h = hash_bytes(h, &st.st_mtim, sizeof(st.st_mtim));
+    stamps[i] = h;
+  }
+  return i;
+}
+
+static int lookup(uint64_t key, const char *path, const char *file, char *buf, size_t buf_sz) {
+  unsigned i;
+  for(i = 0; i < MAX_PROBES; ++i) {
+    PathCacheEntry *e = &cache->entries[(key + i) % NUM_ENTRIES];
+
+    uint64_t seq = seqlock_read_begin(&e->seq);
+    if(__atomic_load_n(&e->key, __ATOMIC_RELAXED) != key)
+      continue;
+
+    uint64_t stamp = e->stamp, checked_ns = e->checked_ns;
+    unsigned num_dirs = e->num_dirs;
+    char result[MAX_RESULT];
+    memcpy(result, e->result, sizeof(result));
+
+    if(seqlock_read_retry(&e->seq, seq))
+      return 0;
+
+    // Protect against hash collisions
+    result[MAX_RESULT - 1] = 0;
+    size_t result_len = strlen(result), file_len = strlen(file);
+    if(result_len <= file_len
+        || result[result_len - file_len - 1] != '/'
+        || 0 != strcmp(result + result_len - file_len, file)
+        || result_len >= buf_sz)
+      return 0;
+
+    uint64_t now = now_ns();
+    if(now - checked_ns > ttl_ns) {
+      uint64_t stamps[MAX_DIRS];
+      if(num_dirs > MAX_DIRS
+          || stamp_dirs(path, num_dirs, stamps) != num_dirs
+          || stamps[num_dirs - 1] != stamp)
+        return 0;
+      // Racy but harmless
+      __atomic_store_n(&e->checked_ns, now, __ATOMIC_RELAXED);
+    }
+
+    memcpy(buf, result, result_len + 1);
+    return 1;
+  }
+
+  return 0;
+}
+
+static void insert(uint64_t key, uint64_t stamp, unsigned num_dirs, const char *result) {
+  if(strlen(result) >= MAX_RESULT)
+    return;
+
+  // Reuse entry with same key or free one, otherwise evict first
+  PathCacheEntry *e = &cache->entries[key % NUM_ENTRIES];
+  unsigned i;
+  for(i = 0; i < MAX_PROBES; ++i) {
+    PathCacheEntry *probe = &cache->entries[(key + i) % NUM_ENTRIES];
+    uint64_t probe_key = __atomic_load_n(&probe->key, __ATOMIC_RELAXED);
+    if(probe_key == key || !probe_key) {
+      e = probe;
+      break;
+    }
+  }
+
+  // Process may die while holding the lock which would disable the entry.
+  // This is unlikely and harmless.
+  if(!seqlock_write_begin(&e->seq))
+    return;
+
+  e->key = key;
+  e->stamp = stamp;
+  e->checked_ns = now_ns();
+  e->num_dirs = num_dirs;
+  strcpy(e->result, result);
+
+  seqlock_write_end(&e->seq);
+}
+
+const char *find_file_in_path(const char *file, char *buf, size_t buf_sz, int error_fd) {
+  const char *path = getenv("PATH");
+  return path ? find_file_in_dirs(file, path, buf, buf_sz, error_fd) : NULL;
+}
+
+const char *find_file_in_dirs(const char *file, const char *path, char *buf, size_t buf_sz, int error_fd) {
+  uint64_t key = 0, stamps[MAX_DIRS];
+  unsigned num_stamps = 0;
+  if(cache) {
+    key = hash_str(hash_str(HASH_INIT, path), file);
+    key += !key;  // 0 marks free entries
+    if(lookup(key, path, file, buf, buf_sz))
+      return buf;
+    // Directories are stamped before search so that entry gets invalidated
+    // if they change while we are searching
+    num_stamps = stamp_dirs(path, MAX_DIRS, stamps);
+  }
+
+  struct stat perm;
+  unsigned i = 0;
+  do {
+    size_t len;
+    const char *dir = path;
+    path = next_dir(path, &len);
+
+    int needed;
+    if(!len)
+      needed = snprintf(buf, buf_sz, "%s", file);
+    else
+      needed = snprintf(buf, buf_sz, "%.*s/%s", (int)len, dir, file);
+
+    if(needed < 0 || (size_t)needed >= buf_sz) {
+      safe_fprintf(error_fd, PREFIX "failed to find file %s in path: string too long\n", file);
+      return NULL;
+    }
+
+    if(0 == stat(buf, &perm)) {
+      if(i < num_stamps)
+        insert(key, stamps[i], i + 1, buf);
+      return buf;
+    }
+
+    ++i;
+  } while(path);
+
+  return NULL;
+}
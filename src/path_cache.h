@@ -0,0 +1,30 @@
+/*
+ * Copyright 2022 Yury Gribov
+ *
+ * Use of this source code is governed by MIT license that can be
+ * found in the LICENSE.txt file.
+ */
+
+#ifndef PATH_CACHE_H
+#define PATH_CACHE_H
+
+#include <stddef.h>
+
+// Resolution of executable names in PATH.
+//
+// Results can be cached in a table shared by all processes
+// (see shm.h). Entries remember mtimes of PATH directories
+// which were searched and are dropped once they change.
+// Lookups do not take locks.
+
+// Not async-safe, call at startup.
+// Directories are revalidated at most once in ttl_ms (0 to check on every lookup).
+void path_cache_init(unsigned ttl_ms, int error_fd);
+
+// Searches file in our PATH
+const char *find_file_in_path(const char *file, char *buf, size_t buf_sz, int error_fd);
+
+// Searches file in given list of directories (e.g. PATH of another process)
+const char *find_file_in_dirs(const char *file, const char *path, char *buf, size_t buf_sz, int error_fd);
+
+#endif
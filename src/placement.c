@@ -0,0 +1,278 @@
+/*
+ * Copyright 2022 Yury Gribov
+ *
+ * Use of this source code is governed by MIT license that can be
+ * found in the LICENSE.txt file.
+ */
+
+#include "placement.h"
+#include "async_safe.h"
+#include "common.h"
+#include "shm.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sched.h>
+
+#include <unistd.h>
+#include <signal.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+
+#define PLACEMENT_MAGIC 0x50475001u
+#define PLACEMENT_NAME "placement"
+
+#define IOPRIO_WHO_PROCESS 1
+#define IOPRIO_CLASS_SHIFT 13
+#define IOPRIO_CLASS_BE 2
+#define IOPRIO_CLASS_IDLE 3
+
+#define MAX_TASKS 1024
+
+// Instrumented process pinned to CPU
+typedef struct {
+  int32_t pid;  // 0 if entry is free
+  int32_t cpu;
+} PlacementTask;
+
+typedef struct {
+  ShmHeader header;
+  uint64_t next;  // Round-robin counter
+  PlacementTask tasks[MAX_TASKS];
+} PlacementState;
+
+static PlacementConfig config;
+static PlacementState *state;
+static int cpus[CPU_SETSIZE];
+static unsigned num_cpus;
+
+// Saved at startup to undo placement if exec fails
+static cpu_set_t orig_affinity;
+static int orig_nice;
+static int orig_ioprio = -1;
+
+int placement_parse_ionice(const char *s, int *cls, int *level) {
+  if(0 == strcmp(s, "idle")) {
+    *cls = IOPRIO_CLASS_IDLE;
+    *level = 0;
+    return 1;
+  }
+
+  static const char be[] = "best-effort";
+  if(0 != strncmp(s, be, sizeof(be) - 1))
+    return 0;
+  s += sizeof(be) - 1;
+
+  *cls = IOPRIO_CLASS_BE;
+  *level = 7;  // Lowest
+  if(!*s)
+    return 1;
+  if(*s != ':' || s[1] < '0' || s[1] > '7' || s[2])
+    return 0;
+  *level = s[1] - '0';
+  return 1;
+}
+
+// Parses list like "0-3,8,10-11"
+static int parse_cpus(const char *s) {
+  num_cpus = 0;
+  while(*s) {
+    char *end;
+    long first = strtol(s, &end, 10), last = first;
+    if(end == s)
+      return 0;
+    s = end;
+    if(*s == '-') {
+      const char *last_s = s + 1;
+      last = strtol(last_s, &end, 10);
+      if(end == last_s)
+        return 0;
+      s = end;
+    }
+    if(first < 0 || last < first || last >= CPU_SETSIZE)
+      return 0;
+    for(; first <= last && num_cpus < CPU_SETSIZE; ++first)
+      cpus[num_cpus++] = first;
+    if(*s == ',')
+      ++s;
+    else if(*s)
+      return 0;
+  }
+  return num_cpus > 0;
+}
+
+void placement_init(const PlacementConfig *cfg, int verbose, int error_fd) {
+  config = *cfg;
+
+  if(0 != sched_getaffinity(0, sizeof(orig_affinity), &orig_affinity)) {
+    safe_fprintf(error_fd, PREFIX "failed to get CPU affinity: %s\n", sys_errlist[errno]);
+    config.policy = PLACEMENT_NONE;
+  }
+
+  errno = 0;
+  orig_nice = getpriority(PRIO_PROCESS, 0);
+  if(errno)
+    orig_nice = 0;
+  orig_ioprio = syscall(SYS_ioprio_get, IOPRIO_WHO_PROCESS, 0);
+
+  if(config.policy == PLACEMENT_NONE)
+    return;
+
+  if(config.cpus) {
+    if(!parse_cpus(config.cpus)) {
+      safe_fprintf(error_fd, PREFIX "invalid PREGRIND_CPUS (expected list like '0-7,16'): %s\n", config.cpus);
+      abort();
+    }
+  } else {
+    int cpu;
+    for(cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+      if(CPU_ISSET(cpu, &orig_affinity))
+        cpus[num_cpus++] = cpu;
+    }
+
+    // Instrumented processes are pinned so their children
+    // must not compute CPU set from their own affinity
+    char list[8 * CPU_SETSIZE], *p = list;
+    unsigned i;
+    for(i = 0; i < num_cpus; ++i)
+      p += sprintf(p, i ? ",%d" : "%d", cpus[i]);
+    setenv("PREGRIND_CPUS", list, 0);
+  }
+
+  state = shm_map(PLACEMENT_NAME, sizeof(PlacementState), PLACEMENT_MAGIC, error_fd);
+  if(!state) {
+    // Balance only our own children
+    static PlacementState local_state;
+    state = &local_state;
+  }
+
+  if(verbose)
+    safe_fprintf(error_fd, PREFIX "placement: %s over %u CPUs\n", config.policy == PLACEMENT_RR ? "round-robin" : "least-loaded", num_cpus);
+}
+
+int placement_enabled() {
+  return config.policy != PLACEMENT_NONE || config.nice || config.ioprio_class;
+}
+
+int placement_select() {
+  if(config.policy == PLACEMENT_NONE)
+    return -1;
+
+  // Rotate start of search to spread ties
+  unsigned start = __atomic_fetch_add(&state->next, 1, __ATOMIC_RELAXED) % num_cpus;
+  if(config.policy == PLACEMENT_RR)
+    return cpus[start];
+
+  // Count running tasks and remove dead ones
+  // (e.g. killed or exited via _exit)
+  uint32_t load[CPU_SETSIZE];
+  memset(load, 0, sizeof(load));
+  unsigned i;
+  for(i = 0; i < MAX_TASKS; ++i) {
+    PlacementTask *t = &state->tasks[i];
+    int32_t pid = __atomic_load_n(&t->pid, __ATOMIC_ACQUIRE);
+    if(pid <= 0)  // Free or being filled
+      continue;
+    if(kill(pid, 0) < 0 && errno == ESRCH) {
+      __atomic_compare_exchange_n(&t->pid, &pid, 0, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+      continue;
+    }
+    unsigned cpu = __atomic_load_n(&t->cpu, __ATOMIC_RELAXED);
+    if(cpu < CPU_SETSIZE)
+      ++load[cpu];
+  }
+
+  unsigned best = start;
+  for(i = 0; i < num_cpus; ++i) {
+    unsigned j = (start + i) % num_cpus;
+    if(load[cpus[j]] < load[cpus[best]])
+      best = j;
+  }
+
+  return cpus[best];
+}
+
+void placement_register(pid_t pid, int cpu) {
+  if(cpu < 0 || config.policy != PLACEMENT_LEAST_LOADED)
+    return;
+
+  // If table is full, process is not taken into account
+  unsigned i;
+  for(i = 0; i < MAX_TASKS; ++i) {
+    PlacementTask *t = &state->tasks[i];
+    int32_t old = 0;
+    if(!__atomic_load_n(&t->pid, __ATOMIC_RELAXED)
+        && __atomic_compare_exchange_n(&t->pid, &old, -1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+      __atomic_store_n(&t->cpu, cpu, __ATOMIC_RELAXED);
+      __atomic_store_n(&t->pid, pid, __ATOMIC_RELEASE);
+      return;
+    }
+  }
+}
+
+static int set_affinity(pid_t pid, int cpu, int error_fd) {
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  CPU_SET(cpu, &set);
+  if(0 != sched_setaffinity(pid, sizeof(set), &set)) {
+    safe_fprintf(error_fd, PREFIX "failed to set affinity: %s\n", sys_errlist[errno]);
+    return 0;
+  }
+  return 1;
+}
+
+void placement_apply(pid_t pid, int cpu, int error_fd) {
+  if(cpu >= 0)
+    set_affinity(pid, cpu, error_fd);
+  placement_lower_priorities(pid, error_fd);
+}
+
+int placement_pin_self(int cpu, cpu_set_t *saved, int error_fd) {
+  return cpu >= 0
+    && 0 == sched_getaffinity(0, sizeof(*saved), saved)
+    && set_affinity(0, cpu, error_fd);
+}
+
+void placement_unpin_self(const cpu_set_t *saved) {
+  sched_setaffinity(0, sizeof(*saved), saved);
+}
+
+void placement_lower_priorities(pid_t pid, int error_fd) {
+  // Children of instrumented processes already have it
+  if(config.nice) {
+    errno = 0;
+    int prio = getpriority(PRIO_PROCESS, pid);
+    if(!errno && prio < config.nice && 0 != setpriority(PRIO_PROCESS, pid, config.nice))
+      safe_fprintf(error_fd, PREFIX "failed to set priority: %s\n", sys_errlist[errno]);
+  }
+
+  if(config.ioprio_class) {
+    int ioprio = (config.ioprio_class << IOPRIO_CLASS_SHIFT) | config.ioprio_level;
+    if(0 != syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, pid, ioprio))
+      safe_fprintf(error_fd, PREFIX "failed to set IO priority: %s\n", sys_errlist[errno]);
+  }
+}
+
+void placement_restore_self() {
+  if(config.policy != PLACEMENT_NONE)
+    sched_setaffinity(0, sizeof(orig_affinity), &orig_affinity);
+  // Fails if we are not privileged
+  if(config.nice)
+    setpriority(PRIO_PROCESS, 0, orig_nice);
+  if(config.ioprio_class && orig_ioprio >= 0)
+    syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, orig_ioprio);
+}
+
+void placement_unregister(pid_t pid) {
+  if(config.policy != PLACEMENT_LEAST_LOADED)
+    return;
+
+  unsigned i;
+  for(i = 0; i < MAX_TASKS; ++i) {
+    int32_t old = pid;
+    if(__atomic_compare_exchange_n(&state->tasks[i].pid, &old, 0, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+      return;
+  }
+}
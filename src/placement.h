@@ -0,0 +1,82 @@
+/*
+ * Copyright 2022 Yury Gribov
+ *
+ * Use of this source code is governed by MIT license that can be
+ * found in the LICENSE.txt file.
+ */
+
+#ifndef PLACEMENT_H
+#define PLACEMENT_H
+
+#include <sched.h>
+
+#include <sys/types.h>
+
+// Placement of instrumented processes.
+//
+// Valgrind serializes guest threads so instrumented process needs
+// about one core. Instrumented children can be pinned to CPUs
+// of configured set (round-robin or to CPU with fewest running
+// instrumented processes) and run with lower CPU and IO priority
+// so that they do not slow down uninstrumented processes
+// on critical path of the build.
+//
+// Least-loaded policy keeps table of pinned processes which is shared
+// between all processes in a run (see shm.h). Dead processes are
+// detected with kill(0) so table does not need cooperation
+// of instrumented processes.
+
+typedef enum {
+  PLACEMENT_NONE,
+  PLACEMENT_RR,
+  PLACEMENT_LEAST_LOADED,
+} PlacementPolicy;
+
+typedef struct {
+  PlacementPolicy policy;
+  const char *cpus;   // E.g. "0-7,16", NULL for CPUs which are available to us
+  int nice;           // Niceness, 0 if not used
+  int ioprio_class;   // IOPRIO_CLASS_* (see ioprio_set(2)), 0 if not used
+  int ioprio_level;
+} PlacementConfig;
+
+// Parses PREGRIND_IONICE ("idle" or "best-effort[:LEVEL]")
+int placement_parse_ionice(const char *s, int *cls, int *level);
+
+// Not async-safe, call at startup
+void placement_init(const PlacementConfig *cfg, int verbose, int error_fd);
+
+int placement_enabled();
+
+// Selects CPU for new instrumented process (-1 if it's not pinned)
+int placement_select();
+
+// Tells that process has been pinned to CPU
+void placement_register(pid_t pid, int cpu);
+
+// Called if process failed to start
+void placement_unregister(pid_t pid);
+
+// Pins process to CPU and lowers its priorities (pid 0 means self;
+// priorities which are already lower are not changed).
+// Failures are reported but not fatal.
+void placement_apply(pid_t pid, int cpu, int error_fd);
+
+// Pins calling thread to CPU (so that it's inherited by child which is
+// about to be spawned) and saves previous affinity.
+// Returns 0 if thread has not been pinned.
+int placement_pin_self(int cpu, cpu_set_t *saved, int error_fd);
+
+// Restores affinity of calling thread after spawn
+void placement_unpin_self(const cpu_set_t *saved);
+
+// Lowers priorities of process (pid 0 means calling thread).
+// They can't be raised back by unprivileged process so for spawned
+// children this is applied to child rather than inherited from parent.
+void placement_lower_priorities(pid_t pid, int error_fd);
+
+// Restores our affinity and (if we have permissions) priorities
+// after failed exec
+void placement_restore_self();
+
+#endif
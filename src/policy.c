@@ -0,0 +1,119 @@
+/*
+ * Copyright 2022 Yury Gribov
+ *
+ * Use of this source code is governed by MIT license that can be
+ * found in the LICENSE.txt file.
+ */
+
+#include "policy.h"
+#include "async_safe.h"
+#include "common.h"
+#include "config_file.h"
+#include "glob_set.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#define MAX_RULE_WORDS 128
+
+void policy_compile(BlobWriter *w, ConfigBlob *h, const char *name, int error_fd) {
+  FILE *p = config_open(name, "policy", error_fd);
+
+  // Rules are split between two automatons so we need to map
+  // pattern ids back to rules
+  GlobSet path_matcher, argv_matcher;
+  glob_set_init(&path_matcher);
+  glob_set_init(&argv_matcher);
+
+  BlobRule *rules = NULL;
+  uint32_t *path_rules = NULL, *argv_rules = NULL;
+
+  char *buf = NULL, *s;
+  size_t buf_size = 0;
+  unsigned num_rules = 0, max_rules = 0;
+  while((s = config_next_line(p, &buf, &buf_size))) {
+    char *words[MAX_RULE_WORDS + 1];
+    int num_words = config_split(s, words, MAX_RULE_WORDS);
+    if(num_words < 0) {
+      dprintf(safe_resolve_fd(error_fd), PREFIX "failed to read policy %s: too many flags\n", name);
+      abort();
+    }
+
+    if(num_rules == max_rules) {
+      max_rules = max_rules ? 2 * max_rules : 16;
+      rules = realloc(rules, max_rules * sizeof(BlobRule));
+      path_rules = realloc(path_rules, max_rules * sizeof(uint32_t));
+      argv_rules = realloc(argv_rules, max_rules * sizeof(uint32_t));
+      assert(rules && path_rules && argv_rules && "Failed to allocate policy");
+    }
+
+    BlobRule *rule = &rules[num_rules];
+    rule->pattern = blob_add_str(w, words[0]);
+    rule->flags = blob_add_strs(w, words + 1, num_words - 1);
+    rule->num_flags = num_words - 1;
+
+    if(0 == strncmp(words[0], "argv:", 5))
+      argv_rules[glob_set_add(&argv_matcher, words[0] + 5)] = num_rules;
+    else
+      path_rules[glob_set_add(&path_matcher, words[0])] = num_rules;
+
+    ++num_rules;
+  }
+
+  free(buf);
+  fclose(p);
+
+  glob_set_finalize(&path_matcher);
+  glob_set_finalize(&argv_matcher);
+
+  h->num_rules = num_rules;
+  h->rules = blob_add(w, rules, num_rules * sizeof(BlobRule));
+  h->path_rules = blob_add(w, path_rules, path_matcher.num_patterns * sizeof(uint32_t));
+  h->argv_rules = blob_add(w, argv_rules, argv_matcher.num_patterns * sizeof(uint32_t));
+  h->path_matcher = blob_add_glob_set(w, &path_matcher);
+  h->argv_matcher = blob_add_glob_set(w, &argv_matcher);
+
+  free(rules);
+  free(path_rules);
+  free(argv_rules);
+  glob_set_destroy(&path_matcher);
+  glob_set_destroy(&argv_matcher);
+}
+
+static const BlobRule *rules;
+static const uint32_t *path_rules, *argv_rules;
+static GlobSet path_matcher, argv_matcher;
+
+void policy_init(const ConfigBlob *b) {
+  if(!b->num_rules)
+    return;
+
+  rules = blob_ptr(b, b->rules);
+  path_rules = blob_ptr(b, b->path_rules);
+  argv_rules = blob_ptr(b, b->argv_rules);
+  blob_glob_set(b, &b->path_matcher, &path_matcher);
+  blob_glob_set(b, &b->argv_matcher, &argv_matcher);
+}
+
+const BlobRule *policy_find(const char *path, char *const *argv, int error_fd) {
+  if(!rules)
+    return NULL;
+
+  int best = -1;
+
+  int id = glob_set_match(&path_matcher, path, error_fd);
+  if(id >= 0)
+    best = path_rules[id];
+
+  if(!glob_set_empty(&argv_matcher)) {
+    for(; argv[0]; ++argv) {
+      id = glob_set_match(&argv_matcher, argv[0], error_fd);
+      if(id >= 0 && (best < 0 || (int)argv_rules[id] < best))
+        best = argv_rules[id];
+    }
+  }
+
+  return best >= 0 ? &rules[best] : NULL;
+}
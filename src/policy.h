@@ -0,0 +1,34 @@
+/*
+ * Copyright 2022 Yury Gribov
+ *
+ * Use of this source code is governed by MIT license that can be
+ * found in the LICENSE.txt file.
+ */
+
+#ifndef POLICY_H
+#define POLICY_H
+
+#include <stddef.h>
+
+#include "config_blob.h"
+
+// Per-binary Valgrind flags.
+//
+// Policy file consists of rules
+//   PATTERN FLAG...
+// where PATTERN is a wildcard for path of executable or, if it starts
+// with "argv:", for any of its arguments. Flags of first matching rule
+// are appended to PREGRIND_FLAGS.
+//
+// Rules are stored in compiled configuration (see config_blob.h).
+
+// Parses policy file into configuration (or aborts)
+void policy_compile(BlobWriter *w, ConfigBlob *h, const char *name, int error_fd);
+
+// Not async-safe, call at startup
+void policy_init(const ConfigBlob *b);
+
+// Returns first matching rule or NULL
+const BlobRule *policy_find(const char *path, char *const *argv, int error_fd);
+
+#endif
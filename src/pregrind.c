@@ -7,6 +7,26 @@
 
 #include "async_safe.h"
 #include "common.h"
+#include "glob_set.h"
+#include "history.h"
+#include "journal.h"
+#include "launcher.h"
+#include "log.h"
+#include "admission.h"
+#include "allowlist.h"
+#include "cmd_queue.h"
+#include "config_blob.h"
+#include "exe_class.h"
+#include "path_cache.h"
+#include "placement.h"
+#include "policy.h"
+#include "profile.h"
+#include "result_cache.h"
+#include "sampling.h"
+#include "shell.h"
+#include "shm.h"
+#include "stats.h"
+#include "vg_client.h"
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -14,15 +34,18 @@
 #include <stdarg.h>
 #include <assert.h>
 #include <stdint.h>
+#include <limits.h>
 #include <errno.h>
-#include <ctype.h>
 
 #include <unistd.h>
 #include <fcntl.h>
 #include <dlfcn.h>
+#include <malloc.h>
 #include <sys/stat.h>
 #include <spawn.h>
 
+extern char **environ;
+
 int (*real_execl)(const char *path, const char *arg, ...);
 int (*real_execlp)(const char *file, const char *arg, ...);
 int (*real_execle)(const char *path, const char *arg, ...);
@@ -39,350 +62,804 @@ int (*real_posix_spawnp)(pid_t *pid, const char *file,
                          const posix_spawnattr_t *attrp,
                          char *const argv[], char *const envp[]);
 
-const char *vg_flags[128];
-const char *vg_log_path_templ;
-const char *log_file;
+const char *vg_path = "/usr/bin/valgrind";
+const char *vg_log_path_templ;  // "--log-file=DIR/vg.UID."
+size_t vg_log_path_templ_len;
+const char *vg_log_socket;  // "--log-socket=ADDR"
+const char *vg_fair_sched;  // "--fair-sched=..."
+// Configuration below is written once by maybe_init() and published
+// to other threads by release store to is_initialized
+const char *log_dir;
+const ConfigBlob *config;
+int config_from_env;    // Compiled from environment (rather than mapped)
+uint64_t config_env_hash;
+int config_fd = -1;     // Memfd with configuration for children (created on demand)
 int v;
 int disable;
+int shell_bypass;
 int i_am_root;
-char *blacklist[64];
-volatile int is_initialized;
-
-static int get_log_fd() {
-  static int log_fd = -1;
+GlobSet blacklist_matcher;
+int is_initialized;  // Use get_initialized()
+char **init_argv, **init_envp;
+int escalate;
+int record;
+char init_cwd[PATH_MAX];
+uint64_t run_key;
+int is_live;
+pid_t init_pid;
+uint64_t init_ns;
+int is_history_guest;
+int has_history_key;
+HistoryKey history_guest_key;
+pid_t init_ppid;
+uint64_t init_realtime_ns;
 
-  if(!log_file)
-    return STDERR_FILENO;
+#define safe_printf(fmt, ...) safe_fprintf(get_log_fd(), fmt, ##__VA_ARGS__)
 
-  if(log_fd > 0)
-    return log_fd;
+static int get_initialized() {
+  return __atomic_load_n(&is_initialized, __ATOMIC_ACQUIRE);
+}
 
-  // We delay opening the file until we have something to write.
-  // This is racy but this isn't a big deal (worst case the output will be corrupted).
-  log_fd = open(log_file, O_CREAT | O_WRONLY | O_APPEND, S_IRWXU | S_IRWXG | S_IRWXO);
-  if(-1 == log_fd) {
-    fprintf(stderr, PREFIX "open() of %s failed: %s\n", log_file, sys_errlist[errno]);
-    abort();
+static char **va_list_to_argv(va_list *ap, const char *arg0, SafeArena *arena) {
+  size_t n = 0;
+  if(arg0) {
+    va_list aq;
+    va_copy(aq, *ap);
+    for(n = 1; va_arg(aq, const char *); ++n);
+    va_end(aq);
   }
 
-  return log_fd;
-}
+  const char **args = safe_arena_alloc(arena, (n + 1) * sizeof(char *), LAZY_LOG_FD);
 
-#define safe_printf(fmt, ...) safe_fprintf(get_log_fd(), fmt, ##__VA_ARGS__)
-#define safe_puts(s) safe_fputs(get_log_fd(), s)
+  args[0] = arg0;
+  size_t i;
+  for(i = 1; i <= n; ++i)
+    args[i] = va_arg(*ap, const char *);  // Also reads trailing null
 
-// Reserve space for size and at least one trailing nullptr
-#define GET_EFFECTIVE_SIZE(size) ((size) - sizeof(MemControlBlock) - sizeof (char *))
+  return (char **)args;
+}
 
-static char **va_list_to_argv(va_list ap, const char *arg0) {
-  void *buf = safe_malloc(PAGE_SIZE >> 1, get_log_fd());
-  const char **args = (const char **)buf;
-  size_t max_args = GET_EFFECTIVE_SIZE(PAGE_SIZE >> 1) / sizeof(const char *);
+// Returns basename of argv[0] of current process (stored in buf)
+static const char *get_prog_name(char *buf, size_t size) {
+  FILE *p = fopen("/proc/self/cmdline", "rb");
+  assert(p && "Failed to read /proc");
 
-  args[0] = arg0;
-  ++args;
-  --max_args;
+  memset(buf, 0, size);
 
-  while(arg0) {
-    assert(max_args > 0 && "Too many arguments");
-    arg0 = va_arg(ap, const char *);
-    args[0] = arg0;
-    ++args;
-    --max_args;
-  } while(arg0);
+  size_t nread = fread(buf, 1, size, p);
+  fclose(p);
+  if(!nread || !memchr(buf, 0, size)) {
+    dprintf(get_log_fd(), PREFIX "fread() from /proc/self/cmdline failed: %s\n", sys_errlist[errno]);
+    abort();
+  }
 
-  return (char **)buf;
+  return safe_basename(buf);
 }
 
-static char *get_prog_name() {
-  FILE *p = fopen("/proc/self/cmdline", "rb");
-  assert(p && "Failed to read /proc");
+// Returns absolute path to directory from environment variable
+static const char *get_abs_dir_from_env(const char *var) {
+  const char *dir_rel = getenv(var);
+  if(!dir_rel || dir_rel[0] == '/')
+    return dir_rel;
 
-  static char s[128];
-  memset(s, 0, sizeof(s));
+  char *dir = realpath(dir_rel, 0);
+  if(!dir) {
+    fprintf(stderr, PREFIX "realpath() of %s failed: %s\n", dir_rel, sys_errlist[errno]);
+    abort();
+  }
 
-  int nread = fread(s, 1, sizeof(s), p);
-  if(nread < 0 || !memchr(s, 0, sizeof(s))) {
-    dprintf(get_log_fd(), PREFIX "fread() from /proc/self/exe failed: %s\n", sys_errlist[errno]);
+  // Absolutize to protect against chdirs
+  if(0 != setenv(var, dir, 1)) {
+    fprintf(stderr, PREFIX "setenv() failed: %s\n", sys_errlist[errno]);
     abort();
   }
 
-  return safe_basename(s);
+  free(dir);
+  return getenv(var);
+}
+
+// Valgrind adds its preloads to environment of client
+static int is_running_on_valgrind() {
+  const char *preload = getenv("LD_PRELOAD");
+  return RUNNING_ON_VALGRIND || (preload && strstr(preload, "/vgpreload_"));
+}
+
+// Launcher is marked by parent but guest inherits the mark
+// if launcher is not ours so also check the name
+static int is_valgrind_launcher() {
+  char buf[128];
+  // Arguments of constructor are cheaper than /proc
+  const char *name = init_argv && init_argv[0] ? safe_basename(init_argv[0]) : get_prog_name(buf, sizeof(buf));
+  // Parent passes resolved path
+  const char *valgrind = getenv("PREGRIND_VALGRIND");
+  return 0 == strcmp(name, safe_basename(valgrind ? valgrind : vg_path));
 }
 
-static char *trim_whites(char *s) {
-  for(; isspace(*s); ++s);
+static void init_real() {
+#define INIT_REAL(f) do { \
+    real_ ## f = (typeof(real_ ## f))dlsym(RTLD_NEXT, #f); \
+    assert(real_ ## f && "Failed to locate true exec"); \
+  } while(0)
+
+  INIT_REAL(execl);
+  INIT_REAL(execlp);
+  INIT_REAL(execle);
+  INIT_REAL(execv);
+  INIT_REAL(execvp);
+  INIT_REAL(execve);
+  INIT_REAL(execvpe);
+  INIT_REAL(posix_spawn);
+  INIT_REAL(posix_spawnp);
+
+#undef INIT_REAL
+}
 
-  char *end = NULL, *p;
-  for(p = s; *p; ++p) {
-    int space = isspace(*p);
-    if(end && !space)
-      end = NULL;
-    else if(!end && space)
-      end = p;
+// Maps configuration passed by instrumenting parent
+// (if it was compiled from the same variables).
+// Descriptor must have been validated by caller.
+static const ConfigBlob *get_parent_config(int fd, uint64_t hash) {
+  if(fd < 0)
+    return NULL;
+
+  const ConfigBlob *b = NULL;
+  if(hash == config_env_hash)
+    b = config_blob_map_fd(fd);
+
+  if(!b) {
+    close(fd);
+    return NULL;
   }
 
-  if(end)
-    *end = 0;
+  // Reuse for our children
+  fcntl(fd, F_SETFD, FD_CLOEXEC);
+  config_fd = fd;
 
-  return s;
+  return b;
 }
 
 static void maybe_init() {
-  assert(!is_initialized && "Init called twice");
+  assert(!get_initialized() && "Init called twice");
+
+  // Set if we have been started by instrumenting parent
+  char *guest = getenv(GUEST_VAR);
+
+  int parent_config_fd = -1, via_launcher = 0;
+  unsigned long long parent_config_hash = 0;
+  if(guest && 3 != sscanf(guest, "%d:%llx:%d", &parent_config_fd, &parent_config_hash, &via_launcher)) {
+    parent_config_fd = -1;
+    via_launcher = 0;
+  }
+
+  // Valgrind launcher only needs to exec the tool
+  // (it's also not instrumented so other features
+  // are not initialized)
+  if(via_launcher && is_valgrind_launcher()) {
+    // Clear the mark for guest in place (launcher passes
+    // its original environment to the tool)
+    strrchr(guest, ':')[1] = '0';
+    init_real();
+    return;
+  }
+
+  if(guest) {
+    // Variable may be inherited by processes which have closed
+    // and reused the descriptor so never trust (or close) it blindly
+    if(parent_config_fd >= 0 && !config_blob_is_memfd(parent_config_fd))
+      parent_config_fd = -1;
+    unsetenv(GUEST_VAR);
+  }
 
   const char *verbose = getenv("PREGRIND_VERBOSE");
   if(verbose) {
     v = atoi(verbose);
   }
 
-  const char *flags = getenv("PREGRIND_FLAGS");
-  if(flags) {
-    flags = strdup(flags);
+  log_dir = get_abs_dir_from_env("PREGRIND_LOG_PATH");
+  if(log_dir) {
+    size_t log_dir_len = strlen(log_dir);
+    vg_log_path_templ = malloc(log_dir_len + 40);
+    vg_log_path_templ_len = snprintf((char *)vg_log_path_templ, log_dir_len + 40, "--log-file=%s/vg.%d.", log_dir, (int)getuid());
+  }
 
-    size_t i = 0;
+  // Socket takes precedence over per-process files
+  const char *log_socket = getenv("PREGRIND_LOG_SOCKET");
+  if(log_socket && *log_socket) {
+    size_t size = strlen(log_socket) + 20;
+    vg_log_socket = malloc(size);
+    assert(vg_log_socket && "Failed to allocate log socket");
+    snprintf((char *)vg_log_socket, size, "--log-socket=%s", log_socket);
+  }
 
-    while(flags) {
-      for(; *flags == ' '; ++flags)
+  const char *events_file = NULL;
+  const char *log_format = getenv("PREGRIND_LOG_FORMAT");
+  if(log_format && 0 == strcmp(log_format, "binary")) {
+    if(!log_dir) {
+      fprintf(stderr, PREFIX "PREGRIND_LOG_FORMAT=binary requires PREGRIND_LOG_PATH\n");
+      abort();
+    }
+    size_t events_file_size = strlen(log_dir) + 30;
+    events_file = malloc(events_file_size);
+    assert(events_file && "Failed to allocate log path");
+    snprintf((char *)events_file, events_file_size, "%s/events.%d", log_dir, (int)getuid());
+  } else if(log_format && 0 != strcmp(log_format, "text")) {
+    fprintf(stderr, PREFIX "invalid PREGRIND_LOG_FORMAT (expected 'text' or 'binary'): %s\n", log_format);
+    abort();
+  }
 
-      if(!*flags)
-        break;
+  log_init(log_dir, events_file);
 
-      char *next = strchr(flags, ' ');
-      if(next) {
-        *next = 0;
-        ++next;
-      }
+  state_dir = get_abs_dir_from_env("PREGRIND_STATE_DIR");
+  if(!state_dir)
+    state_dir = log_dir;
 
-      assert(i < sizeof(vg_flags) / sizeof(vg_flags[0]) - 1 && "Too many flags");
-      vg_flags[i++] = flags;
+  const char *journal = getenv("PREGRIND_JOURNAL");
+  if(journal && atoi(journal)) {
+    journal_init(LAZY_LOG_FD);
+    init_ppid = getppid();
+    init_realtime_ns = journal_now_ns();
+  }
+
+  const char *path_cache = getenv("PREGRIND_PATH_CACHE");
+  if(path_cache) {
+    path_cache_init(atoi(path_cache), LAZY_LOG_FD);
+  }
 
-      flags = next;
+  SamplingConfig sampling;
+  memset(&sampling, 0, sizeof(sampling));
+  sampling.rate = SAMPLING_RATE_ONE;
+
+  const char *sample_rate = getenv("PREGRIND_SAMPLE_RATE");
+  if(sample_rate) {
+    char *end;
+    double rate = strtod(sample_rate, &end);
+    if(end == sample_rate || *end || !(rate >= 0 && rate <= 1)) {
+      dprintf(get_log_fd(), PREFIX "invalid PREGRIND_SAMPLE_RATE (expected number in [0, 1]): %s\n", sample_rate);
+      abort();
     }
+    sampling.rate = (uint32_t)(rate * SAMPLING_RATE_ONE);
+    // Tiny rates still instrument something
+    if(rate > 0 && !sampling.rate)
+      sampling.rate = 1;
+  }
 
-    vg_flags[i] = NULL;
+  const char *sample_first = getenv("PREGRIND_SAMPLE_FIRST");
+  if(sample_first) {
+    sampling.first = atoi(sample_first);
   }
 
-  char *log_dir_rel = getenv("PREGRIND_LOG_PATH");
-  if(log_dir_rel) {
-    char *log_dir = log_dir_rel;
-    if(log_dir[0] != '/') {
-      log_dir = realpath(log_dir, 0);
-      if(!log_dir) {
-        fprintf(stderr, PREFIX "realpath() of %s failed: %s\n", log_dir_rel, sys_errlist[errno]);
-        abort();
-      }
+  const char *shard = getenv("PREGRIND_SHARD");
+  if(shard) {
+    if(2 != sscanf(shard, "%u/%u", &sampling.shard, &sampling.num_shards)
+        || sampling.shard >= sampling.num_shards) {
+      dprintf(get_log_fd(), PREFIX "invalid PREGRIND_SHARD (expected I/N): %s\n", shard);
+      abort();
+    }
+  }
 
-      // Absolutize to protect against chdirs
-      if(0 != setenv("PREGRIND_LOG_PATH", log_dir, 1)) {
-        fprintf(stderr, PREFIX "setenv() failed: %s\n", sys_errlist[errno]);
-        abort();
-      }
+  const char *shard_key = getenv("PREGRIND_SHARD_KEY");
+  if(shard_key) {
+    if(0 == strcmp(shard_key, "argv"))
+      sampling.shard_by_argv = 1;
+    else if(0 != strcmp(shard_key, "path")) {
+      dprintf(get_log_fd(), PREFIX "invalid PREGRIND_SHARD_KEY (expected 'path' or 'argv'): %s\n", shard_key);
+      abort();
     }
+  }
 
-    const char *name = get_prog_name();
-    size_t name_len = strlen(name);
+  sampling_init(&sampling, LAZY_LOG_FD);
 
-    size_t log_dir_len = strlen(log_dir);
-    vg_log_path_templ = malloc(log_dir_len + 20);
-    sprintf((char *)vg_log_path_templ, "%s/vg.%d.", log_dir, (int)getuid());  // FIXME: snprintf
+  const char *max_jobs = getenv("PREGRIND_MAX_JOBS");
+  if(max_jobs) {
+    AdmissionConfig admission;
+    memset(&admission, 0, sizeof(admission));
 
-    log_file = malloc(log_dir_len + name_len + 30);
-    sprintf((char *)log_file, "%s/%s.%d.%d", log_dir, name, (int)getuid(), (int)getpid()); // FIXME: snprintf
+    admission.max_jobs = 0 == strcmp(max_jobs, "auto") ? 0 : atoi(max_jobs);
 
-    if(log_dir != log_dir_rel)
-      free(log_dir);
+    const char *job_mem = getenv("PREGRIND_JOB_MEM");
+    admission.job_mem_mb = job_mem ? (unsigned)atoi(job_mem) : 1024;
+
+    const char *over_limit = getenv("PREGRIND_OVER_LIMIT");
+    if(!over_limit || 0 == strcmp(over_limit, "wait"))
+      admission.action = OVER_LIMIT_WAIT;
+    else if(0 == strcmp(over_limit, "skip"))
+      admission.action = OVER_LIMIT_SKIP;
+    else {
+      dprintf(get_log_fd(), PREFIX "invalid PREGRIND_OVER_LIMIT (expected 'wait' or 'skip'): %s\n", over_limit);
+      abort();
+    }
+
+    admission_init(&admission, v, LAZY_LOG_FD);
   }
 
-  const char *disable_ = getenv("PREGRIND_DISABLE");
-  if(disable_) {
-    disable = atoi(disable_);
+  const char *placement = getenv("PREGRIND_PLACEMENT");
+  const char *nice = getenv("PREGRIND_NICE");
+  const char *ionice = getenv("PREGRIND_IONICE");
+  if(placement || nice || ionice) {
+    PlacementConfig placement_cfg;
+    memset(&placement_cfg, 0, sizeof(placement_cfg));
+
+    if(!placement || 0 == strcmp(placement, "none"))
+      placement_cfg.policy = PLACEMENT_NONE;
+    else if(0 == strcmp(placement, "rr"))
+      placement_cfg.policy = PLACEMENT_RR;
+    else if(0 == strcmp(placement, "least-loaded"))
+      placement_cfg.policy = PLACEMENT_LEAST_LOADED;
+    else {
+      dprintf(get_log_fd(), PREFIX "invalid PREGRIND_PLACEMENT (expected 'rr' or 'least-loaded'): %s\n", placement);
+      abort();
+    }
+
+    placement_cfg.cpus = getenv("PREGRIND_CPUS");
+    placement_cfg.nice = nice ? atoi(nice) : 0;
+
+    if(ionice && !placement_parse_ionice(ionice, &placement_cfg.ioprio_class, &placement_cfg.ioprio_level)) {
+      dprintf(get_log_fd(), PREFIX "invalid PREGRIND_IONICE (expected 'idle' or 'best-effort[:LEVEL]'): %s\n", ionice);
+      abort();
+    }
+
+    placement_init(&placement_cfg, v, LAZY_LOG_FD);
   }
 
-  const char *blacklist_name = getenv("PREGRIND_BLACKLIST");
-  if(blacklist_name) {
-    FILE *p = fopen(blacklist_name, "rb");
-    if(!p) {
-      dprintf(get_log_fd(), PREFIX "failed to open blacklist file %s\n", blacklist_name);
+  const char *fair_sched = getenv("PREGRIND_FAIR_SCHED");
+  if(fair_sched) {
+    if(0 != strcmp(fair_sched, "yes") && 0 != strcmp(fair_sched, "try") && 0 != strcmp(fair_sched, "no")) {
+      dprintf(get_log_fd(), PREFIX "invalid PREGRIND_FAIR_SCHED (expected 'yes', 'try' or 'no'): %s\n", fair_sched);
       abort();
     }
+    static char vg_fair_sched_buf[32];
+    snprintf(vg_fair_sched_buf, sizeof(vg_fair_sched_buf), "--fair-sched=%s", fair_sched);
+    vg_fair_sched = vg_fair_sched_buf;
+  }
 
-    char buf[128];
-    size_t i = 0;
-    while(fgets(buf, sizeof(buf), p)) {
-      char *s = buf;
+  const char *profile = getenv("PREGRIND_PROFILE");
+  if(profile && *profile) {
+    ProfileConfig profile_cfg;
+    memset(&profile_cfg, 0, sizeof(profile_cfg));
 
-      char *nl = strchr(s, '\n');
-      if(nl)
-        *nl = 0;
+    if(!profile_parse_tool(profile, &profile_cfg.tool)) {
+      dprintf(get_log_fd(), PREFIX "invalid PREGRIND_PROFILE (expected 'callgrind' or 'cachegrind'): %s\n", profile);
+      abort();
+    }
 
-      if(i >= sizeof(blacklist) / sizeof(blacklist[0])) {
-        dprintf(get_log_fd(), PREFIX "failed to read patterns from %s: too many\n", blacklist_name);
-        abort();
-      }
+    profile_cfg.dir = get_abs_dir_from_env("PREGRIND_PROFILE_DIR");
+    if(!profile_cfg.dir)
+      profile_cfg.dir = log_dir;
+    if(!profile_cfg.dir) {
+      dprintf(get_log_fd(), PREFIX "PREGRIND_PROFILE requires PREGRIND_PROFILE_DIR or PREGRIND_LOG_PATH\n");
+      abort();
+    }
 
-      // Strip comments
-      char *comment = strchr(s, '#');
-      if(comment)
-        *comment = 0;
+    profile_cfg.toggle = getenv("PREGRIND_PROFILE_TOGGLE");
 
-      s = trim_whites(s);
+    const char *instr_atstart = getenv("PREGRIND_PROFILE_INSTR_ATSTART");
+    if(!instr_atstart || 0 == strcmp(instr_atstart, "yes"))
+      profile_cfg.instr_atstart = 1;
+    else if(0 != strcmp(instr_atstart, "no")) {
+      dprintf(get_log_fd(), PREFIX "invalid PREGRIND_PROFILE_INSTR_ATSTART (expected 'yes' or 'no'): %s\n", instr_atstart);
+      abort();
+    }
+
+    profile_init(&profile_cfg, v, LAZY_LOG_FD);
+  }
 
-      if(*s)
-        blacklist[i++] = strdup(s);
+  // Resolve Valgrind once instead of searching for it on every exec
+  const char *valgrind = getenv("PREGRIND_VALGRIND");
+  if(!valgrind)
+    valgrind = "valgrind";
+  if(strchr(valgrind, '/'))
+    vg_path = valgrind;
+  else {
+    static char vg_path_buf[PATH_MAX];
+    const char *path = find_file_in_path(valgrind, vg_path_buf, sizeof(vg_path_buf), LAZY_LOG_FD);
+    if(path) {
+      vg_path = path;
+      // So that children do not search again
+      setenv("PREGRIND_VALGRIND", vg_path, 1);
+    } else if(getenv("PREGRIND_VALGRIND")) {
+      dprintf(get_log_fd(), PREFIX "failed to find %s in PATH\n", valgrind);
+      abort();
     }
+  }
 
-    fclose(p);
+  const char *vg_lib = getenv("PREGRIND_VALGRIND_LIB");
+  if(vg_lib && *vg_lib) {
+    launcher_init(vg_lib, vg_path, LAZY_LOG_FD);
   }
 
-#define INIT_REAL(f) do { \
-    real_ ## f = (typeof(real_ ## f))dlsym(RTLD_NEXT, #f); \
-    assert(real_ ## f && "Failed to locate true exec"); \
-  } while(0)
+  const char *skip_classes = getenv("PREGRIND_SKIP");
+  if(skip_classes) {
+    unsigned mask;
+    if(!exe_class_parse(skip_classes, &mask)) {
+      dprintf(get_log_fd(), PREFIX "invalid PREGRIND_SKIP (expected list of 'script', 'static', 'foreign' or 'go'): %s\n", skip_classes);
+      abort();
+    }
+    exe_class_init(mask, LAZY_LOG_FD);
+  }
 
-  INIT_REAL(execl);
-  INIT_REAL(execlp);
-  INIT_REAL(execle);
-  INIT_REAL(execv);
-  INIT_REAL(execvp);
-  INIT_REAL(execve);
-  INIT_REAL(execvpe);
-  INIT_REAL(posix_spawn);
-  INIT_REAL(posix_spawnp);
+  // Precompiled configuration is just mapped, otherwise we compile it here
+  const char *config_file = getenv("PREGRIND_CONFIG");
+  const char *flags = getenv("PREGRIND_FLAGS");
+  const char *blacklist = getenv("PREGRIND_BLACKLIST");
+  const char *policy = getenv("PREGRIND_POLICY");
+  const char *allowlist = getenv("PREGRIND_ALLOWLIST");
+  if(config_file) {
+    if(v && (flags || blacklist || policy || allowlist))
+      dprintf(get_log_fd(), PREFIX "PREGRIND_CONFIG overrides PREGRIND_FLAGS, PREGRIND_BLACKLIST, PREGRIND_POLICY and PREGRIND_ALLOWLIST\n");
+    config = config_blob_map(config_file, LAZY_LOG_FD);
+  } else if(flags || blacklist || policy || allowlist) {
+    // Instrumented processes are slow so they avoid parsing
+    // if parent has already done it
+    config_env_hash = config_blob_env_hash();
+    config = get_parent_config(parent_config_fd, parent_config_hash);
+    if(config) {
+      if(v)
+        dprintf(get_log_fd(), PREFIX "using configuration of parent\n");
+    } else
+      config = config_blob_compile(flags, blacklist, policy, allowlist, LAZY_LOG_FD);
+    config_from_env = 1;
+  } else {
+    static ConfigBlob empty_config;
+    config = &empty_config;
+  }
+  if(!config_from_env && parent_config_fd >= 0)
+    close(parent_config_fd);
+  blob_glob_set(config, &config->blacklist_matcher, &blacklist_matcher);
+  policy_init(config);
+  allowlist_init(config);
+
+  const char *skip_clean = getenv("PREGRIND_SKIP_CLEAN");
+  if(skip_clean) {
+    if(!HAVE_VALGRIND_H)
+      dprintf(get_log_fd(), PREFIX "PREGRIND_SKIP_CLEAN needs Pregrind built with Valgrind headers, ignoring\n");
+    else if(profile_enabled())
+      // Profiling runs do not check for errors
+      dprintf(get_log_fd(), PREFIX "PREGRIND_SKIP_CLEAN is not compatible with PREGRIND_PROFILE, ignoring\n");
+    else
+      result_cache_init(atoi(skip_clean), LAZY_LOG_FD);
+  }
 
-#undef INIT_REAL
+  const char *escalate_ = getenv("PREGRIND_ESCALATE");
+  if(escalate_ && atoi(escalate_)) {
+    if(!HAVE_VALGRIND_H)
+      dprintf(get_log_fd(), PREFIX "PREGRIND_ESCALATE needs Pregrind built with Valgrind headers, ignoring\n");
+    else if(!state_dir)
+      dprintf(get_log_fd(), PREFIX "PREGRIND_ESCALATE needs state directory, ignoring\n");
+    else if(getcwd(init_cwd, sizeof(init_cwd)))
+      escalate = 1;
+  }
+
+  const char *record_ = getenv("PREGRIND_RECORD");
+  if(record_ && atoi(record_)) {
+    if(!state_dir)
+      dprintf(get_log_fd(), PREFIX "PREGRIND_RECORD needs state directory, ignoring\n");
+    else
+      record = 1;
+  }
+
+  // Set if we are instrumented (variable is not removed as it needs
+  // to pass through Valgrind launcher)
+  const char *run_key_str = getenv(RUN_KEY_VAR);
+  if(run_key_str) {
+    run_key = strtoull(run_key_str, NULL, 16);
+  }
+
+  const char *stats = getenv("PREGRIND_STATS");
+  if(stats && atoi(stats)) {
+    stats_init(LAZY_LOG_FD);
+  }
+
+  // Set if we have been started under Valgrind. Variable is removed
+  // so that it's not inherited by our children but it needs to pass
+  // through Valgrind launcher first.
+  if(getenv(STATS_LIVE_VAR) && guest) {
+    unsetenv(STATS_LIVE_VAR);
+    is_live = 1;
+  }
+
+  const char *budget = getenv("PREGRIND_BUDGET");
+  const char *history = getenv("PREGRIND_HISTORY");
+  if(budget || (history && atoi(history))) {
+    history_init(budget ? atof(budget) : 0, LAZY_LOG_FD);
+  }
+
+  // Same as above
+  const char *history_key = getenv(HISTORY_VAR);
+  if(history_key && guest) {
+    unsigned long long key, stamp, start;
+    if(3 == sscanf(history_key, "%llx:%llx:%llx", &key, &stamp, &start)) {
+      is_history_guest = 1;
+      history_guest_key.key = key;
+      history_guest_key.stamp = stamp;
+      has_history_key = 1;
+      init_ns = start;
+    }
+    unsetenv(HISTORY_VAR);
+  }
+
+  init_pid = getpid();
+  if(!is_history_guest && history_enabled()) {
+    init_ns = history_now_ns();
+    has_history_key = history_self_key(&history_guest_key);
+  }
+
+  // Arena should be able to hold all arguments of exec'd process
+  // (limit reported for unlimited stack is too large though)
+  long arg_max = sysconf(_SC_ARG_MAX);
+  if(arg_max <= 0 || arg_max > (64l << 20))
+    arg_max = 64l << 20;
+  safe_arena_set_size(4 * arg_max + (1 << 20));
+
+  const char *disable_ = getenv("PREGRIND_DISABLE");
+  if(disable_) {
+    disable = atoi(disable_);
+  }
+
+  const char *shell_bypass_ = getenv("PREGRIND_SHELL_BYPASS");
+  if(shell_bypass_) {
+    shell_bypass = atoi(shell_bypass_);
+  }
+
+  init_real();
 
   i_am_root = getuid() == 0;
 
   if(v)
-    dprintf(get_log_fd(), PREFIX "initialized: v=%d, vg_log_path_templ=%s, log_file=%s, i_am_root=%d\n", v, vg_log_path_templ ? vg_log_path_templ : "(stderr)", log_file, i_am_root);
+    dprintf(get_log_fd(), PREFIX "initialized: v=%d, vg_path=%s, vg_log_path_templ=%s, vg_log_socket=%s, log_dir=%s, config=%s, i_am_root=%d\n", v, vg_path, vg_log_path_templ ? vg_log_path_templ : "(stderr)", vg_log_socket ? vg_log_socket : "(none)", log_dir ? log_dir : "(stderr)", config_file ? config_file : "(env)", i_am_root);
 
-  // TODO: membar
-  asm("");
-  is_initialized = 1;
+  // Publish configuration to threads which may already be running
+  // (e.g. if we were dlopened)
+  __atomic_store_n(&is_initialized, 1, __ATOMIC_RELEASE);
+}
+
+static const char **get_valgrind_flags(const char *path, char *const *argv, SafeArena *arena);
+
+// Key of our record in escalation queue (0 if not queued)
+static uint64_t escalate_key;
+
+// Parent can't see exit status of exec'd process so instrumented
+// process queues itself at start and appends its result at exit
+// (runs which crash, are killed or exec are thus escalated too)
+static void escalate_start() {
+  if(!escalate || !RUNNING_ON_VALGRIND || !init_argv || !init_envp)
+    return;
+
+  char path[PATH_MAX];
+  ssize_t path_len = readlink("/proc/self/exe", path, sizeof(path) - 1);
+  if(path_len <= 0)
+    return;
+  path[path_len] = 0;
+
+  SafeArena arena = SAFE_ARENA_INIT;
+  // So that rerun keeps flags of the first pass
+  const char **flags = get_valgrind_flags(path, init_argv, &arena);
+  escalate_key = cmd_queue_append(ESCALATE_QUEUE, path, init_cwd, init_argv, init_envp, flags,
+                                  /*instrument*/ 1, REASON_NONE, /*errors*/ -1, &arena, LAZY_LOG_FD);
+  safe_arena_free(&arena, LAZY_LOG_FD);
 }
 
 // Avoid issues with async-safety of dlsym by reading symbols at startup
 __attribute__((constructor))
-static void dummy() {
+static void dummy(int argc, char **argv, char **envp) {
+  (void)argc;
+  init_argv = argv;
+  init_envp = envp;
   maybe_init();
+  escalate_start();
 }
 
-static char **init_valgrind_argv(char * const *argv) {
-  void *buf = safe_malloc(PAGE_SIZE >> 1, get_log_fd());
-  const char **new_args = buf;
-  size_t max_args = GET_EFFECTIVE_SIZE(PAGE_SIZE >> 1) / sizeof(char *);
+__attribute__((destructor))
+static void fini() {
+  // Leaks are not known at this point so they are ignored.
+  // Forked children share run key with parent so do not count them.
+  if(run_key && RUNNING_ON_VALGRIND && getpid() == init_pid && 0 == VALGRIND_COUNT_ERRORS)
+    result_cache_record_clean(run_key);
+
+  if(is_live && getpid() == init_pid)
+    stats_live_dec();
+
+  if(escalate_key && getpid() == init_pid) {
+    int errors = VALGRIND_COUNT_ERRORS;
+    if(v && errors)
+      safe_printf(PREFIX "escalating run with %d errors\n", errors);
+    cmd_queue_append_result(ESCALATE_QUEUE, escalate_key, errors, LAZY_LOG_FD);
+  }
 
-  new_args[0] = safe_strdup("/usr/bin/valgrind", get_log_fd());
-  ++new_args;
-  --max_args;
+  if(history_enabled() && has_history_key && getpid() == init_pid)
+    history_record_self(is_history_guest, history_guest_key, init_ns);
 
-  if(vg_log_path_templ) {
-    char *name = safe_basename(argv[0]);
+  if(journal_enabled()) {
+    int instrumented = is_running_on_valgrind();
+    if(getpid() == init_pid)
+      journal_record_self(instrumented, init_ppid, init_realtime_ns);
+    else  // Forked child
+      journal_record_self(instrumented, init_pid, 0);
+  }
+}
+
+static size_t count_args(const char *const *args) {
+  size_t n;
+  for(n = 0; args[n]; ++n);
+  return n;
+}
+
+// Only pointers are copied so new argv must not outlive the original one
+static char **init_valgrind_argv(const char *path, char * const *argv, SafeArena *arena) {
+  const BlobRule *rule = policy_find(path, argv, LAZY_LOG_FD);
+  if(rule && v)
+    safe_printf(PREFIX "using policy '%s' for %s\n", blob_str(config, rule->pattern), path);
+
+  size_t num_args = count_args((const char *const *)argv);
+  size_t num_rule_flags = rule ? rule->num_flags : 0;
+  size_t max_args = 3 + profile_max_args() + config->num_flags + num_rule_flags + num_args + 1;
+  const char **new_args = safe_arena_alloc(arena, max_args * sizeof(char *), LAZY_LOG_FD);
+  size_t i = 0;
+
+  new_args[i++] = vg_path;
+
+  if(vg_log_socket) {
+    new_args[i++] = vg_log_socket;
+  } else if(vg_log_path_templ) {
+    // Valgrind understands %p
+    const char *name = safe_basename(path);
     size_t name_len = strlen(name);
+    char *out = safe_arena_alloc(arena, vg_log_path_templ_len + name_len + 4, LAZY_LOG_FD);
+    memcpy(out, vg_log_path_templ, vg_log_path_templ_len);
+    memcpy(out + vg_log_path_templ_len, name, name_len);
+    memcpy(out + vg_log_path_templ_len + name_len, ".%p", 4);
+    new_args[i++] = out;
+  }
 
-    size_t templ_len = strlen(vg_log_path_templ);
-    char *out = safe_malloc(templ_len + name_len + 20, get_log_fd());
-    sprintf(out, "--log-file=%s%s.%%p", vg_log_path_templ, name);  // Valgrind understands %%p  // FIXME: snprintf
+  // Goes before user flags so that they can override it
+  if(vg_fair_sched)
+    new_args[i++] = vg_fair_sched;
 
-    new_args[0] = out;
-    ++new_args;
-    --max_args;
+  // Also goes before user flags
+  i += profile_add_args(path, &new_args[i], arena, LAZY_LOG_FD);
 
-  }
+  size_t j;
+  for(j = 0; j < config->num_flags; ++j)
+    new_args[i++] = blob_strs_get(config, config->flags, j);
 
-  const char **vg_flag;
-  for(vg_flag = vg_flags; vg_flag[0]; ++vg_flag, ++new_args, --max_args) {
-    assert(max_args && "Too many flags");
-    new_args[0] = safe_strdup(vg_flag[0], get_log_fd());
-  }
+  for(j = 0; j < num_rule_flags; ++j)
+    new_args[i++] = blob_strs_get(config, rule->flags, j);
 
-  for(; argv[0]; ++new_args, --max_args, ++argv) {
-    assert(max_args && "Too many arguments");
-    new_args[0] = safe_strdup(argv[0], get_log_fd());
+  // Pass resolved path so that Valgrind does not search PATH again
+  new_args[i++] = path;
+  if(num_args) {
+    memcpy(&new_args[i], argv + 1, (num_args - 1) * sizeof(char *));
+    i += num_args - 1;
   }
 
-  if(v) {
-    safe_puts(PREFIX "executing: ");
-    for(const char **p = new_args; *p; ++p) {
-      safe_puts(*p);
-      safe_puts(" ");
-    }
-    safe_puts("\n");
-  }
+  new_args[i] = NULL;
 
-  return (char **)buf;
-}
+  if(v)
+    log_strings(PREFIX "executing: ", new_args, arena);
 
-static void free_valgrind_argv(char **argv) {
-  for (size_t i = 0; argv[i]; ++i)
-    safe_free(argv[i], get_log_fd());
-  safe_free(argv, get_log_fd());
+  return (char **)new_args;
 }
 
-static const char *find_file_in_path(const char *file, char *buf, size_t buf_sz) {
-  const char *path = getenv("PATH");
-  if(!path)
-    return NULL;
-
-  struct stat perm;
-  do {
-    char *next = strchr(path, ':');
-
-    int is_empty = (next && next == path + 1) || (!next && !path[0]);
-    int needed;
-    if(is_empty) {
-      needed = snprintf(buf, buf_sz, "%s", file);
-    } else {
-      int len = next ? next - path : (int)strlen(path);
-      needed = snprintf(buf, buf_sz, "%.*s/%s", len, path, file);
-    }
+// Process which is about to be started under Valgrind
+typedef struct {
+  char path_buf[256];
+  const char *path;     // Resolved path of executable
+  uint64_t run_key;     // Key in result cache (0 if not used)
+  int slot_fd;          // Admission slot (-1 if not used)
+  Reason reason;        // Why target is not instrumented
+  uint64_t estimate_ns; // Estimated overhead of instrumentation (0 if unknown)
+  HistoryKey history_key;
+  int cpu;              // CPU which process is pinned to (-1 if not used)
+  int config_fd;        // Configuration passed to child (-1 if not used)
+  char tool_buf[PATH_MAX];  // Valgrind tool which is started directly
+  char env_buf[5][96];  // Storage for variables passed to Valgrind
+  const char *env[7];
+  size_t num_env;
+} Target;
+
+// Returns copy of configuration descriptor for child
+// (with FD_CLOEXEC, see get_spawn_file_actions) or -1
+static int dup_config_fd() {
+  // Mapped configuration is cheap to load
+  if(!config_from_env)
+    return -1;
+
+  int fd = __atomic_load_n(&config_fd, __ATOMIC_ACQUIRE);
+  if(fd < 0) {
+    int new_fd = config_blob_memfd(config, LAZY_LOG_FD);
+    if(new_fd < 0)
+      return -1;
+    // Other thread may have created it concurrently
+    if(__atomic_compare_exchange_n(&config_fd, &fd, new_fd, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+      fd = new_fd;
+    else
+      close(new_fd);
+  }
 
-    if(needed < 0 || (size_t)needed >= buf_sz) {
-      safe_printf(PREFIX "failed to find file %s in path: string too long\n", file);
-      return NULL;
-    }
+  return fcntl(fd, F_DUPFD_CLOEXEC, 0);
+}
 
-    if(0 == stat(buf, &perm))
-      return buf;
+static void add_target_env(Target *t, const char *fmt, ...) {
+  char *buf = t->env_buf[t->num_env];
+  va_list ap;
+  va_start(ap, fmt);
+  vsnprintf(buf, sizeof(t->env_buf[0]), fmt, ap);
+  va_end(ap);
+  t->env[t->num_env++] = buf;
+  t->env[t->num_env] = NULL;
+}
 
-    path = next ? next + 1 : 0;
-  } while(path);
+static int skip(Target *t, Reason reason, const char *path) {
+  t->path = path;
+  t->reason = reason;
+  return 0;
+}
 
-  return NULL;
+// Hashes Valgrind flags for executable (see get_valgrind_flags)
+static uint64_t hash_valgrind_flags(const char *path, char *const *argv) {
+  const BlobRule *rule = policy_find(path, argv, LAZY_LOG_FD);
+  uint64_t h = HASH_INIT;
+  uint32_t j;
+  for(j = 0; j < config->num_flags; ++j)
+    h = hash_str(h, blob_strs_get(config, config->flags, j));
+  for(j = 0; rule && j < rule->num_flags; ++j)
+    h = hash_str(h, blob_strs_get(config, rule->flags, j));
+  return h;
 }
 
-static int can_instrument(const char *arg0, char *const *argv) {
-  if(!is_initialized)  // If initializer hasn't been called, we can't do much (we have to be async-safe)
+// Returns 1 if process should be instrumented and fills target info.
+// Cwd is directory of process (NULL if it's ours).
+static int can_instrument(const char *arg0, char *const *argv, char *const *envp, int file_or_path,
+                          const char *cwd, Target *t) {
+  t->path = arg0;
+  t->run_key = 0;
+  t->slot_fd = -1;
+  t->reason = REASON_NONE;
+  t->estimate_ns = 0;
+  t->cpu = -1;
+  t->config_fd = -1;
+  t->num_env = 0;
+  t->env[0] = NULL;
+
+  if(!get_initialized())  // If initializer hasn't been called, we can't do much (we have to be async-safe)
     return 0;
 
   if(disable)
-    return 0;
+    return skip(t, REASON_DISABLED, arg0);
 
   // Do not try to instrument Valgrind itself
-  if(strstr(arg0, "valgrind") || strstr(argv[0], "valgrind")) {
+  if(strstr(arg0, "valgrind") || strstr(argv[0], "valgrind") || 0 == strcmp(arg0, vg_path)) {
     if(v)
       safe_printf(PREFIX "not instrumenting %s: it's Valgrind!\n", arg0);
-    return 0;
+    return skip(t, REASON_VALGRIND, arg0);
   }
 
-  char buf[256];
-  if(!strchr(arg0, '/')) {
-    const char *path = find_file_in_path(arg0, buf, sizeof(buf));
+  // Only exec*p functions search PATH
+  if(file_or_path && !strchr(arg0, '/')) {
+    const char *path = find_file_in_path(arg0, t->path_buf, sizeof(t->path_buf), LAZY_LOG_FD);
     if(!path) {
       safe_printf(PREFIX "not instrumenting %s: failed to find file in path\n", arg0);
-      return 0;
+      return skip(t, REASON_NOT_FOUND, arg0);
     }
     arg0 = path;
   }
 
-  size_t i;
-  for(i = 0; i < sizeof(blacklist) / sizeof(blacklist[0]) && blacklist[i]; ++i) {
-    if(safe_fnmatch(blacklist[i], arg0)) {
+  if(!glob_set_empty(&blacklist_matcher)) {
+    int i = glob_set_match(&blacklist_matcher, arg0, LAZY_LOG_FD);
+    if(i >= 0) {
+      if(v)
+        safe_printf(PREFIX "not instrumenting %s: blacklisted by '%s'\n", arg0, blob_strs_get(config, config->blacklist, i));
+      return skip(t, REASON_BLACKLIST, arg0);
+    }
+  }
+
+  if(allowlist_enabled()) {
+    int i = allowlist_match(arg0, argv, envp, cwd, LAZY_LOG_FD);
+    if(i < 0) {
       if(v)
-        safe_printf(PREFIX "not instrumenting %s: blacklisted\n", arg0);
-      return 0;
+        safe_printf(PREFIX "not instrumenting %s: not in allowlist\n", arg0);
+      return skip(t, REASON_ALLOWLIST, arg0);
     }
+    if(v)
+      safe_printf(PREFIX "%s allowed by '%s'\n", arg0, blob_strs_get(config, config->allowlist, i));
   }
 
   struct stat perm;
@@ -390,111 +867,498 @@ static int can_instrument(const char *arg0, char *const *argv) {
     if(v)
       safe_printf(PREFIX "stat() failed on %s: %s\n", arg0, sys_errlist[errno]);
     // Do not abort() as some packages seem to check for presense of files by trying to run them
-    return 0;
+    return skip(t, REASON_STAT, arg0);
   }
 
   // Avoid calling setuids as VG can't instrument them
   if(!i_am_root && (perm.st_mode & (S_ISUID | S_ISGID | S_ISVTX))) {
     if(v)
       safe_printf(PREFIX "not instrumenting %s: setuid\n", arg0);
+    return skip(t, REASON_SETUID, arg0);
+  }
+
+  const char *reason;
+  if(!exe_class_allows(arg0, &perm, &reason)) {
+    if(v)
+      safe_printf(PREFIX "not instrumenting %s: %s\n", arg0, reason);
+    return skip(t, REASON_CLASS, arg0);
+  }
+
+  if(!sampling_allows(arg0, argv, &reason)) {
+    if(v)
+      safe_printf(PREFIX "not instrumenting %s: %s\n", arg0, reason);
+    return skip(t, REASON_SAMPLING, arg0);
+  }
+
+  if(result_cache_enabled()) {
+    t->run_key = result_cache_key(arg0, &perm, argv, hash_valgrind_flags(arg0, argv));
+    if(!result_cache_allows(t->run_key, &reason)) {
+      if(v)
+        safe_printf(PREFIX "not instrumenting %s: %s\n", arg0, reason);
+      return skip(t, REASON_RESULT_CACHE, arg0);
+    }
+    add_target_env(t, RUN_KEY_VAR "=%llx", (unsigned long long)t->run_key);
+  }
+
+  if(history_enabled()) {
+    t->history_key = history_key(&perm, argv);
+    reason = NULL;
+    if(!history_allows(t->history_key, &reason, &t->estimate_ns)) {
+      if(v)
+        safe_printf(PREFIX "not instrumenting %s: %s (estimated overhead %llu ms)\n", arg0, reason, (unsigned long long)(t->estimate_ns / 1000000));
+      return skip(t, REASON_BUDGET, arg0);
+    }
+    if(v && reason)
+      safe_printf(PREFIX "instrumenting %s: %s (estimated overhead %llu ms)\n", arg0, reason, (unsigned long long)(t->estimate_ns / 1000000));
+  }
+
+  t->path = arg0;
+  return 1;
+}
+
+static int exec_uninstrumented(const char *arg0, char *const *argv, int file_or_path, int has_envp, char *const *envp) {
+  return has_envp && file_or_path ? real_execvpe(arg0, argv, envp)
+    : has_envp && !file_or_path ? real_execve(arg0, argv, envp)
+    : !has_envp && file_or_path ? real_execvp(arg0, argv)
+    : /* !has_envp && !file_or_path */ real_execv(arg0, argv);
+}
+
+// Returns 0 if process could not be admitted
+static int admit(Target *t) {
+  const char *reason;
+  if(!admission_acquire(&t->slot_fd, &reason, LAZY_LOG_FD)) {
+    if(v)
+      safe_printf(PREFIX "not instrumenting %s: %s\n", t->path, reason);
+    return skip(t, REASON_ADMISSION, t->path);
+  }
+
+  if(t->slot_fd >= 0)
+    add_target_env(t, SLOT_FD_VAR "=%d", t->slot_fd);
+
+  return 1;
+}
+
+static void record_decision(Target *t, int instrument, uint64_t decide_ns) {
+  if(get_initialized()) {
+    log_event(instrument ? DECISION_INSTRUMENT : DECISION_SKIP, t->reason, t->path);
+    stats_decided(t->path, instrument, t->reason, decide_ns);
+  }
+}
+
+// Returns 1 if process should be instrumented and has been admitted
+static int decide(const char *arg0, char *const *argv, char *const *envp, int file_or_path, Target *t) {
+  uint64_t start = stats_enabled() ? stats_now_ns() : 0;
+  int instrument = can_instrument(arg0, argv, envp, file_or_path, /*cwd*/ NULL, t);
+  uint64_t decide_ns = stats_enabled() ? stats_now_ns() - start : 0;
+
+  instrument = instrument && admit(t);
+
+  record_decision(t, instrument, decide_ns);
+
+  if(instrument && stats_enabled()) {
+    add_target_env(t, STATS_LIVE_VAR "=1");
+    stats_live_inc();
+  }
+
+  if(instrument && history_enabled()) {
+    add_target_env(t, HISTORY_VAR "=%llx:%llx:%llx",
+                   (unsigned long long)t->history_key.key,
+                   (unsigned long long)t->history_key.stamp,
+                   (unsigned long long)history_now_ns());
+  }
+
+  if(instrument)
+    t->config_fd = dup_config_fd();
+
+  if(instrument && placement_enabled()) {
+    t->cpu = placement_select();
+    if(v && t->cpu >= 0)
+      safe_printf(PREFIX "placing %s on CPU %d\n", t->path, t->cpu);
+  }
+
+  return instrument;
+}
+
+static char *const *init_valgrind_envp(Target *t, char *const *envp, SafeArena *arena) {
+  return t->num_env ? safe_setenv(envp, t->env, arena, LAZY_LOG_FD) : envp;
+}
+
+// Releases resources if Valgrind failed to start
+// or after it has been spawned
+static void free_target(Target *t) {
+  admission_release(t->slot_fd);
+  if(t->config_fd >= 0)
+    close(t->config_fd);
+}
+
+// Descriptors which are passed to Valgrind are FD_CLOEXEC in parent
+// (so that children which are started concurrently by other threads
+// do not inherit them). Posix_spawn makes them inheritable in child
+// via copy of caller's file actions; dup2 to the same descriptor
+// clears FD_CLOEXEC.
+static const posix_spawn_file_actions_t *get_spawn_file_actions(const Target *t,
+                                                                const posix_spawn_file_actions_t *file_actions,
+                                                                posix_spawn_file_actions_t *copy) {
+  if(t->slot_fd < 0 && t->config_fd < 0)
+    return file_actions;
+
+  if(file_actions) {
+    // Actions are appended to copy so it needs its own array
+    *copy = *file_actions;
+    if(file_actions->__actions) {
+      size_t size = malloc_usable_size(file_actions->__actions);
+      copy->__actions = malloc(size);
+      if(!copy->__actions) {
+        dprintf(get_log_fd(), PREFIX "failed to copy file actions\n");
+        abort();
+      }
+      memcpy(copy->__actions, file_actions->__actions, size);
+    }
+  } else
+    posix_spawn_file_actions_init(copy);
+
+  int fds[] = { t->slot_fd, t->config_fd };
+  size_t i;
+  for(i = 0; i < sizeof(fds) / sizeof(fds[0]); ++i) {
+    if(fds[i] < 0)
+      continue;
+    int err = posix_spawn_file_actions_adddup2(copy, fds[i], fds[i]);
+    if(err) {
+      dprintf(get_log_fd(), PREFIX "failed to add file action: %s\n", sys_errlist[err]);
+      abort();
+    }
+  }
+
+  return copy;
+}
+
+static void free_spawn_file_actions(const posix_spawn_file_actions_t *file_actions,
+                                    posix_spawn_file_actions_t *copy) {
+  // Strings in copied actions belong to caller so do not destroy
+  if(file_actions == copy)
+    free(copy->__actions);
+}
+
+// Returns Valgrind tool to start directly (bypassing launcher)
+// or launcher
+static const char *select_valgrind_exe(Target *t, char *const *vg_argv) {
+  const char *tool = launcher_enabled() ? launcher_select_tool(t->path, vg_argv, t->tool_buf, sizeof(t->tool_buf)) : NULL;
+
+  // Launcher is marked so that it does not initialize as guest
+  add_target_env(t, GUEST_VAR "=%d:%llx:%d", t->config_fd, (unsigned long long)config_env_hash, !tool);
+
+  if(!tool)
+    return vg_argv[0];
+
+  t->env[t->num_env++] = launcher_env();
+  t->env[t->num_env] = NULL;
+
+  if(v)
+    safe_printf(PREFIX "starting %s directly\n", tool);
+
+  return tool;
+}
+
+// Returns value of PATH in environment (or NULL)
+static const char *get_env_path(char *const *envp) {
+  for(; envp && *envp; ++envp) {
+    if(0 == strncmp(*envp, "PATH=", 5))
+      return *envp + 5;
+  }
+  return NULL;
+}
+
+// Returns 1 if process is a shell which should not be instrumented
+// and sets simple command which can be run instead (or NULL)
+// and its executable. Executable is a file which needs PATH lookup
+// iff it's same as command name.
+static int bypass_shell(const char *arg0, char *const *argv, char *const *envp,
+                        char ***cmd_argv, const char **cmd_exe, SafeArena *arena) {
+  if(!get_initialized() || !shell_bypass)
     return 0;
+
+  const char *cmd = shell_get_command(arg0, argv);
+  if(!cmd)
+    return 0;
+
+  // Shell itself is never instrumented
+  if(v)
+    safe_printf(PREFIX "not instrumenting %s: shell\n", arg0);
+  log_event(DECISION_SKIP, REASON_SHELL, arg0);
+  stats_decided(arg0, 0, REASON_SHELL, 0);
+
+  *cmd_argv = shell_split_command(cmd, arena, LAZY_LOG_FD);
+  if(!*cmd_argv)
+    return 1;
+
+  // Shell searches command in PATH of its environment
+  // which may differ from ours
+  *cmd_exe = (*cmd_argv)[0];
+  const char *path = get_env_path(envp), *our_path = getenv("PATH");
+  if(!strchr(*cmd_exe, '/') && (!path || !our_path || 0 != strcmp(path, our_path))) {
+    char *buf = safe_arena_alloc(arena, PATH_MAX, LAZY_LOG_FD);
+    // Shell uses default PATH if it's unset
+    *cmd_exe = path ? find_file_in_dirs(*cmd_exe, path, buf, PATH_MAX, LAZY_LOG_FD) : NULL;
+    if(!*cmd_exe) {
+      if(v)
+        safe_printf(PREFIX "not bypassing shell for '%s': not found in PATH of shell\n", cmd);
+      *cmd_argv = NULL;
+      return 1;
+    }
   }
 
+  if(v)
+    safe_printf(PREFIX "bypassing shell for '%s'\n", cmd);
+
   return 1;
 }
 
-static int exec_worker(const char *arg0, char *const *argv, int file_or_path, int has_envp, char *const *envp) {
-  if(!can_instrument(arg0, argv))
-    return has_envp && file_or_path ? real_execvpe(arg0, argv, envp)
-      : has_envp && !file_or_path ? real_execve(arg0, argv, envp)
-      : !has_envp && file_or_path ? real_execvp(arg0, argv)
-      : /* !has_envp && !file_or_path */ real_execv(arg0, argv);
+// Returns Valgrind flags for executable (global and from policy)
+static const char **get_valgrind_flags(const char *path, char *const *argv, SafeArena *arena) {
+  const BlobRule *rule = policy_find(path, argv, LAZY_LOG_FD);
+  size_t num_rule_flags = rule ? rule->num_flags : 0;
+  const char **flags = safe_arena_alloc(arena, (config->num_flags + num_rule_flags + 1) * sizeof(char *), LAZY_LOG_FD);
+
+  size_t i = 0, j;
+  for(j = 0; j < config->num_flags; ++j)
+    flags[i++] = blob_strs_get(config, config->flags, j);
+  for(j = 0; j < num_rule_flags; ++j)
+    flags[i++] = blob_strs_get(config, rule->flags, j);
+  flags[i] = NULL;
+
+  return flags;
+}
+
+// Appends command to record queue (instead of instrumenting it).
+// Cwd is directory of command (NULL if it's ours).
+static void record_command(const char *arg0, char *const *argv, char *const *envp, int file_or_path,
+                           const char *cwd, SafeArena *arena) {
+  Target t;
+  int instrument = can_instrument(arg0, argv, envp, file_or_path, cwd, &t);
+  if(!get_initialized())
+    return;
+
+  char cwd_buf[PATH_MAX];
+  if(!cwd) {
+    if(!getcwd(cwd_buf, sizeof(cwd_buf))) {
+      safe_printf(PREFIX "not recording %s: getcwd() failed: %s\n", t.path, sys_errlist[errno]);
+      return;
+    }
+    cwd = cwd_buf;
+  }
+
+  if(v)
+    safe_printf(PREFIX "recording %s (%s)\n", t.path, instrument ? "instrumented" : reason_name(t.reason));
+
+  const char **flags = instrument ? get_valgrind_flags(t.path, argv, arena) : NULL;
+  cmd_queue_append(RECORD_QUEUE, t.path, cwd, argv, envp, flags,
+                   instrument, t.reason, /*errors*/ -1, arena, LAZY_LOG_FD);
+}
+
+static int exec_target(const char *arg0, char *const *argv, int file_or_path, int has_envp, char *const *envp, SafeArena *arena) {
+  if(record) {
+    record_command(arg0, argv, has_envp ? envp : environ, file_or_path, /*cwd*/ NULL, arena);
+    return exec_uninstrumented(arg0, argv, file_or_path, has_envp, envp);
+  }
 
-  char **new_argv = init_valgrind_argv(argv);
+  Target t;
+  if(!decide(arg0, argv, has_envp ? envp : environ, file_or_path, &t))
+    return exec_uninstrumented(arg0, argv, file_or_path, has_envp, envp);
 
-  int retcode = has_envp
-    ? real_execve(new_argv[0], new_argv, envp)
-    : real_execv(new_argv[0], new_argv);
+  char **new_argv = init_valgrind_argv(t.path, argv, arena);
+  const char *vg_exe = select_valgrind_exe(&t, new_argv);
+  char *const *new_envp = init_valgrind_envp(&t, has_envp ? envp : environ, arena);
+
+  // Settings are inherited by Valgrind
+  if(placement_enabled()) {
+    placement_apply(0, t.cpu, LAZY_LOG_FD);
+    placement_register(getpid(), t.cpu);
+  }
 
-  if (0 != retcode) {
-    free_valgrind_argv(new_argv);
+  // Descriptors can only be made inheritable in parent
+  // so do this as late as possible
+  admission_pass(t.slot_fd);
+  if(t.config_fd >= 0)
+    fcntl(t.config_fd, F_SETFD, 0);
+  int retcode = real_execve(vg_exe, new_argv, new_envp);
+  admission_keep(t.slot_fd);
+  if(t.config_fd >= 0)
+    fcntl(t.config_fd, F_SETFD, FD_CLOEXEC);
+
+  if(placement_enabled()) {
+    placement_restore_self();
+    placement_unregister(getpid());
   }
+  stats_live_dec();
+  free_target(&t);
 
   return retcode;
 }
 
+// Arena is released if exec fails
+static int exec_worker(const char *arg0, char *const *argv, int file_or_path, int has_envp, char *const *envp, SafeArena *arena) {
+  int retcode;
+  char **cmd_argv;
+  const char *cmd_exe;
+  if(bypass_shell(arg0, argv, has_envp ? envp : environ, &cmd_argv, &cmd_exe, arena)) {
+    // Shell does PATH lookup for commands
+    if(cmd_argv)
+      exec_target(cmd_exe, cmd_argv, /*file_or_path*/ cmd_exe == cmd_argv[0], has_envp, envp, arena);
+    // Command is not simple or failed to start so let shell handle it
+    retcode = exec_uninstrumented(arg0, argv, file_or_path, has_envp, envp);
+  } else
+    retcode = exec_target(arg0, argv, file_or_path, has_envp, envp, arena);
+
+  safe_arena_free(arena, LAZY_LOG_FD);
+  return retcode;
+}
+
 EXPORT int execl(const char *path, const char *arg, ...) {
+  stats_intercepted(API_EXECL);
   if(v)
     safe_printf(PREFIX "intercepted execl: %s\n", path);
 
+  SafeArena arena = SAFE_ARENA_INIT;
   va_list ap;
   va_start(ap, arg);
-  char **args = va_list_to_argv(ap, arg);
+  char **args = va_list_to_argv(&ap, arg, &arena);
+  va_end(ap);
 
-  return exec_worker(path, args, /*file_or_path*/0, /*has_envp*/ 0, 0);
+  return exec_worker(path, args, /*file_or_path*/0, /*has_envp*/ 0, 0, &arena);
 }
 
 EXPORT int execlp(const char *file, const char *arg, ...) {
+  stats_intercepted(API_EXECLP);
   if(v)
     safe_printf(PREFIX "intercepted execlp: %s\n", file);
 
+  SafeArena arena = SAFE_ARENA_INIT;
   va_list ap;
   va_start(ap, arg);
-  char **args = va_list_to_argv(ap, arg);
+  char **args = va_list_to_argv(&ap, arg, &arena);
+  va_end(ap);
 
-  return exec_worker(file, args, /*file_or_path*/ 1, /*has_envp*/ 0, 0);
+  return exec_worker(file, args, /*file_or_path*/ 1, /*has_envp*/ 0, 0, &arena);
 }
 
 EXPORT int execle(const char *path, const char *arg, ...) {
+  stats_intercepted(API_EXECLE);
   if(v)
     safe_printf(PREFIX "intercepted execle: %s\n", path);
 
+  SafeArena arena = SAFE_ARENA_INIT;
   va_list ap;
   va_start(ap, arg);
-  char **args = va_list_to_argv(ap, arg);
+  char **args = va_list_to_argv(&ap, arg, &arena);
 
   char * const *e = va_arg(ap, char * const *);
+  va_end(ap);
 
-  return exec_worker(path, args, /*file_or_path*/ 0, /*has_envp*/ 1, e);
+  return exec_worker(path, args, /*file_or_path*/ 0, /*has_envp*/ 1, e, &arena);
 }
 
 EXPORT int execv(const char *path, char *const argv[]) {
+  stats_intercepted(API_EXECV);
   if(v)
     safe_printf(PREFIX "intercepted execv: %s\n", path);
-  return exec_worker(path, argv, /*file_or_path*/ 0, /*has_envp*/ 0, 0);
+  SafeArena arena = SAFE_ARENA_INIT;
+  return exec_worker(path, argv, /*file_or_path*/ 0, /*has_envp*/ 0, 0, &arena);
 }
 
 EXPORT int execve(const char *path, char *const argv[], char *const envp[]) {
+  stats_intercepted(API_EXECVE);
   if(v)
     safe_printf(PREFIX "intercepted execve: %s\n", path);
-  return exec_worker(path, argv, /*file_or_path*/ 0, /*has_envp*/ 1, envp);
+  SafeArena arena = SAFE_ARENA_INIT;
+  return exec_worker(path, argv, /*file_or_path*/ 0, /*has_envp*/ 1, envp, &arena);
 }
 
 EXPORT int execvp(const char *file, char *const argv[]) {
+  stats_intercepted(API_EXECVP);
   if(v)
     safe_printf(PREFIX "intercepted execvp: %s\n", file);
-  return exec_worker(file, argv, /*file_or_path*/ 1, /*has_envp*/ 0, 0);
+  SafeArena arena = SAFE_ARENA_INIT;
+  return exec_worker(file, argv, /*file_or_path*/ 1, /*has_envp*/ 0, 0, &arena);
 }
 
 EXPORT int execvpe(const char *file, char *const argv[], char *const envp[]) {
+  stats_intercepted(API_EXECVPE);
   if(v)
     safe_printf(PREFIX "intercepted execvpe: %s\n", file);
-  return exec_worker(file, argv, /*file_or_path*/ 1, /*has_envp*/ 1, envp);
+  SafeArena arena = SAFE_ARENA_INIT;
+  return exec_worker(file, argv, /*file_or_path*/ 1, /*has_envp*/ 1, envp, &arena);
 }
 
-static int spawn_worker(pid_t *pid, const char *path,
+static int spawn_target(pid_t *pid, const char *path,
                         const posix_spawn_file_actions_t *file_actions,
                         const posix_spawnattr_t *attrp,
                         char *const *argv, char *const *envp,
-                        int path_or_file) {
-  if(!can_instrument(path, argv))
+                        int path_or_file, SafeArena *arena) {
+  if(record) {
+    record_command(path, argv, envp, !path_or_file, /*cwd*/ NULL, arena);
     return (path_or_file ? real_posix_spawn : real_posix_spawnp)(pid, path, file_actions, attrp, argv, envp);
+  }
+
+  Target t;
+  if(!decide(path, argv, envp, !path_or_file, &t))
+    return (path_or_file ? real_posix_spawn : real_posix_spawnp)(pid, path, file_actions, attrp, argv, envp);
+
+  char **new_argv = init_valgrind_argv(t.path, argv, arena);
+  const char *vg_exe = select_valgrind_exe(&t, new_argv);
+  char *const *new_envp = init_valgrind_envp(&t, envp, arena);
+
+  // Posix_spawn can't set affinity so child inherits it from
+  // calling thread (setting it for child's pid after spawn would only
+  // affect its main thread which is already running)
+  cpu_set_t affinity;
+  int pinned = placement_enabled() && placement_pin_self(t.cpu, &affinity, LAZY_LOG_FD);
 
-  char **new_argv = init_valgrind_argv(argv);
+  posix_spawn_file_actions_t file_actions_copy;
+  const posix_spawn_file_actions_t *vg_file_actions = get_spawn_file_actions(&t, file_actions, &file_actions_copy);
 
-  int status = real_posix_spawnp(pid, "valgrind", file_actions, attrp, new_argv, envp);
+  int status = real_posix_spawn(pid, vg_exe, vg_file_actions, attrp, new_argv, new_envp);
 
-  free_valgrind_argv(new_argv);
+  free_spawn_file_actions(vg_file_actions, &file_actions_copy);
+
+  if(pinned)
+    placement_unpin_self(&affinity);
+
+  if(status)
+    stats_live_dec();
+  else if(placement_enabled()) {
+    // Our priorities could not be restored so they are lowered
+    // in child (Valgrind has just started so it's unlikely
+    // to have other threads)
+    placement_lower_priorities(*pid, LAZY_LOG_FD);
+    placement_register(*pid, t.cpu);
+  }
+
+  // Child holds its own copy of slot
+  free_target(&t);
+
+  return status;
+}
+
+static int spawn_worker(pid_t *pid, const char *path,
+                        const posix_spawn_file_actions_t *file_actions,
+                        const posix_spawnattr_t *attrp,
+                        char *const *argv, char *const *envp,
+                        int path_or_file) {
+  SafeArena arena = SAFE_ARENA_INIT;
+
+  int status;
+  char **cmd_argv;
+  const char *cmd_exe;
+  if(bypass_shell(path, argv, envp ? envp : environ, &cmd_argv, &cmd_exe, &arena)) {
+    // Command is not simple or failed to start so let shell handle it
+    if(!cmd_argv
+        || 0 != (status = spawn_target(pid, cmd_exe, file_actions, attrp, cmd_argv, envp,
+                                       /*path_or_file*/ cmd_exe != cmd_argv[0], &arena)))
+      status = (path_or_file ? real_posix_spawn : real_posix_spawnp)(pid, path, file_actions, attrp, argv, envp);
+  } else
+    status = spawn_target(pid, path, file_actions, attrp, argv, envp, path_or_file, &arena);
+
+  safe_arena_free(&arena, LAZY_LOG_FD);
 
   return status;
 }
@@ -503,6 +1367,7 @@ EXPORT int posix_spawn(pid_t *pid, const char *path,
                        const posix_spawn_file_actions_t *file_actions,
                        const posix_spawnattr_t *attrp,
                        char *const argv[], char *const envp[]) {
+  stats_intercepted(API_POSIX_SPAWN);
   return spawn_worker(pid, path, file_actions, attrp, argv, envp, 1);
 }
 
@@ -510,7 +1375,48 @@ EXPORT int posix_spawnp(pid_t *pid, const char *path,
                         const posix_spawn_file_actions_t *file_actions,
                         const posix_spawnattr_t *attrp,
                         char *const argv[], char *const envp[]) {
+  stats_intercepted(API_POSIX_SPAWNP);
   return spawn_worker(pid, path, file_actions, attrp, argv, envp, 0);
 }
 
 // TODO: execlpe
+
+// Entry point for pregrind-supervise which loads us with dlopen
+// and asks for decisions about execve's of traced processes.
+// Path should be absolute, cwd is directory of tracee (NULL if unknown).
+//
+// Admission control is not supported as slot fds can't be passed
+// to tracees. Returned argv and envp are valid until next call.
+EXPORT int pregrind_supervise_exec(const char *path, const char *cwd, char *const *argv, char *const *envp,
+                                   char ***new_argv, char ***new_envp) {
+  static SafeArena arena = SAFE_ARENA_INIT;
+  safe_arena_free(&arena, LAZY_LOG_FD);
+
+  stats_intercepted(API_EXECVE);
+  if(v)
+    safe_printf(PREFIX "supervised execve: %s\n", path);
+
+  // Tracee runs natively so its command is only recorded
+  if(record) {
+    if(cwd)
+      record_command(path, argv, envp, /*file_or_path*/ 0, cwd, &arena);
+    else if(v)
+      safe_printf(PREFIX "not recording %s: unknown directory\n", path);
+    return 0;
+  }
+
+  Target t;
+  uint64_t start = stats_enabled() ? stats_now_ns() : 0;
+  // Unknown directory does not match cwd: predicates
+  int instrument = can_instrument(path, argv, envp, /*file_or_path*/ 0, cwd ? cwd : "", &t);
+  uint64_t decide_ns = stats_enabled() ? stats_now_ns() - start : 0;
+
+  record_decision(&t, instrument, decide_ns);
+
+  if(!instrument)
+    return 0;
+
+  *new_argv = init_valgrind_argv(t.path, argv, &arena);
+  *new_envp = (char **)init_valgrind_envp(&t, envp, &arena);
+  return 1;
+}
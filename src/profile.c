@@ -0,0 +1,116 @@
+/*
+ * Copyright 2022 Yury Gribov
+ *
+ * Use of this source code is governed by MIT license that can be
+ * found in the LICENSE.txt file.
+ */
+
+#include "profile.h"
+#include "common.h"
+#include "elf_info.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MAX_ARGS 4
+
+static ProfileConfig config;
+static const char *args[MAX_ARGS];  // Options which do not depend on executable
+static size_t num_args;
+static char out_prefix[4096];       // "--TOOL-out-file=DIR/TOOL."
+static size_t out_prefix_len;
+
+int profile_parse_tool(const char *s, ProfileTool *tool) {
+  if(0 == strcmp(s, "callgrind"))
+    *tool = PROFILE_CALLGRIND;
+  else if(0 == strcmp(s, "cachegrind"))
+    *tool = PROFILE_CACHEGRIND;
+  else
+    return 0;
+  return 1;
+}
+
+// Returns option allocated on heap
+static const char *make_arg(const char *fmt, const char *val) {
+  size_t size = strlen(fmt) + strlen(val) + 1;
+  char *arg = malloc(size);
+  if(!arg)
+    return NULL;
+  snprintf(arg, size, fmt, val);
+  return arg;
+}
+
+void profile_init(const ProfileConfig *cfg, int verbose, int error_fd) {
+  config = *cfg;
+  if(config.tool == PROFILE_NONE)
+    return;
+
+  const char *tool = config.tool == PROFILE_CALLGRIND ? "callgrind" : "cachegrind";
+
+  args[num_args++] = make_arg("--tool=%s", tool);
+
+  if(!config.instr_atstart) {
+    args[num_args++] = config.tool == PROFILE_CALLGRIND
+      ? "--instr-atstart=no"
+      : "--instr-at-start=no";
+  }
+
+  if(config.toggle) {
+    if(config.tool == PROFILE_CALLGRIND) {
+      args[num_args++] = "--collect-atstart=no";
+      args[num_args++] = make_arg("--toggle-collect=%s", config.toggle);
+    } else
+      safe_fprintf(error_fd, PREFIX "PREGRIND_PROFILE_TOGGLE is only supported by Callgrind, ignoring\n");
+  }
+
+  out_prefix_len = snprintf(out_prefix, sizeof(out_prefix), "--%s-out-file=%s/%s.", tool, config.dir, tool);
+  if(out_prefix_len >= sizeof(out_prefix)) {
+    safe_fprintf(error_fd, PREFIX "profile directory name is too long: %s\n", config.dir);
+    abort();
+  }
+
+  size_t i;
+  for(i = 0; i < num_args; ++i) {
+    if(!args[i]) {
+      safe_fprintf(error_fd, PREFIX "failed to allocate profiling options\n");
+      abort();
+    }
+  }
+
+  if(verbose)
+    safe_fprintf(error_fd, PREFIX "profiling with %s to %s\n", tool, config.dir);
+}
+
+int profile_enabled() {
+  return config.tool != PROFILE_NONE;
+}
+
+size_t profile_max_args() {
+  return profile_enabled() ? num_args + 1 : 0;
+}
+
+size_t profile_add_args(const char *path, const char **out, SafeArena *a, int error_fd) {
+  if(!profile_enabled())
+    return 0;
+
+  memcpy(out, args, num_args * sizeof(char *));
+
+  // Rebuilt binaries are profiled separately
+  char build_id[2 * MAX_BUILD_ID + 1] = "nobuildid";
+  ElfInfo info;
+  if(elf_read_info(path, &info) && info.build_id_len) {
+    size_t i;
+    for(i = 0; i < info.build_id_len; ++i)
+      snprintf(build_id + 2 * i, 3, "%02x", info.build_id[i]);
+  }
+
+  // Valgrind understands %p
+  const char *name = safe_basename(path);
+  size_t size = out_prefix_len + strlen(name) + 1 + strlen(build_id) + 4;
+  char *arg = safe_arena_alloc(a, size, error_fd);
+  snprintf(arg, size, "%s%s.%s.%%p", out_prefix, name, build_id);
+  out[num_args] = arg;
+
+  return num_args + 1;
+}
@@ -0,0 +1,49 @@
+/*
+ * Copyright 2022 Yury Gribov
+ *
+ * Use of this source code is governed by MIT license that can be
+ * found in the LICENSE.txt file.
+ */
+
+#ifndef PROFILE_H
+#define PROFILE_H
+
+#include <stddef.h>
+
+#include "async_safe.h"
+
+// Profiling of process tree with Callgrind or Cachegrind.
+//
+// Profile of each process is written to DIR/TOOL.NAME.BUILDID.PID
+// so that profiles of the same binary can be found and merged
+// (by pregrind-profile-merge script) even if it's been rebuilt
+// or has the same name as other binaries.
+
+typedef enum {
+  PROFILE_NONE,
+  PROFILE_CALLGRIND,
+  PROFILE_CACHEGRIND,
+} ProfileTool;
+
+typedef struct {
+  ProfileTool tool;
+  const char *dir;     // Absolute
+  const char *toggle;  // Collect only inside this function (NULL if not used)
+  int instr_atstart;   // Whether instrumentation is enabled at start
+} ProfileConfig;
+
+// Parses PREGRIND_PROFILE ("callgrind" or "cachegrind")
+int profile_parse_tool(const char *s, ProfileTool *tool);
+
+// Not async-safe, call at startup
+void profile_init(const ProfileConfig *cfg, int verbose, int error_fd);
+
+int profile_enabled();
+
+// Maximum number of options added by profile_add_args
+size_t profile_max_args();
+
+// Adds Valgrind options for executable and returns their number
+size_t profile_add_args(const char *path, const char **args, SafeArena *a, int error_fd);
+
+#endif
@@ -0,0 +1,100 @@
+/*
+ * Copyright 2022 Yury Gribov
+ *
+ * Use of this source code is governed by MIT license that can be
+ * found in the LICENSE.txt file.
+ */
+
+#include "result_cache.h"
+#include "common.h"
+#include "elf_info.h"
+#include "shm.h"
+
+#define RESULTS_MAGIC 0x50475201u
+#define NUM_ENTRIES 65536
+#define MAX_PROBES 16
+
+typedef struct {
+  uint64_t key;  // 0 if entry is free
+  uint32_t clean_runs;
+  uint32_t reserved;
+} ResultEntry;
+
+typedef struct {
+  ShmHeader header;
+  ResultEntry entries[NUM_ENTRIES];
+} ResultCache;
+
+static ResultCache *cache;
+static unsigned max_clean;
+
+void result_cache_init(unsigned max_clean_, int error_fd) {
+  max_clean = max_clean_;
+  cache = shm_map("results", sizeof(ResultCache), RESULTS_MAGIC, error_fd);
+}
+
+int result_cache_enabled() {
+  return cache != 0;
+}
+
+uint64_t result_cache_key(const char *path, const struct stat *st, char *const *argv, uint64_t flags_hash) {
+  uint64_t h = hash_bytes(HASH_INIT, &flags_hash, sizeof(flags_hash));
+
+  ElfInfo info;
+  if(elf_read_info(path, &info) && info.build_id_len) {
+    h = hash_bytes(h, info.build_id, info.build_id_len);
+  } else {
+    // Fall back to file identity
+    h = hash_bytes(h, &st->st_dev, sizeof(st->st_dev));
+    h = hash_bytes(h, &st->st_ino, sizeof(st->st_ino));
+    h = hash_bytes(h, &st->st_size, sizeof(st->st_size));
+    h = hash_bytes(h, &st->st_mtim, sizeof(st->st_mtim));
+  }
+
+  // Ignore argv[0] as it depends on how program was called
+  for(++argv; argv[0]; ++argv)
+    h = hash_str(h, argv[0]);
+
+  return h + !h;
+}
+
+// Returns entry for key (inserting it if needed) or NULL if table is full
+static ResultEntry *find_entry(uint64_t key, int insert) {
+  unsigned i;
+  for(i = 0; i < MAX_PROBES; ++i) {
+    ResultEntry *e = &cache->entries[(key + i) % NUM_ENTRIES];
+    uint64_t old = __atomic_load_n(&e->key, __ATOMIC_ACQUIRE);
+    if(old == key)
+      return e;
+    if(!old) {
+      if(!insert)
+        return NULL;
+      if(__atomic_compare_exchange_n(&e->key, &old, key, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)
+          || old == key)
+        return e;
+    }
+  }
+  return NULL;
+}
+
+int result_cache_allows(uint64_t key, const char **reason) {
+  if(!cache)
+    return 1;
+
+  ResultEntry *e = find_entry(key, 0);
+  if(e && __atomic_load_n(&e->clean_runs, __ATOMIC_RELAXED) >= max_clean) {
+    *reason = "already ran cleanly under Valgrind";
+    return 0;
+  }
+
+  return 1;
+}
+
+void result_cache_record_clean(uint64_t key) {
+  if(!cache)
+    return;
+
+  ResultEntry *e = find_entry(key, 1);
+  if(e)
+    __atomic_fetch_add(&e->clean_runs, 1, __ATOMIC_RELAXED);
+}
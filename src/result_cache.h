@@ -0,0 +1,39 @@
+/*
+ * Copyright 2022 Yury Gribov
+ *
+ * Use of this source code is governed by MIT license that can be
+ * found in the LICENSE.txt file.
+ */
+
+#ifndef RESULT_CACHE_H
+#define RESULT_CACHE_H
+
+#include <stdint.h>
+
+#include <sys/stat.h>
+
+// Persistent index of runs which finished under Valgrind without errors.
+//
+// Runs are identified by build-id of executable (or its inode and mtime
+// if there is no build-id), arguments and Valgrind flags (so that e.g.
+// runs under --tool=none do not hide errors from Memcheck).
+// Index is a lock-free table in state directory (see shm.h).
+
+// Environment variable which passes key of run to instrumented process
+#define RUN_KEY_VAR "PREGRIND_RUN_KEY"
+
+// Not async-safe, call at startup.
+// Runs are skipped after max_clean clean runs.
+void result_cache_init(unsigned max_clean, int error_fd);
+
+int result_cache_enabled();
+
+// Flags_hash identifies Valgrind flags which are used for the run
+uint64_t result_cache_key(const char *path, const struct stat *st, char *const *argv, uint64_t flags_hash);
+
+// Returns 0 and reason if run does not need to be instrumented
+int result_cache_allows(uint64_t key, const char **reason);
+
+void result_cache_record_clean(uint64_t key);
+
+#endif
@@ -0,0 +1,128 @@
+/*
+ * Copyright 2022 Yury Gribov
+ *
+ * Use of this source code is governed by MIT license that can be
+ * found in the LICENSE.txt file.
+ */
+
+#include "sampling.h"
+#include "async_safe.h"
+#include "common.h"
+#include "shm.h"
+
+#include <string.h>
+#include <time.h>
+
+#include <unistd.h>
+
+#define COUNTERS_MAGIC 0x50475302u
+#define NUM_ENTRIES 16384
+#define MAX_PROBES 16
+
+typedef struct {
+  uint64_t key;  // Hash of binary path (0 if entry is free)
+  uint64_t count;
+} BinaryCounter;
+
+typedef struct {
+  ShmHeader header;
+  uint64_t run_id;  // Run which invocations are counted
+  uint64_t total;
+  BinaryCounter binaries[NUM_ENTRIES];
+} SamplingCounters;
+
+static SamplingConfig config;
+static SamplingCounters *counters;
+
+void sampling_init(const SamplingConfig *cfg, int error_fd) {
+  config = *cfg;
+
+  if(config.rate > SAMPLING_RATE_ONE)
+    config.rate = SAMPLING_RATE_ONE;
+
+  if(config.rate < SAMPLING_RATE_ONE || config.first) {
+    counters = shm_map("sampling", sizeof(SamplingCounters), COUNTERS_MAGIC, error_fd);
+    if(!counters && config.first) {
+      safe_fprintf(error_fd, PREFIX "sampling of first invocations needs state directory, disabling\n");
+      config.first = 0;
+    }
+  }
+
+  // Start counting again if previous run has finished
+  if(counters) {
+    uint64_t run_id = shm_run_id();
+    uint64_t old = __atomic_load_n(&counters->run_id, __ATOMIC_ACQUIRE);
+    if(old != run_id
+        && __atomic_compare_exchange_n(&counters->run_id, &old, run_id, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+      __atomic_store_n(&counters->total, 0, __ATOMIC_RELAXED);
+      memset(counters->binaries, 0, sizeof(counters->binaries));
+    }
+  }
+}
+
+// Finds counter for binary, returns NULL if table is full
+static uint64_t *get_binary_counter(uint64_t key) {
+  unsigned i;
+  for(i = 0; i < MAX_PROBES; ++i) {
+    BinaryCounter *c = &counters->binaries[(key + i) % NUM_ENTRIES];
+    uint64_t old = __atomic_load_n(&c->key, __ATOMIC_ACQUIRE);
+    if(old == key)
+      return &c->count;
+    if(!old && (__atomic_compare_exchange_n(&c->key, &old, key, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)
+                || old == key))
+      return &c->count;
+  }
+  return NULL;
+}
+
+static int is_sampled(uint64_t n) {
+  // Spread instrumented invocations evenly
+  uint64_t rate = config.rate;
+  return (n + 1) * rate / SAMPLING_RATE_ONE > n * rate / SAMPLING_RATE_ONE;
+}
+
+int sampling_allows(const char *path, char *const *argv, const char **reason) {
+  uint64_t path_hash = hash_str(HASH_INIT, path);
+
+  if(config.num_shards) {
+    uint64_t h = path_hash;
+    if(config.shard_by_argv) {
+      // Skip argv[0] as it may differ for same command
+      for(++argv; argv[0]; ++argv)
+        h = hash_str(h, argv[0]);
+    }
+    if(h % config.num_shards != config.shard) {
+      *reason = "belongs to different shard";
+      return 0;
+    }
+  }
+
+  if(config.first) {
+    uint64_t *count = get_binary_counter(path_hash + !path_hash);
+    // If table is full, fall back to instrumenting
+    if(count && __atomic_fetch_add(count, 1, __ATOMIC_RELAXED) >= config.first) {
+      *reason = "already instrumented enough times";
+      return 0;
+    }
+  }
+
+  if(config.rate < SAMPLING_RATE_ONE) {
+    uint64_t n;
+    if(counters) {
+      n = __atomic_fetch_add(&counters->total, 1, __ATOMIC_RELAXED);
+    } else {
+      // No shared state so sample randomly
+      struct timespec ts;
+      clock_gettime(CLOCK_MONOTONIC, &ts);
+      uint64_t h = hash_bytes(HASH_INIT, &ts, sizeof(ts));
+      pid_t pid = getpid();
+      n = hash_bytes(h, &pid, sizeof(pid)) % SAMPLING_RATE_ONE;
+    }
+    if(!is_sampled(n)) {
+      *reason = "not sampled";
+      return 0;
+    }
+  }
+
+  return 1;
+}
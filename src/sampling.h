@@ -0,0 +1,38 @@
+/*
+ * Copyright 2022 Yury Gribov
+ *
+ * Use of this source code is governed by MIT license that can be
+ * found in the LICENSE.txt file.
+ */
+
+#ifndef SAMPLING_H
+#define SAMPLING_H
+
+#include <stdint.h>
+
+// Selection of subset of processes which will be instrumented.
+//
+// Sampling instruments a fraction of all invocations or first N
+// invocations of each binary. Counters are shared between all processes
+// in a run (via state directory, see shm.h) and reset when new run starts.
+//
+// Sharding deterministically splits binaries (or commands) between
+// several machines which run the same build.
+
+typedef struct {
+  uint32_t rate;         // Instrumented fraction (in millionths), SAMPLING_RATE_ONE if not used
+  uint32_t first;        // Instrument only first invocations of each binary, 0 if not used
+  uint32_t num_shards;   // 0 if not used
+  uint32_t shard;
+  int shard_by_argv;     // Include arguments into shard key
+} SamplingConfig;
+
+#define SAMPLING_RATE_ONE 1000000u
+
+// Not async-safe, call at startup
+void sampling_init(const SamplingConfig *cfg, int error_fd);
+
+// Returns 0 and reason if process should not be instrumented
+int sampling_allows(const char *path, char *const *argv, const char **reason);
+
+#endif
@@ -0,0 +1,85 @@
+/*
+ * Copyright 2022 Yury Gribov
+ *
+ * Use of this source code is governed by MIT license that can be
+ * found in the LICENSE.txt file.
+ */
+
+#include "shell.h"
+
+#include <string.h>
+
+static const char *const shells[] = {
+  "sh", "bash", "dash", "ash", "ksh", "mksh", "zsh", NULL
+};
+
+// Builtins and keywords which can not be exec'd
+// (or behave differently from binaries with same name)
+static const char *const builtins[] = {
+  "alias", "bg", "break", "case", "cd", "command", "continue", "do", "done",
+  "echo", "elif", "else", "esac", "eval", "exec", "exit", "export", "fc",
+  "fg", "fi", "for", "function", "getopts", "hash", "if", "in", "jobs",
+  "kill", "local", "printf", "pwd", "read", "readonly", "return", "select",
+  "set", "shift", "source", "test", "then", "time", "times", "trap", "type",
+  "ulimit", "umask", "unalias", "unset", "until", "wait", "while", NULL
+};
+
+static int is_one_of(const char *s, const char *const *list) {
+  for(; *list; ++list) {
+    if(0 == strcmp(s, *list))
+      return 1;
+  }
+  return 0;
+}
+
+const char *shell_get_command(const char *path, char *const *argv) {
+  if(!argv[0] || !argv[1] || !argv[2] || argv[3])
+    return NULL;
+  if(0 != strcmp(argv[1], "-c") || !is_one_of(safe_basename(path), shells))
+    return NULL;
+  return argv[2];
+}
+
+static int is_blank(char c) {
+  return c == ' ' || c == '\t';
+}
+
+char **shell_split_command(const char *cmd, SafeArena *a, int error_fd) {
+  // Anything which may be interpreted by shell
+  if(cmd[strcspn(cmd, "|&;<>()$`\\\"'*?[]#~{}!\n")])
+    return NULL;
+
+  size_t num_words = 0;
+  const char *s;
+  for(s = cmd; *s; ) {
+    for(; is_blank(*s); ++s);
+    if(!*s)
+      break;
+    ++num_words;
+    for(; *s && !is_blank(*s); ++s);
+  }
+
+  if(!num_words)
+    return NULL;
+
+  char *buf = safe_arena_strdup(a, cmd, error_fd);
+  char **words = safe_arena_alloc(a, (num_words + 1) * sizeof(char *), error_fd);
+  size_t i = 0;
+  char *p;
+  for(p = buf; *p; ) {
+    for(; is_blank(*p); ++p);
+    if(!*p)
+      break;
+    words[i++] = p;
+    for(; *p && !is_blank(*p); ++p);
+    if(*p)
+      *p++ = 0;
+  }
+  words[i] = NULL;
+
+  // Variable assignments and builtins
+  if(strchr(words[0], '=') || is_one_of(words[0], builtins))
+    return NULL;
+
+  return words;
+}
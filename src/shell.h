@@ -0,0 +1,27 @@
+/*
+ * Copyright 2022 Yury Gribov
+ *
+ * Use of this source code is governed by MIT license that can be
+ * found in the LICENSE.txt file.
+ */
+
+#ifndef SHELL_H
+#define SHELL_H
+
+#include "async_safe.h"
+
+// Handling of shell invocations (`sh -c CMD`, e.g. from system(3)
+// or build systems). Running shell itself under Valgrind is expensive
+// and pointless so simple commands are exec'd directly and others
+// are left to uninstrumented shell (its children will still be
+// instrumented).
+
+// Returns command if argv is `SHELL -c CMD` for one of known shells
+const char *shell_get_command(const char *path, char *const *argv);
+
+// Splits command into arguments if it does not need shell
+// (no quotes, expansions, redirections, builtins, etc.),
+// otherwise returns NULL.
+char **shell_split_command(const char *cmd, SafeArena *a, int error_fd);
+
+#endif
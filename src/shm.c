@@ -0,0 +1,84 @@
+/*
+ * Copyright 2022 Yury Gribov
+ *
+ * Use of this source code is governed by MIT license that can be
+ * found in the LICENSE.txt file.
+ */
+
+#include "shm.h"
+#include "async_safe.h"
+#include "common.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <errno.h>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+const char *state_dir;
+
+void *shm_map(const char *name, size_t size, uint32_t magic, int error_fd) {
+  if(!state_dir)
+    return NULL;
+
+  char path[256];
+  int needed = snprintf(path, sizeof(path), "%s/%s.%d", state_dir, name, (int)getuid());
+  if(needed < 0 || (size_t)needed >= sizeof(path)) {
+    safe_fprintf(error_fd, PREFIX "failed to map %s: path too long\n", name);
+    return NULL;
+  }
+
+  int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, S_IRUSR | S_IWUSR);
+  if(fd < 0) {
+    safe_fprintf(error_fd, PREFIX "failed to open %s: %s\n", path, sys_errlist[errno]);
+    return NULL;
+  }
+
+  // Many processes may do this at the same time but result will be the same
+  struct stat st;
+  if(0 != fstat(fd, &st) || ((size_t)st.st_size < size && 0 != ftruncate(fd, size))) {
+    safe_fprintf(error_fd, PREFIX "failed to resize %s: %s\n", path, sys_errlist[errno]);
+    close(fd);
+    return NULL;
+  }
+
+  void *p = mmap(0, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if(p == MAP_FAILED) {
+    safe_fprintf(error_fd, PREFIX "failed to mmap %s: %s\n", path, sys_errlist[errno]);
+    return NULL;
+  }
+
+  ShmHeader *h = p;
+  uint32_t old = 0;
+  if(!__atomic_compare_exchange_n(&h->magic, &old, magic, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)
+      && old != magic) {
+    safe_fprintf(error_fd, PREFIX "ignoring %s: created by different version of Pregrind\n", path);
+    munmap(p, size);
+    return NULL;
+  }
+  h->size = size;
+
+  return p;
+}
+
+uint64_t shm_run_id() {
+  const char *run_id_str = getenv(RUN_ID_VAR);
+  if(run_id_str)
+    return strtoull(run_id_str, NULL, 16);
+
+  // First process of run generates its id
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  pid_t pid = getpid();
+  uint64_t run_id = hash_bytes(hash_bytes(HASH_INIT, &ts, sizeof(ts)), &pid, sizeof(pid));
+  char buf[32];
+  snprintf(buf, sizeof(buf), "%llx", (unsigned long long)run_id);
+  setenv(RUN_ID_VAR, buf, 1);
+
+  return run_id;
+}
@@ -0,0 +1,85 @@
+/*
+ * Copyright 2022 Yury Gribov
+ *
+ * Use of this source code is governed by MIT license that can be
+ * found in the LICENSE.txt file.
+ */
+
+#ifndef SHM_H
+#define SHM_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Helpers for state shared between all processes in a run
+// (caches, counters, etc.). It's stored in files under state directory
+// which are mmap-ed to all processes.
+
+extern const char *state_dir;
+
+// Must be the first member of all shared structures
+typedef struct {
+  uint32_t magic;  // Identifies structure and its version
+  uint32_t reserved;
+  uint64_t size;
+} ShmHeader;
+
+// Not async-safe, call at startup.
+// Returns NULL if state directory is not set or on error.
+void *shm_map(const char *name, size_t size, uint32_t magic, int error_fd);
+
+// Environment variable which identifies current run
+#define RUN_ID_VAR "PREGRIND_RUN_ID"
+
+// Not async-safe, call at startup.
+// Returns id of current run (process tree started by first process
+// which loaded Pregrind) so that per-run state can be reset.
+uint64_t shm_run_id();
+
+// FNV-1a
+#define HASH_INIT 0xcbf29ce484222325ull
+
+static inline uint64_t hash_bytes(uint64_t h, const void *p, size_t n) {
+  const unsigned char *s = p;
+  for(; n; --n, ++s) {
+    h ^= *s;
+    h *= 0x100000001b3ull;
+  }
+  return h;
+}
+
+static inline uint64_t hash_str(uint64_t h, const char *s) {
+  // Include terminating null to separate consecutive strings
+  for(;; ++s) {
+    h ^= (unsigned char)*s;
+    h *= 0x100000001b3ull;
+    if(!*s)
+      return h;
+  }
+}
+
+// Simple seqlock for entries of shared tables.
+// Writers do not wait for each other: if entry is busy, update is skipped
+// (which is fine for caches).
+
+static inline int seqlock_write_begin(uint64_t *seq) {
+  uint64_t old = __atomic_load_n(seq, __ATOMIC_RELAXED);
+  return !(old & 1)
+    && __atomic_compare_exchange_n(seq, &old, old + 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
+}
+
+static inline void seqlock_write_end(uint64_t *seq) {
+  __atomic_fetch_add(seq, 1, __ATOMIC_RELEASE);
+}
+
+// Returns odd value if entry is being written
+static inline uint64_t seqlock_read_begin(const uint64_t *seq) {
+  return __atomic_load_n(seq, __ATOMIC_ACQUIRE);
+}
+
+static inline int seqlock_read_retry(const uint64_t *seq, uint64_t start) {
+  __atomic_thread_fence(__ATOMIC_ACQUIRE);
+  return (start & 1) || __atomic_load_n(seq, __ATOMIC_RELAXED) != start;
+}
+
+#endif
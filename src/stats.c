@@ -0,0 +1,101 @@
+/*
+ * Copyright 2022 Yury Gribov
+ *
+ * Use of this source code is governed by MIT license that can be
+ * found in the LICENSE.txt file.
+ */
+
+#include "stats.h"
+#include "async_safe.h"
+#include "common.h"
+
+#include <string.h>
+#include <time.h>
+
+#define MAX_PROBES 16
+
+static Stats *stats;
+
+void stats_init(int error_fd) {
+  stats = shm_map(STATS_NAME, sizeof(Stats), STATS_MAGIC, error_fd);
+  if(!stats)
+    safe_fprintf(error_fd, PREFIX "statistics need state directory, disabling\n");
+}
+
+int stats_enabled() {
+  return stats != NULL;
+}
+
+uint64_t stats_now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+void stats_intercepted(Api api) {
+  if(stats)
+    __atomic_fetch_add(&stats->intercepted[api], 1, __ATOMIC_RELAXED);
+}
+
+// Finds entry for binary, returns NULL if table is full
+static StatsBinary *get_binary(const char *path) {
+  uint64_t key = hash_str(HASH_INIT, path);
+  key += !key;
+
+  unsigned i;
+  for(i = 0; i < MAX_PROBES; ++i) {
+    StatsBinary *b = &stats->binaries[(key + i) % STATS_NUM_BINARIES];
+    uint64_t old = __atomic_load_n(&b->key, __ATOMIC_ACQUIRE);
+    if(old == key)
+      return b;
+    if(!old && __atomic_compare_exchange_n(&b->key, &old, key, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+      // We own the entry so fill the path and publish it
+      size_t len = strlen(path);
+      if(len >= STATS_PATH_SIZE) {
+        // Keep tail of path as it's more informative
+        path += len - (STATS_PATH_SIZE - 1);
+        len = STATS_PATH_SIZE - 1;
+      }
+      memcpy(b->path, path, len + 1);
+      __atomic_store_n(&b->ready, 1, __ATOMIC_RELEASE);
+      return b;
+    }
+    if(old == key)
+      return b;
+  }
+  return NULL;
+}
+
+static unsigned log2_bucket(uint64_t x) {
+  return x ? 63 - __builtin_clzll(x) : 0;
+}
+
+void stats_decided(const char *path, int instrumented, Reason reason, uint64_t decide_ns) {
+  if(!stats)
+    return;
+
+  if(instrumented)
+    __atomic_fetch_add(&stats->instrumented, 1, __ATOMIC_RELAXED);
+  else
+    __atomic_fetch_add(&stats->skipped[reason], 1, __ATOMIC_RELAXED);
+
+  __atomic_fetch_add(&stats->decide_hist[log2_bucket(decide_ns)], 1, __ATOMIC_RELAXED);
+
+  StatsBinary *b = get_binary(path);
+  if(b) {
+    __atomic_fetch_add(&b->count, 1, __ATOMIC_RELAXED);
+    if(instrumented)
+      __atomic_fetch_add(&b->instrumented, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&b->decide_ns, decide_ns, __ATOMIC_RELAXED);
+  }
+}
+
+void stats_live_inc() {
+  if(stats)
+    __atomic_fetch_add(&stats->live, 1, __ATOMIC_RELAXED);
+}
+
+void stats_live_dec() {
+  if(stats)
+    __atomic_fetch_sub(&stats->live, 1, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,92 @@
+/*
+ * Copyright 2022 Yury Gribov
+ *
+ * Use of this source code is governed by MIT license that can be
+ * found in the LICENSE.txt file.
+ */
+
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdint.h>
+
+#include "log.h"
+#include "shm.h"
+
+// Counters of Pregrind activity shared by all processes of a run
+// (see shm.h). They are updated with atomics and can be watched
+// with pregrind-top tool while the run is in progress.
+
+typedef enum {
+  API_EXECL,
+  API_EXECLP,
+  API_EXECLE,
+  API_EXECV,
+  API_EXECVE,
+  API_EXECVP,
+  API_EXECVPE,
+  API_POSIX_SPAWN,
+  API_POSIX_SPAWNP,
+  API_MAX
+} Api;
+
+static inline const char *api_name(unsigned api) {
+  static const char *const names[] = {
+    "execl",
+    "execlp",
+    "execle",
+    "execv",
+    "execve",
+    "execvp",
+    "execvpe",
+    "posix_spawn",
+    "posix_spawnp",
+  };
+  return api < API_MAX ? names[api] : "unknown";
+}
+
+#define STATS_MAGIC 0x50475402u
+#define STATS_NAME "stats"
+#define STATS_HIST_SIZE 64  // Log2 buckets of nanoseconds
+#define STATS_NUM_BINARIES 4096
+#define STATS_PATH_SIZE 112
+
+// Environment variable which marks process started under Valgrind
+#define STATS_LIVE_VAR "PREGRIND_LIVE"
+
+typedef struct {
+  uint64_t key;         // Hash of path (0 if entry is free)
+  uint32_t ready;       // Path has been filled
+  uint32_t reserved;
+  uint64_t count;       // Number of exec attempts
+  uint64_t instrumented;
+  uint64_t decide_ns;   // Total time spent in deciding whether to instrument
+  char path[STATS_PATH_SIZE];  // Possibly truncated
+} StatsBinary;
+
+typedef struct {
+  ShmHeader header;
+  uint64_t intercepted[API_MAX];
+  uint64_t instrumented;
+  uint64_t skipped[REASON_MAX];
+  int64_t live;  // Currently running instrumented processes (approximate)
+  uint64_t decide_hist[STATS_HIST_SIZE];
+  StatsBinary binaries[STATS_NUM_BINARIES];
+} Stats;
+
+// Not async-safe, call at startup
+void stats_init(int error_fd);
+
+int stats_enabled();
+
+// Monotonic time for measuring decisions
+uint64_t stats_now_ns();
+
+void stats_intercepted(Api api);
+void stats_decided(const char *path, int instrumented, Reason reason, uint64_t decide_ns);
+
+// Tracks number of running instrumented processes
+void stats_live_inc();
+void stats_live_dec();
+
+#endif
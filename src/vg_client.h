@@ -0,0 +1,26 @@
+/*
+ * Copyright 2022 Yury Gribov
+ *
+ * Use of this source code is governed by MIT license that can be
+ * found in the LICENSE.txt file.
+ */
+
+#ifndef VG_CLIENT_H
+#define VG_CLIENT_H
+
+// Valgrind client requests (if Valgrind headers are available)
+
+#if defined __has_include
+# if __has_include(<valgrind/valgrind.h>)
+#  include <valgrind/valgrind.h>
+#  define HAVE_VALGRIND_H 1
+# endif
+#endif
+
+#ifndef HAVE_VALGRIND_H
+# define HAVE_VALGRIND_H 0
+# define RUNNING_ON_VALGRIND 0
+# define VALGRIND_COUNT_ERRORS 0
+#endif
+
+#endif
@@ -0,0 +1,56 @@
+#!/bin/sh
+
+# Copyright 2022 Yury Gribov
+#
+# The MIT License (MIT)
+#
+# Use of this source code is governed by MIT license that can be
+# found in the LICENSE.txt file.
+
+# Smoke test for pregrind-collect: logs with errors should be archived
+# and clean ones dropped.
+
+set -eu
+
+cd $(dirname $0)
+
+if test -n "${GITHUB_ACTIONS:-}"; then
+  set -x
+fi
+
+CFLAGS="-g -O0 -Wall -Wextra -Werror"
+
+ROOT=$PWD/../..
+
+${CC:-gcc} $CFLAGS send.c -o send
+
+PORT=$((15000 + $$ % 1000))
+
+$ROOT/bin/pregrind-collect -l 127.0.0.1:$PORT -o test.arch 2> test.log &
+COLLECTOR=$!
+
+./send $PORT <<EOF
+==123== Memcheck, a memory error detector
+==123== Command: ./child arg
+==123== Invalid read of size 4
+==123== ERROR SUMMARY: 1 errors from 1 contexts (suppressed: 0 from 0)
+EOF
+
+./send $PORT <<EOF
+==124== Memcheck, a memory error detector
+==124== Command: ./clean
+==124== ERROR SUMMARY: 0 errors from 0 contexts (suppressed: 0 from 0)
+EOF
+
+# Let collector see closed connections
+sleep 1
+kill -INT $COLLECTOR
+wait $COLLECTOR || true
+
+if ! $ROOT/bin/pregrind-collect -t test.arch > test.list 2>> test.log \
+    || test $(wc -l < test.list) != 1 \
+    || ! grep -q '^0 pid=123 errors=1 .* \./child arg$' test.list \
+    || ! $ROOT/bin/pregrind-collect -x 0 test.arch 2>> test.log | grep -q 'Invalid read of size 4'; then
+  echo "collect: test failed" >&2
+  cat test.log test.list >&2
+fi
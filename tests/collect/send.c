@@ -0,0 +1,63 @@
+/*
+ * Copyright 2022 Yury Gribov
+ *
+ * The MIT License (MIT)
+ *
+ * Use of this source code is governed by MIT license that can be
+ * found in the LICENSE.txt file.
+ */
+
+// Sends stdin to PORT on localhost (like Valgrind's --log-socket)
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+int main(int argc, char *argv[]) {
+  if (argc != 2) {
+    fprintf(stderr, "Usage: send PORT < LOG\n");
+    exit(1);
+  }
+
+  struct sockaddr_in sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sin_family = AF_INET;
+  sa.sin_port = htons(atoi(argv[1]));
+  sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+  // Collector may not be listening yet
+  int fd = -1, i;
+  for (i = 0; i < 100; ++i) {
+    fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) {
+      perror("send: failed to create socket");
+      exit(1);
+    }
+    if (0 == connect(fd, (struct sockaddr *)&sa, sizeof(sa)))
+      break;
+    close(fd);
+    fd = -1;
+    usleep(50000);
+  }
+  if (fd < 0) {
+    perror("send: failed to connect");
+    exit(1);
+  }
+
+  char buf[4096];
+  ssize_t n;
+  while ((n = read(STDIN_FILENO, buf, sizeof(buf))) > 0) {
+    if (n != write(fd, buf, n)) {
+      perror("send: failed to write");
+      exit(1);
+    }
+  }
+
+  close(fd);
+  return 0;
+}
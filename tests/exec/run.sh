@@ -37,6 +37,14 @@ if ! LD_PRELOAD=$ROOT/bin/libpregrind.so ./parent > test.log 2>&1; then
   cat test.log >&2
 fi
 
+# Same in supervisor mode
+if test $(uname -m) = x86_64; then
+  if ! $ROOT/bin/pregrind-supervise ./parent > test.log 2>&1; then
+    echo "exec (supervisor): test failed" >&2
+    cat test.log >&2
+  fi
+fi
+
 if test -n "${COVERAGE:-}"; then
   # Merge DLL coverage from both processes
   gcov-tool merge coverage.*
@@ -38,6 +38,49 @@ if ! LD_PRELOAD=$ROOT/bin/libpregrind.so ./parent > test.log 2>&1 \
   cat test.log >&2
 fi
 
+# Same in supervisor mode
+if test $(uname -m) = x86_64; then
+  if ! $ROOT/bin/pregrind-supervise ./parent > test.log 2>&1 \
+      || ! grep -q 'Invalid read of size 4' test.log; then
+    echo "spawn (supervisor): test failed" >&2
+    cat test.log >&2
+  fi
+fi
+
+# Allowlist selects child by path, arguments, directory or environment
+check_allowlist() {
+  echo "$1" > allowlist.txt
+  if ! ALLOW_TEST=yes PREGRIND_ALLOWLIST=$PWD/allowlist.txt PREGRIND_VERBOSE=1 \
+        LD_PRELOAD=$ROOT/bin/libpregrind.so ./parent > test.log 2>&1 \
+      || ! grep -qF "$2" test.log; then
+    echo "spawn (allowlist '$1'): test failed" >&2
+    cat test.log >&2
+  fi
+  rm -f allowlist.txt
+}
+
+check_allowlist '*/child' "./child allowed by '*/child'"
+check_allowlist 'path:*/child' "./child allowed by 'path:*/child'"
+check_allowlist 'argv:./chi?d' "./child allowed by 'argv:./chi?d'"
+check_allowlist "cwd:$PWD" "./child allowed by 'cwd:$PWD'"
+check_allowlist 'env:ALLOW_TEST=y*' "./child allowed by 'env:ALLOW_TEST=y*'"
+check_allowlist '*/parent' 'not instrumenting ./child: not in allowlist'
+check_allowlist 'argv:--foo' 'not instrumenting ./child: not in allowlist'
+check_allowlist 'cwd:/nonexistent' 'not instrumenting ./child: not in allowlist'
+check_allowlist 'env:ALLOW_TEST=no' 'not instrumenting ./child: not in allowlist'
+
+# In supervisor mode directory of tracee (not supervisor's one) is matched
+if test $(uname -m) = x86_64; then
+  echo "cwd:$PWD" > allowlist.txt
+  if ! (cd / && PREGRIND_ALLOWLIST=$OLDPWD/allowlist.txt PREGRIND_VERBOSE=1 \
+          $ROOT/bin/pregrind-supervise sh -c "cd $OLDPWD && ./parent") > test.log 2>&1 \
+      || ! grep -qF "allowed by 'cwd:$PWD'" test.log; then
+    echo "spawn (supervisor allowlist): test failed" >&2
+    cat test.log >&2
+  fi
+  rm -f allowlist.txt
+fi
+
 if test -n "${COVERAGE:-}"; then
   # Merge DLL coverage from both processes
   gcov-tool merge coverage.*
@@ -28,6 +28,7 @@ ROOT=$PWD/../..
 
 ${CC:-gcc} $CFLAGS parent.c -o parent
 ${CC:-gcc} $CFLAGS child.c -o child
+${CC:-gcc} $CFLAGS shell.c -o shell
 
 export PREGRIND_FLAGS='-q --error-exitcode=1'
 
@@ -37,6 +38,25 @@ if ! LD_PRELOAD=$ROOT/bin/libpregrind.so ./parent >test.log 2>&1 \
   cat test.log >&2
 fi
 
+# Same in supervisor mode
+if test $(uname -m) = x86_64; then
+  if ! $ROOT/bin/pregrind-supervise ./parent >test.log 2>&1 \
+      || ! grep -q 'Invalid read of size 4' test.log; then
+    echo "system (supervisor): test failed" >&2
+    cat test.log >&2
+  fi
+fi
+
+# Shell should be skipped but command still instrumented
+# (system() starts shell internally so run it explicitly)
+if ! PREGRIND_SHELL_BYPASS=1 PREGRIND_VERBOSE=1 LD_PRELOAD=$ROOT/bin/libpregrind.so ./shell >test.log 2>&1 \
+    || ! grep -q 'Invalid read of size 4' test.log \
+    || ! grep -q "bypassing shell for './child'" test.log \
+    || grep -q 'executing: .* /bin/sh' test.log; then
+  echo "system (shell bypass): test failed" >&2
+  cat test.log >&2
+fi
+
 if test -n "${COVERAGE:-}"; then
   # Merge DLL coverage from both processes
   gcov-tool merge coverage.*
@@ -0,0 +1,36 @@
+/*
+ * Copyright 2022 Yury Gribov
+ *
+ * The MIT License (MIT)
+ *
+ * Use of this source code is governed by MIT license that can be
+ * found in the LICENSE.txt file.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <unistd.h>
+#include <sys/wait.h>
+#include <spawn.h>
+
+extern char **environ;
+
+// Unlike system(), starts shell explicitly (via intercepted API)
+int main() {
+  char *argv[] = {"/bin/sh", "-c", "./child", 0};
+  int pid;
+  if (0 != posix_spawn(&pid, "/bin/sh", NULL, NULL, argv, environ)) {
+    perror("shell: failed to spawn shell");
+    exit(1);
+  }
+  int wstatus;
+  if (waitpid(pid, &wstatus, 0) < 0) {
+    perror("shell: failed to wait for shell");
+    exit(1);
+  }
+  if (WIFEXITED(wstatus) && WEXITSTATUS(wstatus) == 0) {
+    fprintf(stderr, "shell: child did not fail as expected\n");
+  }
+  return 0;
+}
@@ -0,0 +1,22 @@
+/*
+ * Copyright 2022 Yury Gribov
+ *
+ * The MIT License (MIT)
+ *
+ * Use of this source code is governed by MIT license that can be
+ * found in the LICENSE.txt file.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include <unistd.h>
+
+int main(int argc, char *argv[]) {
+  if (argc != 2)
+    return 1;
+  // Single write so that lines of different children do not interleave
+  char buf[64];
+  int n = snprintf(buf, sizeof(buf), "child %s done\n", argv[1]);
+  return write(STDOUT_FILENO, buf, n) == n ? 0 : 1;
+}
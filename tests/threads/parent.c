@@ -0,0 +1,71 @@
+/*
+ * Copyright 2022 Yury Gribov
+ *
+ * The MIT License (MIT)
+ *
+ * Use of this source code is governed by MIT license that can be
+ * found in the LICENSE.txt file.
+ */
+
+// Spawns children from many threads at once.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/wait.h>
+#include <spawn.h>
+
+extern char **environ;
+
+#define NUM_THREADS 64
+#define SPAWNS_PER_THREAD 4
+
+static void *worker(void *arg) {
+  int id = (int)(long)arg, i;
+  for (i = 0; i < SPAWNS_PER_THREAD; ++i) {
+    char token[32];
+    snprintf(token, sizeof(token), "%d.%d", id, i);
+    char *argv[] = {"./child", token, 0};
+    int pid;
+    if (0 != posix_spawn(&pid, "./child", NULL, NULL, argv, environ)) {
+      perror("parent: failed to spawn child");
+      exit(1);
+    }
+    int wstatus;
+    if (waitpid(pid, &wstatus, 0) < 0) {
+      perror("parent: failed to wait for child");
+      exit(1);
+    }
+    if (!WIFEXITED(wstatus) || WEXITSTATUS(wstatus) != 0) {
+      fprintf(stderr, "parent: child %s failed\n", token);
+      exit(1);
+    }
+  }
+  return 0;
+}
+
+int main() {
+  struct timespec start, end;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  pthread_t threads[NUM_THREADS];
+  long i;
+  for (i = 0; i < NUM_THREADS; ++i) {
+    if (0 != pthread_create(&threads[i], NULL, worker, (void *)i)) {
+      fprintf(stderr, "parent: failed to create thread\n");
+      exit(1);
+    }
+  }
+  for (i = 0; i < NUM_THREADS; ++i)
+    pthread_join(threads[i], NULL);
+
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  double dt = end.tv_sec - start.tv_sec + (end.tv_nsec - start.tv_nsec) / 1e9;
+  fprintf(stderr, "parent: %d spawns in %.2f sec (%.1f/sec)\n",
+          NUM_THREADS * SPAWNS_PER_THREAD, dt, NUM_THREADS * SPAWNS_PER_THREAD / dt);
+  return 0;
+}
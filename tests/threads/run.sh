@@ -0,0 +1,60 @@
+#!/bin/sh
+
+# Copyright 2022 Yury Gribov
+#
+# The MIT License (MIT)
+# 
+# Use of this source code is governed by MIT license that can be
+# found in the LICENSE.txt file.
+
+# Stress test for posix_spawn from many threads.
+
+set -eu
+
+cd $(dirname $0)
+
+if test -n "${GITHUB_ACTIONS:-}"; then
+  set -x
+fi
+
+NUM_CHILDREN=256  # NUM_THREADS * SPAWNS_PER_THREAD in parent.c
+CFLAGS="-g -O0 -Wall -Wextra -Werror"
+
+ROOT=$PWD/../..
+
+${CC:-gcc} $CFLAGS parent.c -o parent -pthread
+${CC:-gcc} $CFLAGS child.c -o child
+
+rm -rf logs
+mkdir logs
+
+export PREGRIND_FLAGS="-q"
+export PREGRIND_VERBOSE=1
+export PREGRIND_LOG_PATH=$PWD/logs
+
+failed=
+if ! LD_PRELOAD=$ROOT/bin/libpregrind.so ./parent > test.log 2> parent.log; then
+  failed=1
+fi
+
+# Each child should have printed exactly one intact line
+if test $(grep -c '^child [0-9]*\.[0-9]* done$' test.log) != $NUM_CHILDREN \
+    || test $(sort -u test.log | wc -l) != $NUM_CHILDREN; then
+  failed=1
+fi
+
+# Log records of concurrent threads should not interleave
+if cat $(ls logs/* | grep -v '/vg\.') | grep -v -q '^libpregrind.so: '; then
+  failed=1
+fi
+
+if test $(cat logs/parent.* | grep -c '^libpregrind.so: executing: ') != $NUM_CHILDREN; then
+  failed=1
+fi
+
+if test -n "$failed"; then
+  echo "threads: test failed" >&2
+  cat parent.log test.log >&2
+else
+  grep '^parent:' parent.log
+fi
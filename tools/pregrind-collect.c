@@ -0,0 +1,436 @@
+/*
+ * Copyright 2022 Yury Gribov
+ *
+ * Use of this source code is governed by MIT license that can be
+ * found in the LICENSE.txt file.
+ */
+
+// Collector of Valgrind logs sent via --log-socket (PREGRIND_LOG_SOCKET).
+//
+// Output of each process is buffered until connection is closed.
+// Empty and clean (0 errors) outputs are dropped, others are compressed
+// and appended to a single archive:
+//   "PGARCH01"
+//   records: ArchiveRecord + zlib stream
+//   index: ArchiveEntry[num_entries]
+//   ArchiveTrailer
+// Index is written on SIGINT or SIGTERM; records of archives
+// without index can still be read sequentially.
+//
+// Usage:
+//   pregrind-collect [-l ADDR:PORT] [-k] -o ARCHIVE  # collect logs
+//   pregrind-collect -t ARCHIVE                      # list logs
+//   pregrind-collect -x N ARCHIVE                    # print N-th log
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+
+#include <unistd.h>
+#include <poll.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#include <zlib.h>
+
+#define ARCHIVE_MAGIC "PGARCH01"
+#define INDEX_MAGIC "PGINDEX1"
+#define RECORD_MAGIC 0x50475231u
+#define MAX_COMMAND 256
+#define NO_ERRORS_INFO UINT32_MAX
+
+typedef struct {
+  uint32_t magic;
+  uint32_t pid;
+  uint32_t errors;  // NO_ERRORS_INFO if unknown
+  uint32_t reserved;
+  uint64_t raw_size;
+  uint64_t comp_size;
+} ArchiveRecord;
+
+typedef struct {
+  uint64_t offset;  // Of ArchiveRecord
+  uint32_t pid;
+  uint32_t errors;
+  uint64_t raw_size;
+  char command[MAX_COMMAND];
+} ArchiveEntry;
+
+typedef struct {
+  uint64_t index_offset;
+  uint64_t num_entries;
+  char magic[8];
+} ArchiveTrailer;
+
+typedef struct {
+  int fd;
+  char *buf;
+  size_t size, capacity;
+} Connection;
+
+static void die(const char *fmt, ...) __attribute__((format(printf, 1, 2), noreturn));
+
+static void die(const char *fmt, ...) {
+  va_list ap;
+  va_start(ap, fmt);
+  fputs("pregrind-collect: ", stderr);
+  vfprintf(stderr, fmt, ap);
+  fputc('\n', stderr);
+  va_end(ap);
+  exit(1);
+}
+
+static void *xrealloc(void *p, size_t n) {
+  p = realloc(p, n);
+  if(!p)
+    die("realloc() of %zd bytes failed", n);
+  return p;
+}
+
+static void xwrite(FILE *f, const void *p, size_t n) {
+  if(n && 1 != fwrite(p, n, 1, f))
+    die("failed to write archive: %s", strerror(errno));
+}
+
+static void xread(FILE *f, void *p, size_t n) {
+  if(n && 1 != fread(p, n, 1, f))
+    die("failed to read archive");
+}
+
+// Returns value after pattern or NULL
+static const char *find_after(const char *s, size_t n, const char *pattern) {
+  const char *p = memmem(s, n, pattern, strlen(pattern));
+  return p ? p + strlen(pattern) : NULL;
+}
+
+static int is_blank(const char *s, size_t n) {
+  for(; n; --n, ++s) {
+    if(*s != ' ' && *s != '\t' && *s != '\n')
+      return 0;
+  }
+  return 1;
+}
+
+static ArchiveEntry *entries;
+static size_t num_entries, max_entries;
+static unsigned long num_received, num_dropped;
+
+static void add_log(FILE *out, const char *buf, size_t size, int keep_clean) {
+  ++num_received;
+
+  uint32_t errors = NO_ERRORS_INFO;
+  const char *p = find_after(buf, size, "ERROR SUMMARY: ");
+  if(p)
+    errors = strtoul(p, NULL, 10);
+
+  if(!keep_clean && (is_blank(buf, size) || errors == 0)) {
+    ++num_dropped;
+    return;
+  }
+
+  uLongf comp_size = compressBound(size);
+  Bytef *comp = xrealloc(NULL, comp_size);
+  if(Z_OK != compress2(comp, &comp_size, (const Bytef *)buf, size, Z_BEST_SPEED))
+    die("failed to compress log");
+
+  if(num_entries == max_entries) {
+    max_entries = max_entries ? 2 * max_entries : 64;
+    entries = xrealloc(entries, max_entries * sizeof(ArchiveEntry));
+  }
+  ArchiveEntry *e = &entries[num_entries++];
+  memset(e, 0, sizeof(*e));
+
+  e->offset = ftell(out);
+  e->errors = errors;
+  e->raw_size = size;
+
+  // Lines look like "==PID== Command: ..."
+  if(size > 2 && buf[0] == '=' && buf[1] == '=')
+    e->pid = strtoul(buf + 2, NULL, 10);
+
+  p = find_after(buf, size, "Command: ");
+  if(p) {
+    const char *end = memchr(p, '\n', buf + size - p);
+    size_t len = (end ? end : buf + size) - p;
+    if(len >= MAX_COMMAND)
+      len = MAX_COMMAND - 1;
+    memcpy(e->command, p, len);
+  }
+
+  ArchiveRecord rec;
+  memset(&rec, 0, sizeof(rec));
+  rec.magic = RECORD_MAGIC;
+  rec.pid = e->pid;
+  rec.errors = errors;
+  rec.raw_size = size;
+  rec.comp_size = comp_size;
+
+  xwrite(out, &rec, sizeof(rec));
+  xwrite(out, comp, comp_size);
+  fflush(out);
+
+  free(comp);
+}
+
+static volatile sig_atomic_t done;
+
+static void on_signal(int sig) {
+  (void)sig;
+  done = 1;
+}
+
+static int listen_on(const char *addr) {
+  char host[64];
+  unsigned port = 1500;  // Valgrind's default
+  if(2 != sscanf(addr, "%63[^:]:%u", host, &port)
+      && 1 != sscanf(addr, "%63[^:]", host))
+    die("invalid address: %s", addr);
+
+  struct sockaddr_in sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sin_family = AF_INET;
+  sa.sin_port = htons(port);
+  if(1 != inet_pton(AF_INET, host, &sa.sin_addr))
+    die("invalid address: %s", addr);
+
+  int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  int one = 1;
+  if(fd < 0
+      || 0 != setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one))
+      || 0 != bind(fd, (struct sockaddr *)&sa, sizeof(sa))
+      || 0 != listen(fd, 128))
+    die("failed to listen on %s: %s", addr, strerror(errno));
+
+  return fd;
+}
+
+static int collect(const char *addr, const char *archive, int keep_clean) {
+  FILE *out = fopen(archive, "wb");
+  if(!out)
+    die("failed to open %s: %s", archive, strerror(errno));
+  xwrite(out, ARCHIVE_MAGIC, 8);
+
+  int lfd = listen_on(addr);
+
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = on_signal;
+  sigaction(SIGINT, &sa, NULL);
+  sigaction(SIGTERM, &sa, NULL);
+
+  Connection *conns = NULL;
+  struct pollfd *pfds = NULL;
+  size_t num_conns = 0, max_conns = 0;
+
+  while(!done) {
+    pfds = xrealloc(pfds, (num_conns + 1) * sizeof(struct pollfd));
+    pfds[0].fd = lfd;
+    pfds[0].events = POLLIN;
+    size_t i;
+    for(i = 0; i < num_conns; ++i) {
+      pfds[i + 1].fd = conns[i].fd;
+      pfds[i + 1].events = POLLIN;
+    }
+
+    if(poll(pfds, num_conns + 1, -1) < 0) {
+      if(errno == EINTR)
+        continue;
+      die("poll() failed: %s", strerror(errno));
+    }
+
+    // Iterate backwards as finished connections are removed
+    for(i = num_conns; i > 0; --i) {
+      if(!pfds[i].revents)
+        continue;
+
+      Connection *c = &conns[i - 1];
+      if(c->capacity - c->size < 4096) {
+        c->capacity = c->capacity ? 2 * c->capacity : 8192;
+        c->buf = xrealloc(c->buf, c->capacity);
+      }
+
+      ssize_t n = read(c->fd, c->buf + c->size, c->capacity - c->size);
+      if(n > 0) {
+        c->size += n;
+        continue;
+      }
+      if(n < 0 && errno == EINTR)
+        continue;
+
+      add_log(out, c->buf, c->size, keep_clean);
+      close(c->fd);
+      free(c->buf);
+      *c = conns[--num_conns];
+    }
+
+    if(pfds[0].revents & POLLIN) {
+      int fd = accept4(lfd, NULL, NULL, SOCK_CLOEXEC);
+      if(fd >= 0) {
+        if(num_conns == max_conns) {
+          max_conns = max_conns ? 2 * max_conns : 64;
+          conns = xrealloc(conns, max_conns * sizeof(Connection));
+        }
+        memset(&conns[num_conns], 0, sizeof(Connection));
+        conns[num_conns++].fd = fd;
+      }
+    }
+  }
+
+  // Save whatever we have for unfinished processes
+  size_t i;
+  for(i = 0; i < num_conns; ++i) {
+    add_log(out, conns[i].buf, conns[i].size, keep_clean);
+    close(conns[i].fd);
+    free(conns[i].buf);
+  }
+
+  ArchiveTrailer trailer;
+  memset(&trailer, 0, sizeof(trailer));
+  trailer.index_offset = ftell(out);
+  trailer.num_entries = num_entries;
+  memcpy(trailer.magic, INDEX_MAGIC, 8);
+
+  xwrite(out, entries, num_entries * sizeof(ArchiveEntry));
+  xwrite(out, &trailer, sizeof(trailer));
+  if(0 != fclose(out))
+    die("failed to write archive: %s", strerror(errno));
+
+  fprintf(stderr, "pregrind-collect: received %lu logs, dropped %lu clean ones\n",
+          num_received, num_dropped);
+
+  return 0;
+}
+
+static FILE *open_archive(const char *archive, ArchiveTrailer *trailer) {
+  FILE *f = fopen(archive, "rb");
+  if(!f)
+    die("failed to open %s: %s", archive, strerror(errno));
+
+  char magic[8];
+  xread(f, magic, 8);
+  if(0 != memcmp(magic, ARCHIVE_MAGIC, 8))
+    die("%s is not a Pregrind archive", archive);
+
+  if(0 != fseek(f, -(long)sizeof(ArchiveTrailer), SEEK_END))
+    die("%s has no index", archive);
+  xread(f, trailer, sizeof(*trailer));
+  if(0 != memcmp(trailer->magic, INDEX_MAGIC, 8))
+    die("%s has no index (collector was not stopped properly?)", archive);
+
+  return f;
+}
+
+static ArchiveEntry *read_index(FILE *f, const ArchiveTrailer *trailer) {
+  ArchiveEntry *index = xrealloc(NULL, (trailer->num_entries + 1) * sizeof(ArchiveEntry));
+  if(0 != fseek(f, trailer->index_offset, SEEK_SET))
+    die("failed to read index");
+  xread(f, index, trailer->num_entries * sizeof(ArchiveEntry));
+  return index;
+}
+
+static int list(const char *archive) {
+  ArchiveTrailer trailer;
+  FILE *f = open_archive(archive, &trailer);
+  ArchiveEntry *index = read_index(f, &trailer);
+
+  uint64_t i;
+  for(i = 0; i < trailer.num_entries; ++i) {
+    const ArchiveEntry *e = &index[i];
+    char errors[16] = "?";
+    if(e->errors != NO_ERRORS_INFO)
+      snprintf(errors, sizeof(errors), "%u", e->errors);
+    printf("%llu pid=%u errors=%s size=%llu %.*s\n", (unsigned long long)i, e->pid, errors,
+           (unsigned long long)e->raw_size, MAX_COMMAND, e->command);
+  }
+
+  free(index);
+  fclose(f);
+  return 0;
+}
+
+static int extract(const char *archive, uint64_t n) {
+  ArchiveTrailer trailer;
+  FILE *f = open_archive(archive, &trailer);
+  ArchiveEntry *index = read_index(f, &trailer);
+
+  if(n >= trailer.num_entries)
+    die("no log %llu in %s", (unsigned long long)n, archive);
+
+  ArchiveRecord rec;
+  if(0 != fseek(f, index[n].offset, SEEK_SET))
+    die("failed to read log");
+  xread(f, &rec, sizeof(rec));
+  if(rec.magic != RECORD_MAGIC)
+    die("corrupted archive");
+
+  Bytef *comp = xrealloc(NULL, rec.comp_size + 1);
+  uLongf size = rec.raw_size;
+  Bytef *buf = xrealloc(NULL, size + 1);
+  xread(f, comp, rec.comp_size);
+  if(Z_OK != uncompress(buf, &size, comp, rec.comp_size))
+    die("failed to decompress log");
+  fwrite(buf, 1, size, stdout);
+
+  free(buf);
+  free(comp);
+  free(index);
+  fclose(f);
+  return 0;
+}
+
+static void usage(int code) {
+  fprintf(code ? stderr : stdout,
+          "Usage:\n"
+          "  pregrind-collect [-l ADDR:PORT] [-k] -o ARCHIVE\n"
+          "  pregrind-collect -t ARCHIVE\n"
+          "  pregrind-collect -x N ARCHIVE\n");
+  exit(code);
+}
+
+int main(int argc, char *argv[]) {
+  const char *addr = "127.0.0.1:1500", *out = NULL;
+  int keep_clean = 0, do_list = 0;
+  long long n = -1;
+
+  int opt;
+  while((opt = getopt(argc, argv, "l:ko:tx:h")) != -1) {
+    switch(opt) {
+    case 'l':
+      addr = optarg;
+      break;
+    case 'k':
+      keep_clean = 1;
+      break;
+    case 'o':
+      out = optarg;
+      break;
+    case 't':
+      do_list = 1;
+      break;
+    case 'x':
+      n = atoll(optarg);
+      break;
+    case 'h':
+      usage(0);
+      break;
+    default:
+      usage(1);
+    }
+  }
+
+  if(do_list || n >= 0) {
+    if(optind + 1 != argc)
+      usage(1);
+    return do_list ? list(argv[optind]) : extract(argv[optind], n);
+  }
+
+  if(!out || optind != argc)
+    usage(1);
+
+  return collect(addr, out, keep_clean);
+}
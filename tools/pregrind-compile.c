@@ -0,0 +1,107 @@
+/*
+ * Copyright 2022 Yury Gribov
+ *
+ * Use of this source code is governed by MIT license that can be
+ * found in the LICENSE.txt file.
+ */
+
+// Compiles Valgrind flags, blacklist, policy and allowlist into a single
+// file which can be passed to Pregrind via PREGRIND_CONFIG. Unless given
+// in options, configuration is taken from PREGRIND_FLAGS,
+// PREGRIND_BLACKLIST, PREGRIND_POLICY and PREGRIND_ALLOWLIST.
+// With -d prints contents of compiled file.
+//
+// Usage: pregrind-compile [-f FLAGS] [-b BLACKLIST] [-p POLICY] [-a ALLOWLIST] OUT
+//        pregrind-compile -d FILE
+
+#include "config_blob.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <unistd.h>
+
+// Newer Glibc's do not allow linking sys_errlist to executables
+// so Pregrind modules use our table (filled in main)
+const char *sys_errlist[256];
+
+static void dump(const ConfigBlob *b) {
+  size_t i, j;
+
+  printf("flags:");
+  for(i = 0; i < b->num_flags; ++i)
+    printf(" %s", blob_strs_get(b, b->flags, i));
+  printf("\n");
+
+  printf("blacklist (%u patterns, %u states):\n",
+         b->num_blacklist, b->blacklist_matcher.num_nodes);
+  for(i = 0; i < b->num_blacklist; ++i)
+    printf("  %s\n", blob_strs_get(b, b->blacklist, i));
+
+  printf("policy (%u rules):\n", b->num_rules);
+  const BlobRule *rules = blob_ptr(b, b->rules);
+  for(i = 0; i < b->num_rules; ++i) {
+    printf("  %s", blob_str(b, rules[i].pattern));
+    for(j = 0; j < rules[i].num_flags; ++j)
+      printf(" %s", blob_strs_get(b, rules[i].flags, j));
+    printf("\n");
+  }
+
+  printf("allowlist (%u predicates):\n", b->num_allowlist);
+  for(i = 0; i < b->num_allowlist; ++i)
+    printf("  %s\n", blob_strs_get(b, b->allowlist, i));
+}
+
+int main(int argc, char *argv[]) {
+  int i;
+  for(i = 0; i < 256; ++i)
+    sys_errlist[i] = strerror(i);
+
+  const char *flags = getenv("PREGRIND_FLAGS");
+  const char *blacklist = getenv("PREGRIND_BLACKLIST");
+  const char *policy = getenv("PREGRIND_POLICY");
+  const char *allowlist = getenv("PREGRIND_ALLOWLIST");
+  int dump_only = 0;
+
+  int opt;
+  while((opt = getopt(argc, argv, "f:b:p:a:dh")) != -1) {
+    switch(opt) {
+    case 'f':
+      flags = optarg;
+      break;
+    case 'b':
+      blacklist = optarg;
+      break;
+    case 'p':
+      policy = optarg;
+      break;
+    case 'a':
+      allowlist = optarg;
+      break;
+    case 'd':
+      dump_only = 1;
+      break;
+    default:
+      fprintf(stderr,
+              "Usage: pregrind-compile [-f FLAGS] [-b BLACKLIST] [-p POLICY] [-a ALLOWLIST] OUT\n"
+              "       pregrind-compile -d FILE\n");
+      return opt == 'h' ? 0 : 1;
+    }
+  }
+
+  if(optind + 1 != argc) {
+    fprintf(stderr, "pregrind-compile: expected exactly one file\n");
+    return 1;
+  }
+
+  const char *file = argv[optind];
+
+  if(dump_only) {
+    dump(config_blob_map(file, STDERR_FILENO));
+    return 0;
+  }
+
+  const ConfigBlob *b = config_blob_compile(flags, blacklist, policy, allowlist, STDERR_FILENO);
+  return config_blob_save(b, file, STDERR_FILENO) ? 0 : 1;
+}
@@ -0,0 +1,58 @@
+/*
+ * Copyright 2022 Yury Gribov
+ *
+ * Use of this source code is governed by MIT license that can be
+ * found in the LICENSE.txt file.
+ */
+
+// Prints binary decision log (PREGRIND_LOG_FORMAT=binary) in text form:
+//   TIME PID PPID DECISION REASON PATH
+
+#include "log.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+static int dump(FILE *f, const char *name) {
+  LogRecord rec;
+  char path[UINT16_MAX + 1];
+  while(1 == fread(&rec, sizeof(rec), 1, f)) {
+    if(rec.magic != LOG_RECORD_MAGIC || rec.size < sizeof(rec)) {
+      fprintf(stderr, "pregrind-events: %s: corrupted record\n", name);
+      return 1;
+    }
+    size_t path_len = rec.size - sizeof(rec);
+    if(path_len && 1 != fread(path, path_len, 1, f)) {
+      fprintf(stderr, "pregrind-events: %s: truncated record\n", name);
+      return 1;
+    }
+    path[path_len] = 0;
+    printf("%llu.%09llu %d %d %s %s %s\n",
+           (unsigned long long)(rec.time_ns / 1000000000),
+           (unsigned long long)(rec.time_ns % 1000000000),
+           rec.pid, rec.ppid,
+           rec.decision == DECISION_INSTRUMENT ? "instrument" : "skip",
+           reason_name(rec.reason), path);
+  }
+  return 0;
+}
+
+int main(int argc, char *argv[]) {
+  if(argc < 2)
+    return dump(stdin, "stdin");
+
+  int i, ret = 0;
+  for(i = 1; i < argc; ++i) {
+    FILE *f = fopen(argv[i], "rb");
+    if(!f) {
+      fprintf(stderr, "pregrind-events: failed to open %s: %s\n", argv[i], strerror(errno));
+      return 1;
+    }
+    ret |= dump(f, argv[i]);
+    fclose(f);
+  }
+
+  return ret;
+}
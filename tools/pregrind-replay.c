@@ -0,0 +1,435 @@
+/*
+ * Copyright 2022 Yury Gribov
+ *
+ * Use of this source code is governed by MIT license that can be
+ * found in the LICENSE.txt file.
+ */
+
+// Runs commands from queue (PREGRIND_ESCALATE or PREGRIND_RECORD)
+// under Valgrind in parallel. Identical commands are run once
+// and commands which Pregrind would not instrument or whose runs
+// have all finished without errors are skipped.
+// Each command is run in its original directory and environment
+// (without preloads of Pregrind and Valgrind) with recorded flags,
+// FLAGS and --error-exitcode so runs which reported errors
+// can be told from failing ones.
+// With -l only prints commands.
+//
+// Usage: pregrind-replay [-j JOBS] [-f FLAGS] [-o LOG_DIR] [-l] QUEUE...
+
+#include "cmd_queue.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/wait.h>
+
+// Exit code which tells that Valgrind has found errors
+#define ERROR_EXITCODE 97
+
+typedef struct {
+  CmdRecord rec;
+  const char *path;
+  const char *cwd;
+  char **argv;
+  char **envp;
+  char **flags;   // Recorded Valgrind flags
+  unsigned count;  // Number of occurences in queue
+  unsigned clean;  // Number of runs which finished without errors
+  pid_t pid;
+} Cmd;
+
+static Cmd *cmds;
+static size_t num_cmds, cmds_capacity;
+
+// Open-addressing table of command indices (plus 1) by key
+static size_t *table;
+static size_t table_size;
+
+static void *xrealloc(void *p, size_t size) {
+  p = realloc(p, size);
+  if(!p) {
+    fprintf(stderr, "pregrind-replay: out of memory\n");
+    exit(1);
+  }
+  return p;
+}
+
+// Returns next string in record or NULL if record is corrupted
+static char *next_str(char **p, char *end) {
+  char *s = *p, *nul = memchr(s, 0, end - s);
+  if(!nul)
+    return NULL;
+  *p = nul + 1;
+  return s;
+}
+
+static char **read_strs(char **p, char *end, uint32_t n) {
+  char **strs = xrealloc(NULL, (n + 1) * sizeof(char *));
+  uint32_t i;
+  for(i = 0; i < n; ++i) {
+    if(!(strs[i] = next_str(p, end))) {
+      free(strs);
+      return NULL;
+    }
+  }
+  strs[n] = NULL;
+  return strs;
+}
+
+static size_t *find_slot(uint64_t key) {
+  size_t i = key & (table_size - 1);
+  while(table[i] && cmds[table[i] - 1].rec.key != key)
+    i = (i + 1) & (table_size - 1);
+  return &table[i];
+}
+
+static void grow_table() {
+  free(table);
+  table_size = table_size ? 2 * table_size : 256;
+  table = xrealloc(NULL, table_size * sizeof(size_t));
+  memset(table, 0, table_size * sizeof(size_t));
+  size_t i;
+  for(i = 0; i < num_cmds; ++i)
+    *find_slot(cmds[i].rec.key) = i + 1;
+}
+
+static int load(FILE *f, const char *name) {
+  CmdRecord rec;
+  while(1 == fread(&rec, sizeof(rec), 1, f)) {
+    if(rec.magic != CMD_QUEUE_MAGIC || rec.size < sizeof(rec)) {
+      fprintf(stderr, "pregrind-replay: %s: corrupted record\n", name);
+      return 1;
+    }
+
+    size_t size = rec.size - sizeof(rec);
+    char *data = xrealloc(NULL, size + 1), *p = data, *end = data + size;
+    if(size && 1 != fread(data, size, 1, f)) {
+      fprintf(stderr, "pregrind-replay: %s: truncated record\n", name);
+      free(data);
+      return 1;
+    }
+
+    Cmd c;
+    memset(&c, 0, sizeof(c));
+    c.rec = rec;
+    if(!(c.path = next_str(&p, end))
+        || !(c.cwd = next_str(&p, end))
+        || !(c.argv = read_strs(&p, end, rec.argc))
+        || !(c.envp = read_strs(&p, end, rec.envc))
+        || !(c.flags = read_strs(&p, end, rec.flagc))) {
+      fprintf(stderr, "pregrind-replay: %s: corrupted record\n", name);
+      return 1;
+    }
+
+    // Result of escalated run (see cmd_queue.h)
+    if(!*c.path) {
+      size_t *slot = table_size ? find_slot(rec.key) : NULL;
+      if(slot && *slot) {
+        Cmd *run = &cmds[*slot - 1];
+        if(!rec.errors)
+          ++run->clean;
+        else if(rec.errors > run->rec.errors)
+          run->rec.errors = rec.errors;
+      }
+      free(c.argv);
+      free(c.envp);
+      free(c.flags);
+      free(data);
+      continue;
+    }
+
+    if(2 * (num_cmds + 1) > table_size)
+      grow_table();
+
+    size_t *slot = find_slot(rec.key);
+    if(!rec.instrument || *slot) {
+      if(*slot)
+        ++cmds[*slot - 1].count;
+      free(c.argv);
+      free(c.envp);
+      free(c.flags);
+      free(data);
+      continue;
+    }
+
+    if(num_cmds == cmds_capacity) {
+      cmds_capacity = cmds_capacity ? 2 * cmds_capacity : 64;
+      cmds = xrealloc(cmds, cmds_capacity * sizeof(Cmd));
+    }
+    c.count = 1;
+    cmds[num_cmds++] = c;
+    *slot = num_cmds;
+  }
+  return 0;
+}
+
+static void print_cmd(const Cmd *c) {
+  char *const *arg;
+  for(arg = c->flags; *arg; ++arg)
+    printf("%s ", *arg);
+  printf("%s", c->path);
+  for(arg = c->argv + (c->argv[0] != NULL); *arg; ++arg)
+    printf(" %s", *arg);
+  printf(" (in %s)", c->cwd);
+}
+
+// Removes preloads of Pregrind and Valgrind from LD_PRELOAD
+static char *clean_preload(const char *var) {
+  char *res = xrealloc(NULL, strlen(var) + 1), *out = res;
+  out += sprintf(out, "LD_PRELOAD=");
+  char *copy = strdup(var + strlen("LD_PRELOAD=")), *save, *lib;
+  int empty = 1;
+  for(lib = strtok_r(copy, ": ", &save); lib; lib = strtok_r(NULL, ": ", &save)) {
+    if(strstr(lib, "vgpreload_") || strstr(lib, "libpregrind"))
+      continue;
+    out += sprintf(out, empty ? "%s" : ":%s", lib);
+    empty = 0;
+  }
+  free(copy);
+  if(empty) {
+    free(res);
+    return NULL;
+  }
+  return res;
+}
+
+static char **make_envp(const Cmd *c) {
+  char **envp = xrealloc(NULL, (c->rec.envc + 1) * sizeof(char *));
+  size_t n = 0;
+  char *const *var;
+  for(var = c->envp; *var; ++var) {
+    if(0 == strncmp(*var, "LD_PRELOAD=", 11)) {
+      char *preload = clean_preload(*var);
+      if(preload)
+        envp[n++] = preload;
+    } else if(!cmd_queue_volatile_var(*var))
+      envp[n++] = *var;
+  }
+  envp[n] = NULL;
+  return envp;
+}
+
+static char **make_argv(const Cmd *c, const char *valgrind, const char *flags,
+                        const char *log_dir, size_t idx) {
+  size_t max_args = 3 + c->rec.flagc + strlen(flags) / 2 + 1 + c->rec.argc + 1;
+  char **argv = xrealloc(NULL, max_args * sizeof(char *));
+  size_t n = 0;
+
+  argv[n++] = (char *)valgrind;
+
+  // Given flags override recorded ones
+  char *const *rec_flag;
+  for(rec_flag = c->flags; *rec_flag; ++rec_flag)
+    argv[n++] = *rec_flag;
+
+  char *copy = strdup(flags), *save, *flag;
+  for(flag = strtok_r(copy, " \t", &save); flag; flag = strtok_r(NULL, " \t", &save))
+    argv[n++] = flag;
+
+  // Go last so that we can classify results
+  if(log_dir) {
+    const char *name = strrchr(c->path, '/');
+    name = name ? name + 1 : c->path;
+    char *log = xrealloc(NULL, strlen(log_dir) + strlen(name) + 64);
+    sprintf(log, "--log-file=%s/%s.%zu.log", log_dir, name, idx);
+    argv[n++] = log;
+  }
+
+  char buf[64];
+  snprintf(buf, sizeof(buf), "--error-exitcode=%d", ERROR_EXITCODE);
+  argv[n++] = strdup(buf);
+
+  argv[n++] = (char *)c->path;
+  if(c->rec.argc) {
+    memcpy(&argv[n], c->argv + 1, (c->rec.argc - 1) * sizeof(char *));
+    n += c->rec.argc - 1;
+  }
+  argv[n] = NULL;
+
+  return argv;
+}
+
+static pid_t start(const Cmd *c, const char *valgrind, const char *flags,
+                   const char *log_dir, size_t idx) {
+  char **argv = make_argv(c, valgrind, flags, log_dir, idx);
+  char **envp = make_envp(c);
+
+  pid_t pid = fork();
+  if(pid < 0) {
+    perror("pregrind-replay: fork failed");
+    exit(1);
+  }
+
+  if(!pid) {
+    if(0 != chdir(c->cwd)) {
+      fprintf(stderr, "pregrind-replay: failed to change directory to %s: %s\n", c->cwd, strerror(errno));
+      _exit(1);
+    }
+
+    // Commands must not compete for terminal
+    int fd = open("/dev/null", O_RDONLY);
+    if(fd >= 0) {
+      dup2(fd, STDIN_FILENO);
+      close(fd);
+    }
+
+    if(log_dir) {
+      char out[4096];
+      snprintf(out, sizeof(out), "%s/%zu.out", log_dir, idx);
+      fd = open(out, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+      if(fd >= 0) {
+        dup2(fd, STDOUT_FILENO);
+        dup2(fd, STDERR_FILENO);
+        close(fd);
+      }
+    }
+
+    execvpe(valgrind, argv, envp);
+    fprintf(stderr, "pregrind-replay: failed to run %s: %s\n", valgrind, strerror(errno));
+    _exit(1);
+  }
+
+  // Strings are leaked
+  free(argv);
+  free(envp);
+  return pid;
+}
+
+// Returns 1 if Valgrind has found errors
+static int report(const Cmd *c, int wstatus) {
+  int errors = WIFEXITED(wstatus) && WEXITSTATUS(wstatus) == ERROR_EXITCODE;
+  if(errors)
+    printf("errors: ");
+  else if(WIFEXITED(wstatus) && !WEXITSTATUS(wstatus))
+    printf("clean: ");
+  else if(WIFEXITED(wstatus))
+    printf("exit %d: ", WEXITSTATUS(wstatus));
+  else
+    printf("signal %d: ", WTERMSIG(wstatus));
+  print_cmd(c);
+  printf("\n");
+  fflush(stdout);
+  return errors;
+}
+
+int main(int argc, char *argv[]) {
+  long jobs = sysconf(_SC_NPROCESSORS_ONLN);
+  const char *flags = getenv("PREGRIND_ESCALATE_FLAGS");
+  const char *log_dir = NULL;
+  int list = 0;
+
+  int opt;
+  while((opt = getopt(argc, argv, "j:f:o:lh")) != -1) {
+    switch(opt) {
+    case 'j':
+      jobs = atoi(optarg);
+      break;
+    case 'f':
+      flags = optarg;
+      break;
+    case 'o':
+      log_dir = optarg;
+      break;
+    case 'l':
+      list = 1;
+      break;
+    default:
+      fprintf(stderr, "Usage: pregrind-replay [-j JOBS] [-f FLAGS] [-o LOG_DIR] [-l] QUEUE...\n");
+      return opt == 'h' ? 0 : 1;
+    }
+  }
+
+  if(optind >= argc) {
+    fprintf(stderr, "pregrind-replay: queue not specified\n");
+    return 1;
+  }
+
+  if(jobs <= 0)
+    jobs = 1;
+  if(!flags)
+    flags = "";
+
+  // Commands are run in their directories
+  char log_dir_buf[PATH_MAX];
+  if(log_dir && !(log_dir = realpath(log_dir, log_dir_buf))) {
+    fprintf(stderr, "pregrind-replay: failed to access log directory: %s\n", strerror(errno));
+    return 1;
+  }
+
+  const char *valgrind = getenv("PREGRIND_VALGRIND");
+  if(!valgrind)
+    valgrind = "valgrind";
+
+  int i;
+  for(i = optind; i < argc; ++i) {
+    FILE *f = fopen(argv[i], "rb");
+    if(!f) {
+      fprintf(stderr, "pregrind-replay: failed to open %s: %s\n", argv[i], strerror(errno));
+      return 1;
+    }
+    int ret = load(f, argv[i]);
+    fclose(f);
+    if(ret)
+      return ret;
+  }
+
+  // Do not rerun escalated commands if all their runs were clean
+  // (recorded commands do not have results)
+  size_t j, n = 0;
+  for(j = 0; j < num_cmds; ++j) {
+    if(cmds[j].clean < cmds[j].count)
+      cmds[n++] = cmds[j];
+  }
+  num_cmds = n;
+
+  if(list) {
+    for(j = 0; j < num_cmds; ++j) {
+      const Cmd *c = &cmds[j];
+      printf("%u", c->count);
+      if(c->rec.errors >= 0)
+        printf(" (%d errors)", c->rec.errors);
+      printf(": ");
+      print_cmd(c);
+      printf("\n");
+    }
+    return 0;
+  }
+
+  size_t next = 0, running = 0;
+  unsigned num_errors = 0;
+  while(next < num_cmds || running) {
+    if(next < num_cmds && running < (size_t)jobs) {
+      cmds[next].pid = start(&cmds[next], valgrind, flags, log_dir, next);
+      ++next;
+      ++running;
+      continue;
+    }
+
+    int wstatus;
+    pid_t pid = wait(&wstatus);
+    if(pid < 0) {
+      if(errno == EINTR)
+        continue;
+      perror("pregrind-replay: wait failed");
+      return 1;
+    }
+
+    for(j = 0; j < next; ++j) {
+      if(cmds[j].pid == pid) {
+        num_errors += report(&cmds[j], wstatus);
+        cmds[j].pid = 0;
+        --running;
+        break;
+      }
+    }
+  }
+
+  printf("%zu commands replayed, %u with errors\n", num_cmds, num_errors);
+  return num_errors ? 1 : 0;
+}
@@ -0,0 +1,401 @@
+/*
+ * Copyright 2022 Yury Gribov
+ *
+ * Use of this source code is governed by MIT license that can be
+ * found in the LICENSE.txt file.
+ */
+
+// Analyzes process journal (PREGRIND_JOURNAL=1).
+//
+// Processes are linked to parents by pid and time and binaries
+// are ranked by total cost of instrumented runs and by slowdown
+// (average instrumented run vs. average native run).
+// With -t prints process tree and with -f prints folded stacks
+// (input for flamegraph.pl) weighted by CPU time in milliseconds.
+//
+// Usage: pregrind-report [-k TOP] [-t | -f] JOURNAL...
+
+#include "journal.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include <unistd.h>
+
+typedef struct {
+  JournalRecord rec;
+  char *path;
+  int parent;  // Index in procs or -1
+  unsigned depth;
+} Proc;
+
+static Proc *procs;
+static size_t num_procs, procs_capacity;
+
+static void *xrealloc(void *p, size_t size) {
+  p = realloc(p, size);
+  if(!p) {
+    fprintf(stderr, "pregrind-report: out of memory\n");
+    exit(1);
+  }
+  return p;
+}
+
+static int load(FILE *f, const char *name) {
+  JournalRecord rec;
+  while(1 == fread(&rec, sizeof(rec), 1, f)) {
+    if(rec.magic != JOURNAL_MAGIC || rec.size < sizeof(rec)) {
+      fprintf(stderr, "pregrind-report: %s: corrupted record\n", name);
+      return 1;
+    }
+    size_t path_len = rec.size - sizeof(rec);
+    char *path = xrealloc(NULL, path_len + 1);
+    if(path_len && 1 != fread(path, path_len, 1, f)) {
+      fprintf(stderr, "pregrind-report: %s: truncated record\n", name);
+      free(path);
+      return 1;
+    }
+    path[path_len] = 0;
+
+    if(num_procs == procs_capacity) {
+      procs_capacity = procs_capacity ? 2 * procs_capacity : 256;
+      procs = xrealloc(procs, procs_capacity * sizeof(Proc));
+    }
+    Proc *p = &procs[num_procs++];
+    p->rec = rec;
+    p->path = path;
+    p->parent = -1;
+  }
+  return 0;
+}
+
+// Instrumented runs include startup of Valgrind;
+// native runs are measured from start of executable
+// as process start time is imprecise
+static uint64_t wall_ns(const Proc *p) {
+  uint64_t start_ns = p->rec.start_ns;
+  if(!p->rec.instrumented && p->rec.exec_ns)
+    start_ns = p->rec.exec_ns;
+  return p->rec.end_ns > start_ns ? p->rec.end_ns - start_ns : 0;
+}
+
+static uint64_t cpu_ns(const Proc *p) {
+  return p->rec.user_ns + p->rec.sys_ns;
+}
+
+static int compare_by_pid(const void *a, const void *b) {
+  const Proc *l = &procs[*(const int *)a], *r = &procs[*(const int *)b];
+  if(l->rec.pid != r->rec.pid)
+    return l->rec.pid < r->rec.pid ? -1 : 1;
+  if(l->rec.start_ns != r->rec.start_ns)
+    return l->rec.start_ns < r->rec.start_ns ? -1 : 1;
+  return 0;
+}
+
+// Start times are rounded to clock ticks
+#define START_SLACK_NS 10000000ull
+
+// Parent is the latest process with child's ppid
+// which was alive when child started (pids are reused)
+static void link_parents() {
+  int *order = xrealloc(NULL, num_procs * sizeof(int) + 1);
+  size_t i;
+  for(i = 0; i < num_procs; ++i)
+    order[i] = i;
+  qsort(order, num_procs, sizeof(int), compare_by_pid);
+
+  for(i = 0; i < num_procs; ++i) {
+    Proc *p = &procs[i];
+
+    // Find first process with pid >= ppid
+    size_t lo = 0, hi = num_procs;
+    while(lo < hi) {
+      size_t mid = (lo + hi) / 2;
+      if(procs[order[mid]].rec.pid < p->rec.ppid)
+        lo = mid + 1;
+      else
+        hi = mid;
+    }
+
+    for(; lo < num_procs && procs[order[lo]].rec.pid == p->rec.ppid; ++lo) {
+      const Proc *q = &procs[order[lo]];
+      if(q->rec.start_ns > p->rec.start_ns + START_SLACK_NS)
+        break;
+      if(q->rec.end_ns + START_SLACK_NS >= p->rec.start_ns && q != p)
+        p->parent = order[lo];
+    }
+  }
+
+  free(order);
+
+  // Depths are needed for printing of tree;
+  // guard against cycles caused by clock skew
+  for(i = 0; i < num_procs; ++i) {
+    unsigned depth = 0;
+    int j;
+    for(j = procs[i].parent; j >= 0 && depth <= num_procs; j = procs[j].parent)
+      ++depth;
+    procs[i].depth = depth;
+    if(depth > num_procs)
+      procs[i].parent = -1;
+  }
+}
+
+typedef struct {
+  const char *path;
+  unsigned runs, instrumented_runs;
+  uint64_t instrumented_wall_ns, instrumented_cpu_ns;
+  uint64_t native_wall_ns;
+  uint64_t maxrss_kb;
+  double slowdown;  // 0 if unknown
+} Binary;
+
+static int compare_paths(const void *a, const void *b) {
+  return strcmp(procs[*(const int *)a].path, procs[*(const int *)b].path);
+}
+
+static Binary *aggregate(size_t *num_binaries) {
+  int *order = xrealloc(NULL, num_procs * sizeof(int) + 1);
+  size_t i;
+  for(i = 0; i < num_procs; ++i)
+    order[i] = i;
+  qsort(order, num_procs, sizeof(int), compare_paths);
+
+  Binary *binaries = xrealloc(NULL, num_procs * sizeof(Binary) + 1);
+  size_t n = 0;
+  for(i = 0; i < num_procs; ++i) {
+    const Proc *p = &procs[order[i]];
+    if(!n || 0 != strcmp(binaries[n - 1].path, p->path)) {
+      memset(&binaries[n], 0, sizeof(Binary));
+      binaries[n++].path = p->path;
+    }
+
+    Binary *b = &binaries[n - 1];
+    ++b->runs;
+    if(p->rec.instrumented) {
+      ++b->instrumented_runs;
+      b->instrumented_wall_ns += wall_ns(p);
+      b->instrumented_cpu_ns += cpu_ns(p);
+      if(p->rec.maxrss_kb > b->maxrss_kb)
+        b->maxrss_kb = p->rec.maxrss_kb;
+    } else {
+      b->native_wall_ns += wall_ns(p);
+    }
+  }
+
+  for(i = 0; i < n; ++i) {
+    Binary *b = &binaries[i];
+    unsigned native_runs = b->runs - b->instrumented_runs;
+    if(b->instrumented_runs && native_runs && b->native_wall_ns) {
+      b->slowdown = ((double)b->instrumented_wall_ns / b->instrumented_runs)
+        / ((double)b->native_wall_ns / native_runs);
+    }
+  }
+
+  free(order);
+  *num_binaries = n;
+  return binaries;
+}
+
+static int compare_by_cost(const void *a, const void *b) {
+  const Binary *l = a, *r = b;
+  if(l->instrumented_wall_ns != r->instrumented_wall_ns)
+    return l->instrumented_wall_ns < r->instrumented_wall_ns ? 1 : -1;
+  return strcmp(l->path, r->path);
+}
+
+static int compare_by_slowdown(const void *a, const void *b) {
+  const Binary *l = a, *r = b;
+  if(l->slowdown != r->slowdown)
+    return l->slowdown < r->slowdown ? 1 : -1;
+  return strcmp(l->path, r->path);
+}
+
+static void print_binaries(const Binary *binaries, size_t n, unsigned top) {
+  printf("%6s %6s %10s %10s %10s %8s %10s  %s\n", "runs", "instr", "wall(ms)",
+         "cpu(ms)", "native(ms)", "slowdown", "maxrss(kb)", "binary");
+  size_t i;
+  for(i = 0; i < n && i < top; ++i) {
+    const Binary *b = &binaries[i];
+    unsigned native_runs = b->runs - b->instrumented_runs;
+    char slowdown[32] = "-";
+    if(b->slowdown)
+      snprintf(slowdown, sizeof(slowdown), "%.1f", b->slowdown);
+    printf("%6u %6u %10.1f %10.1f %10.1f %8s %10llu  %s\n",
+           b->runs, b->instrumented_runs,
+           b->instrumented_wall_ns / 1e6, b->instrumented_cpu_ns / 1e6,
+           native_runs ? b->native_wall_ns / 1e6 / native_runs : 0.0,
+           slowdown, (unsigned long long)b->maxrss_kb, b->path);
+  }
+}
+
+static void report(unsigned top) {
+  size_t n, i;
+  Binary *binaries = aggregate(&n);
+
+  unsigned instrumented = 0;
+  uint64_t total_wall_ns = 0, total_cpu_ns = 0;
+  for(i = 0; i < num_procs; ++i) {
+    if(procs[i].rec.instrumented) {
+      ++instrumented;
+      total_wall_ns += wall_ns(&procs[i]);
+      total_cpu_ns += cpu_ns(&procs[i]);
+    }
+  }
+
+  printf("processes: %zu, instrumented: %u (%.1f s wall, %.1f s cpu), binaries: %zu\n",
+         num_procs, instrumented, total_wall_ns / 1e9, total_cpu_ns / 1e9, n);
+
+  printf("\nBy instrumented cost:\n");
+  qsort(binaries, n, sizeof(Binary), compare_by_cost);
+  print_binaries(binaries, n, top);
+
+  printf("\nBy slowdown (binaries which also ran natively):\n");
+  qsort(binaries, n, sizeof(Binary), compare_by_slowdown);
+  size_t num_known = 0;
+  while(num_known < n && binaries[num_known].slowdown)
+    ++num_known;
+  print_binaries(binaries, num_known, top);
+
+  free(binaries);
+}
+
+static int compare_by_start(const void *a, const void *b) {
+  const Proc *l = &procs[*(const int *)a], *r = &procs[*(const int *)b];
+  if(l->rec.start_ns != r->rec.start_ns)
+    return l->rec.start_ns < r->rec.start_ns ? -1 : 1;
+  return l->depth < r->depth ? -1 : l->depth > r->depth;
+}
+
+static void print_subtree(const int *children, const int *first_child, int i) {
+  const Proc *p = &procs[i];
+  printf("%*s%d %s%s (%.1f ms wall, %.1f ms cpu)\n", 2 * p->depth, "",
+         p->rec.pid, p->path, p->rec.instrumented ? " [vg]" : "",
+         wall_ns(p) / 1e6, cpu_ns(p) / 1e6);
+  int j;
+  for(j = first_child[i]; j < first_child[i + 1]; ++j)
+    print_subtree(children, first_child, children[j]);
+}
+
+// Children of each process are sorted by start time
+static void print_tree() {
+  int *order = xrealloc(NULL, num_procs * sizeof(int) + 1);
+  int *children = xrealloc(NULL, num_procs * sizeof(int) + 1);
+  int *first_child = xrealloc(NULL, (num_procs + 1) * sizeof(int));
+  size_t i;
+
+  for(i = 0; i < num_procs; ++i)
+    order[i] = i;
+  qsort(order, num_procs, sizeof(int), compare_by_start);
+
+  memset(first_child, 0, (num_procs + 1) * sizeof(int));
+  for(i = 0; i < num_procs; ++i) {
+    if(procs[i].parent >= 0)
+      ++first_child[procs[i].parent + 1];
+  }
+  for(i = 0; i < num_procs; ++i)
+    first_child[i + 1] += first_child[i];
+
+  int *pos = xrealloc(NULL, num_procs * sizeof(int) + 1);
+  memcpy(pos, first_child, num_procs * sizeof(int));
+  for(i = 0; i < num_procs; ++i) {
+    int parent = procs[order[i]].parent;
+    if(parent >= 0)
+      children[pos[parent]++] = order[i];
+  }
+
+  for(i = 0; i < num_procs; ++i) {
+    if(procs[order[i]].parent < 0)
+      print_subtree(children, first_child, order[i]);
+  }
+
+  free(pos);
+  free(first_child);
+  free(children);
+  free(order);
+}
+
+// Frame names must not contain separators of folded format
+static void print_frame(const Proc *p) {
+  const char *name = strrchr(p->path, '/');
+  name = name ? name + 1 : p->path;
+  if(!*name)
+    name = "?";
+  for(; *name; ++name)
+    putchar(*name == ';' || *name == ' ' ? '_' : *name);
+  if(p->rec.instrumented)
+    fputs("_[vg]", stdout);
+}
+
+static void print_stack(int i) {
+  if(procs[i].parent >= 0) {
+    print_stack(procs[i].parent);
+    putchar(';');
+  }
+  print_frame(&procs[i]);
+}
+
+static void print_folded() {
+  size_t i;
+  for(i = 0; i < num_procs; ++i) {
+    uint64_t ms = cpu_ns(&procs[i]) / 1000000;
+    if(!ms)
+      continue;
+    print_stack(i);
+    printf(" %llu\n", (unsigned long long)ms);
+  }
+}
+
+int main(int argc, char *argv[]) {
+  unsigned top = 20;
+  int tree = 0, folded = 0;
+
+  int opt;
+  while((opt = getopt(argc, argv, "k:tfh")) != -1) {
+    switch(opt) {
+    case 'k':
+      top = atoi(optarg);
+      break;
+    case 't':
+      tree = 1;
+      break;
+    case 'f':
+      folded = 1;
+      break;
+    default:
+      fprintf(stderr, "Usage: pregrind-report [-k TOP] [-t | -f] JOURNAL...\n");
+      return opt == 'h' ? 0 : 1;
+    }
+  }
+
+  if(optind >= argc) {
+    fprintf(stderr, "pregrind-report: journal not specified\n");
+    return 1;
+  }
+
+  int i;
+  for(i = optind; i < argc; ++i) {
+    FILE *f = fopen(argv[i], "rb");
+    if(!f) {
+      fprintf(stderr, "pregrind-report: failed to open %s: %s\n", argv[i], strerror(errno));
+      return 1;
+    }
+    int ret = load(f, argv[i]);
+    fclose(f);
+    if(ret)
+      return ret;
+  }
+
+  link_parents();
+
+  if(folded)
+    print_folded();
+  else if(tree)
+    print_tree();
+  else
+    report(top);
+
+  return 0;
+}
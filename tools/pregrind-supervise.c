@@ -0,0 +1,754 @@
+/*
+ * Copyright 2022 Yury Gribov
+ *
+ * Use of this source code is governed by MIT license that can be
+ * found in the LICENSE.txt file.
+ */
+
+// Supervisor mode: runs command under seccomp filter which stops
+// execve and execveat of all its descendants (including static
+// binaries and direct syscalls) so that decisions are made centrally
+// by a single process which loads libpregrind.so (and keeps its
+// caches warm) instead of preloading it to every process.
+//
+// SECCOMP_RET_USER_NOTIF does not allow changing syscall arguments
+// so we use SECCOMP_RET_TRACE and ptrace(2) instead. To rewrite exec,
+// the tracee is made to mmap a buffer, new arguments are copied there
+// and syscall is restarted.
+//
+// Successful exec releases the buffer together with address space
+// except for vfork children (e.g. from posix_spawn) which share it
+// with parent. Such buffers are unmapped by parent when vfork returns.
+//
+// Only x86_64 tracees are supported (32-bit syscalls are not stopped).
+//
+// Usage: pregrind-supervise [-l LIB] CMD ARG...
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <limits.h>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <dlfcn.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/ptrace.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <sys/user.h>
+#include <sys/wait.h>
+#include <linux/audit.h>
+#include <linux/filter.h>
+#include <linux/kcmp.h>
+#include <linux/seccomp.h>
+
+#ifndef __x86_64__
+# error Supervisor mode is only supported on x86_64
+#endif
+
+#define SYSCALL_INSN_SIZE 2
+
+typedef int (*SuperviseExec)(const char *path, const char *cwd, char *const *argv, char *const *envp,
+                             char ***new_argv, char ***new_envp);
+
+static SuperviseExec supervise_exec;
+static int verbose;
+
+typedef enum {
+  STATE_NEW,       // Waiting for initial SIGSTOP
+  STATE_RUNNING,
+  STATE_MMAP,      // Executing injected mmap
+  STATE_RESTARTED, // Restarted execve (possibly rewritten)
+  STATE_VFORK_DONE, // Returning from vfork (to unmap child's buffers)
+  STATE_MUNMAP,    // Executing injected munmap
+} State;
+
+// Buffer mapped in tracee
+typedef struct Mapping {
+  pid_t pid;                     // Tracee which mapped it
+  uintptr_t base;
+  size_t size;
+  struct Mapping *next;
+} Mapping;
+
+// Buffers of vfork children which remain in parents' memory
+static Mapping *vfork_maps;
+
+static void free_maps(Mapping *m) {
+  while(m) {
+    Mapping *next = m->next;
+    free(m);
+    m = next;
+  }
+}
+
+typedef struct Tracee {
+  pid_t pid;
+  State state;
+  struct user_regs_struct regs;  // Registers at execve
+  char *block;                   // New arguments (with offsets instead of pointers)
+  size_t block_size;
+  size_t argv_off, envp_off;     // Offsets of pointer arrays in block
+  size_t argc, envc;
+  int rewritten;                 // Restarted execve runs Valgrind
+  int in_launcher;               // Process is Valgrind launcher
+  int initial;                   // Supervised command has not started yet
+  pid_t vfork_child;             // Last child started via vfork
+  Mapping *unmaps;               // Buffers to unmap when vfork returns
+  struct Tracee *next;
+} Tracee;
+
+#define NUM_BUCKETS 1024
+
+static Tracee *tracees[NUM_BUCKETS];
+
+static Tracee *get_tracee(pid_t pid, int create) {
+  Tracee **p;
+  for(p = &tracees[pid % NUM_BUCKETS]; *p; p = &(*p)->next) {
+    if((*p)->pid == pid)
+      return *p;
+  }
+  if(!create)
+    return NULL;
+  Tracee *t = calloc(1, sizeof(Tracee));
+  if(!t) {
+    perror("pregrind-supervise: calloc");
+    exit(1);
+  }
+  t->pid = pid;
+  t->state = STATE_NEW;
+  *p = t;
+  return t;
+}
+
+static void remove_tracee(pid_t pid) {
+  Tracee **p;
+  for(p = &tracees[pid % NUM_BUCKETS]; *p; p = &(*p)->next) {
+    if((*p)->pid == pid) {
+      Tracee *t = *p;
+      *p = t->next;
+      free(t->block);
+      free_maps(t->unmaps);
+      free(t);
+      return;
+    }
+  }
+}
+
+// Growable buffer
+typedef struct {
+  char *data;
+  size_t size, capacity;
+} Buf;
+
+static void buf_reserve(Buf *b, size_t n) {
+  if(b->size + n <= b->capacity)
+    return;
+  b->capacity = b->capacity ? 2 * b->capacity : 4096;
+  if(b->capacity < b->size + n)
+    b->capacity = b->size + n;
+  b->data = realloc(b->data, b->capacity);
+  if(!b->data) {
+    perror("pregrind-supervise: realloc");
+    exit(1);
+  }
+}
+
+static size_t buf_add(Buf *b, const void *p, size_t n) {
+  buf_reserve(b, n);
+  memcpy(b->data + b->size, p, n);
+  b->size += n;
+  return b->size - n;
+}
+
+// Last page read from tracee (arguments are usually packed
+// so this saves a syscall per argument)
+static struct {
+  pid_t pid;
+  uintptr_t addr;
+  char data[4096];
+} page_cache;
+
+static void invalidate_page_cache() {
+  page_cache.pid = 0;
+}
+
+// Reads memory of tracee page by page (so that reads do not
+// fail because of unmapped neighbors). Returns 0 on failure.
+static int read_mem(pid_t pid, uintptr_t addr, void *buf, size_t n) {
+  char *out = buf;
+  while(n) {
+    uintptr_t page = addr & ~(uintptr_t)4095;
+    if(page_cache.pid != pid || page_cache.addr != page) {
+      struct iovec local = { page_cache.data, 4096 }, remote = { (void *)page, 4096 };
+      page_cache.pid = 0;
+      if(process_vm_readv(pid, &local, 1, &remote, 1, 0) != 4096)
+        return 0;
+      page_cache.pid = pid;
+      page_cache.addr = page;
+    }
+
+    size_t chunk = 4096 - (addr - page);
+    if(chunk > n)
+      chunk = n;
+    memcpy(out, page_cache.data + (addr - page), chunk);
+    out += chunk;
+    addr += chunk;
+    n -= chunk;
+  }
+  return 1;
+}
+
+// Appends null-terminated string from tracee to buffer,
+// returns its offset or -1
+static ssize_t read_string(pid_t pid, uintptr_t addr, Buf *b) {
+  size_t off = b->size;
+  while(1) {
+    size_t chunk = 4096 - addr % 4096;
+    buf_reserve(b, chunk);
+    if(!read_mem(pid, addr, b->data + b->size, chunk))
+      return -1;
+    char *end = memchr(b->data + b->size, 0, chunk);
+    if(end) {
+      b->size = end + 1 - b->data;
+      return off;
+    }
+    b->size += chunk;
+    addr += chunk;
+  }
+}
+
+// Reads null-terminated array of strings from tracee.
+// Offsets of strings are stored to offs (terminated by -1).
+static int read_strings(pid_t pid, uintptr_t addr, Buf *b, Buf *offs) {
+  // Read pointers first so that page cache is not thrashed
+  Buf ptrs = { 0, 0, 0 };
+  uintptr_t p = 0;
+  if(addr) {
+    while(1) {
+      if(!read_mem(pid, addr, &p, sizeof(p))) {
+        free(ptrs.data);
+        return 0;
+      }
+      if(!p)
+        break;
+      buf_add(&ptrs, &p, sizeof(p));
+      addr += sizeof(p);
+    }
+  }
+
+  size_t n = ptrs.size / sizeof(uintptr_t), i;
+  for(i = 0; i < n; ++i) {
+    ssize_t off = read_string(pid, ((uintptr_t *)ptrs.data)[i], b);
+    if(off < 0) {
+      free(ptrs.data);
+      return 0;
+    }
+    buf_add(offs, &off, sizeof(off));
+  }
+  free(ptrs.data);
+
+  ssize_t end = -1;
+  buf_add(offs, &end, sizeof(end));
+  return 1;
+}
+
+// Converts offsets to pointers
+static char **to_pointers(Buf *b, Buf *offs) {
+  size_t n = offs->size / sizeof(ssize_t), i;
+  char **ptrs = malloc(n * sizeof(char *));
+  if(!ptrs) {
+    perror("pregrind-supervise: malloc");
+    exit(1);
+  }
+  const ssize_t *o = (const ssize_t *)offs->data;
+  for(i = 0; i < n; ++i)
+    ptrs[i] = o[i] >= 0 ? b->data + o[i] : NULL;
+  return ptrs;
+}
+
+// Resolves path relative to directory of tracee
+static int get_abs_path(pid_t pid, int dirfd, const char *path, char *buf, size_t size) {
+  if(path[0] == '/') {
+    snprintf(buf, size, "%s", path);
+    return 1;
+  }
+
+  char link[64];
+  if(dirfd == AT_FDCWD)
+    snprintf(link, sizeof(link), "/proc/%d/cwd", (int)pid);
+  else
+    snprintf(link, sizeof(link), "/proc/%d/fd/%d", (int)pid, dirfd);
+
+  ssize_t n = readlink(link, buf, size - 1);
+  if(n < 0)
+    return 0;
+  buf[n] = 0;
+
+  return (size_t)snprintf(buf + n, size - n, "/%s", path) < size - n;
+}
+
+// Serializes array of strings to block: strings, then array of offsets
+static size_t serialize_strings(Buf *block, char *const *strs, size_t *n) {
+  Buf offs = { 0, 0, 0 };
+  for(*n = 0; strs[*n]; ++*n) {
+    uintptr_t off = buf_add(block, strs[*n], strlen(strs[*n]) + 1);
+    buf_add(&offs, &off, sizeof(off));
+  }
+  uintptr_t end = 0;
+  buf_add(&offs, &end, sizeof(end));
+
+  // Align array
+  static const char zeros[8];
+  buf_add(block, zeros, (8 - block->size % 8) % 8);
+  size_t array_off = buf_add(block, offs.data, offs.size);
+  free(offs.data);
+  return array_off;
+}
+
+static void resume(pid_t pid, int sig) {
+  if(0 != ptrace(PTRACE_CONT, pid, 0, sig) && errno != ESRCH)
+    fprintf(stderr, "pregrind-supervise: failed to resume %d: %s\n", (int)pid, strerror(errno));
+}
+
+// Tracee stopped at execve or execveat
+static void handle_exec(Tracee *t) {
+  pid_t pid = t->pid;
+
+  if(t->state == STATE_RESTARTED) {
+    // Decision has already been made
+    t->state = STATE_RUNNING;
+    resume(pid, 0);
+    return;
+  }
+
+  t->rewritten = 0;
+
+  if(t->in_launcher || t->initial) {
+    // Valgrind launcher starts the tool, do not interfere
+    // (same for supervised command, as in preload mode)
+    t->in_launcher = 0;
+    resume(pid, 0);
+    return;
+  }
+
+  struct user_regs_struct regs;
+  if(0 != ptrace(PTRACE_GETREGS, pid, 0, &regs)) {
+    resume(pid, 0);
+    return;
+  }
+
+  // Memory may have changed since last stop
+  invalidate_page_cache();
+
+  int dirfd = AT_FDCWD;
+  uintptr_t path_addr, argv_addr, envp_addr;
+  if(regs.orig_rax == SYS_execve) {
+    path_addr = regs.rdi;
+    argv_addr = regs.rsi;
+    envp_addr = regs.rdx;
+  } else {
+    // fexecve and friends are not instrumented
+    if(regs.r8 & AT_EMPTY_PATH) {
+      resume(pid, 0);
+      return;
+    }
+    dirfd = (int)regs.rdi;
+    path_addr = regs.rsi;
+    argv_addr = regs.rdx;
+    envp_addr = regs.r10;
+  }
+
+  Buf strs = { 0, 0, 0 }, argv_offs = { 0, 0, 0 }, envp_offs = { 0, 0, 0 };
+  char path[PATH_MAX];
+  ssize_t path_off = read_string(pid, path_addr, &strs);
+  int ok = path_off >= 0
+    && read_strings(pid, argv_addr, &strs, &argv_offs)
+    && read_strings(pid, envp_addr, &strs, &envp_offs)
+    && get_abs_path(pid, dirfd, strs.data + path_off, path, sizeof(path));
+
+  char **argv = NULL, **envp = NULL, **new_argv, **new_envp;
+  if(ok) {
+    argv = to_pointers(&strs, &argv_offs);
+    envp = to_pointers(&strs, &envp_offs);
+    // Needed to record commands
+    char cwd[PATH_MAX], link[64];
+    snprintf(link, sizeof(link), "/proc/%d/cwd", (int)pid);
+    ssize_t cwd_len = readlink(link, cwd, sizeof(cwd) - 1);
+    if(cwd_len >= 0)
+      cwd[cwd_len] = 0;
+    // Kernel accepts empty argv
+    ok = argv[0] && supervise_exec(path, cwd_len >= 0 ? cwd : NULL, argv, envp, &new_argv, &new_envp);
+  }
+
+  if(ok) {
+    Buf block = { 0, 0, 0 };
+    t->argv_off = serialize_strings(&block, new_argv, &t->argc);
+    t->envp_off = serialize_strings(&block, new_envp, &t->envc);
+    free(t->block);
+    t->block = block.data;
+    t->block_size = block.size;
+    t->regs = regs;
+
+    // Ask tracee to allocate memory for new arguments
+    regs.orig_rax = SYS_mmap;
+    regs.rdi = 0;
+    regs.rsi = t->block_size;
+    regs.rdx = PROT_READ | PROT_WRITE;
+    regs.r10 = MAP_PRIVATE | MAP_ANONYMOUS;
+    regs.r8 = (unsigned long)-1;
+    regs.r9 = 0;
+    if(0 == ptrace(PTRACE_SETREGS, pid, 0, &regs)
+        && 0 == ptrace(PTRACE_SYSCALL, pid, 0, 0))
+      t->state = STATE_MMAP;
+  }
+
+  free(argv);
+  free(envp);
+  free(strs.data);
+  free(argv_offs.data);
+  free(envp_offs.data);
+
+  if(t->state != STATE_MMAP)
+    resume(pid, 0);
+}
+
+// Checks if tracee shares address space with its parent
+// (i.e. it's a vfork child)
+static int shares_parent_memory(pid_t pid) {
+  char status[64];
+  snprintf(status, sizeof(status), "/proc/%d/status", (int)pid);
+  FILE *f = fopen(status, "r");
+  if(!f)
+    return 0;
+  int ppid = 0;
+  char line[128];
+  while(fgets(line, sizeof(line), f)) {
+    if(1 == sscanf(line, "PPid: %d", &ppid))
+      break;
+  }
+  fclose(f);
+  return ppid > 0 && 0 == syscall(SYS_kcmp, pid, ppid, KCMP_VM, 0, 0);
+}
+
+static void add_vfork_map(pid_t pid, uintptr_t base, size_t size) {
+  Mapping *m = malloc(sizeof(Mapping));
+  if(!m) {
+    perror("pregrind-supervise: malloc");
+    exit(1);
+  }
+  m->pid = pid;
+  m->base = base;
+  m->size = size;
+  m->next = vfork_maps;
+  vfork_maps = m;
+}
+
+// Moves buffers of tracee's vfork child to tracee
+static int take_vfork_maps(Tracee *t) {
+  Mapping **p = &vfork_maps;
+  while(*p) {
+    Mapping *m = *p;
+    if(m->pid == t->vfork_child) {
+      *p = m->next;
+      m->next = t->unmaps;
+      t->unmaps = m;
+    } else {
+      p = &m->next;
+    }
+  }
+  return t->unmaps != NULL;
+}
+
+// Tracee finished injected mmap
+static void handle_mmap(Tracee *t) {
+  pid_t pid = t->pid;
+
+  struct __ptrace_syscall_info info;
+  if(ptrace(PTRACE_GET_SYSCALL_INFO, pid, sizeof(info), &info) > 0
+      && info.op == PTRACE_SYSCALL_INFO_ENTRY) {
+    // Wait for syscall exit
+    ptrace(PTRACE_SYSCALL, pid, 0, 0);
+    return;
+  }
+
+  struct user_regs_struct regs;
+  if(0 != ptrace(PTRACE_GETREGS, pid, 0, &regs)) {
+    t->state = STATE_RUNNING;
+    return;
+  }
+
+  uintptr_t base = regs.rax;
+  regs = t->regs;
+
+  if(base > (uintptr_t)-4096) {
+    fprintf(stderr, "pregrind-supervise: mmap in %d failed, not instrumenting\n", (int)pid);
+  } else {
+    if(shares_parent_memory(pid))
+      add_vfork_map(pid, base, t->block_size);
+
+    // Relocate pointer arrays and copy block to tracee
+    uintptr_t *argv = (uintptr_t *)(t->block + t->argv_off);
+    uintptr_t *envp = (uintptr_t *)(t->block + t->envp_off);
+    size_t i;
+    for(i = 0; i < t->argc; ++i)
+      argv[i] += base;
+    for(i = 0; i < t->envc; ++i)
+      envp[i] += base;
+
+    struct iovec local = { t->block, t->block_size }, remote = { (void *)base, t->block_size };
+    if(process_vm_writev(pid, &local, 1, &remote, 1, 0) == (ssize_t)t->block_size) {
+      // Valgrind is run via plain execve (its path is absolute)
+      regs.orig_rax = SYS_execve;
+      regs.rdi = argv[0];
+      regs.rsi = base + t->argv_off;
+      regs.rdx = base + t->envp_off;
+      t->rewritten = 1;
+    } else {
+      fprintf(stderr, "pregrind-supervise: failed to write to %d, not instrumenting\n", (int)pid);
+    }
+  }
+
+  // Restart original or rewritten execve (it will stop again)
+  regs.rax = regs.orig_rax;
+  regs.rip -= SYSCALL_INSN_SIZE;
+  t->state = STATE_RESTARTED;
+
+  ptrace(PTRACE_SETREGS, pid, 0, &regs);
+  free(t->block);
+  t->block = NULL;
+  resume(pid, 0);
+}
+
+// Tracee returned from vfork or finished injected munmap
+static void handle_munmap(Tracee *t) {
+  pid_t pid = t->pid;
+
+  struct __ptrace_syscall_info info;
+  if(ptrace(PTRACE_GET_SYSCALL_INFO, pid, sizeof(info), &info) > 0
+      && info.op == PTRACE_SYSCALL_INFO_ENTRY) {
+    // Wait for syscall exit
+    ptrace(PTRACE_SYSCALL, pid, 0, 0);
+    return;
+  }
+
+  // Save results of vfork
+  if(t->state == STATE_VFORK_DONE && 0 != ptrace(PTRACE_GETREGS, pid, 0, &t->regs)) {
+    free_maps(t->unmaps);
+    t->unmaps = NULL;
+    t->state = STATE_RUNNING;
+    resume(pid, 0);
+    return;
+  }
+
+  Mapping *m = t->unmaps;
+  if(m) {
+    t->unmaps = m->next;
+
+    // Execute munmap instead of vfork's syscall instruction
+    struct user_regs_struct regs = t->regs;
+    regs.rax = SYS_munmap;
+    regs.rdi = m->base;
+    regs.rsi = m->size;
+    regs.rip -= SYSCALL_INSN_SIZE;
+    free(m);
+
+    if(0 == ptrace(PTRACE_SETREGS, pid, 0, &regs)
+        && 0 == ptrace(PTRACE_SYSCALL, pid, 0, 0)) {
+      t->state = STATE_MUNMAP;
+      return;
+    }
+
+    free_maps(t->unmaps);
+    t->unmaps = NULL;
+  }
+
+  // Return from vfork
+  ptrace(PTRACE_SETREGS, pid, 0, &t->regs);
+  t->state = STATE_RUNNING;
+  resume(pid, 0);
+}
+
+static void install_filter() {
+  struct sock_filter filter[] = {
+    BPF_STMT(BPF_LD | BPF_W | BPF_ABS, offsetof(struct seccomp_data, arch)),
+    BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, AUDIT_ARCH_X86_64, 1, 0),
+    BPF_STMT(BPF_RET | BPF_K, SECCOMP_RET_ALLOW),
+    BPF_STMT(BPF_LD | BPF_W | BPF_ABS, offsetof(struct seccomp_data, nr)),
+    BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, SYS_execve, 1, 0),
+    BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, SYS_execveat, 0, 1),
+    BPF_STMT(BPF_RET | BPF_K, SECCOMP_RET_TRACE),
+    BPF_STMT(BPF_RET | BPF_K, SECCOMP_RET_ALLOW),
+  };
+  struct sock_fprog prog = { sizeof(filter) / sizeof(filter[0]), filter };
+
+  if(0 != prctl(PR_SET_NO_NEW_PRIVS, 1, 0, 0, 0)
+      || 0 != prctl(PR_SET_SECCOMP, SECCOMP_MODE_FILTER, &prog)) {
+    perror("pregrind-supervise: failed to install seccomp filter");
+    exit(1);
+  }
+}
+
+static void load_lib(const char *lib) {
+  char buf[PATH_MAX];
+  if(!lib) {
+    // Look next to us (build tree) or in ../lib (installation)
+    ssize_t n = readlink("/proc/self/exe", buf, sizeof(buf) - 32);
+    if(n < 0) {
+      perror("pregrind-supervise: readlink");
+      exit(1);
+    }
+    buf[n] = 0;
+    char *slash = strrchr(buf, '/');
+    strcpy(slash, "/libpregrind.so");
+    if(0 != access(buf, R_OK))
+      strcpy(slash, "/../lib/libpregrind.so");
+    lib = buf;
+  }
+
+  // Local binding so that library does not intercept our own calls
+  void *h = dlopen(lib, RTLD_NOW | RTLD_LOCAL);
+  if(!h) {
+    fprintf(stderr, "pregrind-supervise: %s\n", dlerror());
+    exit(1);
+  }
+
+  supervise_exec = (SuperviseExec)dlsym(h, "pregrind_supervise_exec");
+  if(!supervise_exec) {
+    fprintf(stderr, "pregrind-supervise: %s is too old\n", lib);
+    exit(1);
+  }
+}
+
+int main(int argc, char *argv[]) {
+  const char *lib = NULL;
+
+  int opt;
+  while((opt = getopt(argc, argv, "+l:vh")) != -1) {
+    switch(opt) {
+    case 'l':
+      lib = optarg;
+      break;
+    case 'v':
+      verbose = 1;
+      break;
+    default:
+      fprintf(stderr, "Usage: pregrind-supervise [-l LIB] [-v] CMD ARG...\n");
+      return opt == 'h' ? 0 : 1;
+    }
+  }
+
+  if(optind >= argc) {
+    fprintf(stderr, "pregrind-supervise: command not specified\n");
+    return 1;
+  }
+
+  load_lib(lib);
+
+  pid_t child = fork();
+  if(child < 0) {
+    perror("pregrind-supervise: fork");
+    return 1;
+  }
+
+  if(!child) {
+    if(0 != ptrace(PTRACE_TRACEME, 0, 0, 0)) {
+      perror("pregrind-supervise: ptrace");
+      exit(1);
+    }
+    raise(SIGSTOP);
+    install_filter();
+    execvp(argv[optind], &argv[optind]);
+    fprintf(stderr, "pregrind-supervise: failed to run %s: %s\n", argv[optind], strerror(errno));
+    exit(127);
+  }
+
+  int status;
+  if(waitpid(child, &status, 0) != child || !WIFSTOPPED(status)) {
+    fprintf(stderr, "pregrind-supervise: failed to start %s\n", argv[optind]);
+    return 1;
+  }
+
+  if(0 != ptrace(PTRACE_SETOPTIONS, child, 0,
+                 PTRACE_O_TRACESECCOMP | PTRACE_O_TRACESYSGOOD | PTRACE_O_TRACEEXEC
+                 | PTRACE_O_TRACEFORK | PTRACE_O_TRACEVFORK | PTRACE_O_TRACECLONE
+                 | PTRACE_O_TRACEVFORKDONE | PTRACE_O_EXITKILL)) {
+    perror("pregrind-supervise: PTRACE_SETOPTIONS");
+    return 1;
+  }
+
+  Tracee *root = get_tracee(child, 1);
+  root->state = STATE_RUNNING;
+  root->initial = 1;
+  resume(child, 0);
+
+  // Job control stops are not handled: stopping signals are simply
+  // passed through.
+  int exit_code = 1;
+  while(1) {
+    pid_t pid = waitpid(-1, &status, __WALL);
+    if(pid < 0) {
+      if(errno == EINTR)
+        continue;
+      break;  // ECHILD
+    }
+
+    if(WIFEXITED(status) || WIFSIGNALED(status)) {
+      if(pid == child)
+        exit_code = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+      remove_tracee(pid);
+      continue;
+    }
+
+    if(!WIFSTOPPED(status))
+      continue;
+
+    Tracee *t = get_tracee(pid, 1);
+    int sig = WSTOPSIG(status), event = status >> 16;
+
+    if(sig == SIGTRAP && event == PTRACE_EVENT_SECCOMP) {
+      if(verbose)
+        fprintf(stderr, "pregrind-supervise: exec in %d\n", (int)pid);
+      t->state = t->state == STATE_NEW ? STATE_RUNNING : t->state;
+      handle_exec(t);
+    } else if(sig == (SIGTRAP | 0x80) && t->state == STATE_MMAP) {
+      handle_mmap(t);
+    } else if(sig == (SIGTRAP | 0x80)
+              && (t->state == STATE_VFORK_DONE || t->state == STATE_MUNMAP)) {
+      handle_munmap(t);
+    } else if(sig == SIGTRAP && event == PTRACE_EVENT_VFORK_DONE && take_vfork_maps(t)) {
+      // Wait until vfork returns to unmap child's buffers
+      t->state = STATE_VFORK_DONE;
+      ptrace(PTRACE_SYSCALL, pid, 0, 0);
+    } else if(sig == SIGTRAP && event) {
+      // Fork, clone or exec
+      if(event == PTRACE_EVENT_EXEC) {
+        t->in_launcher = t->rewritten;
+        t->rewritten = 0;
+        t->initial = 0;
+      } else if(event == PTRACE_EVENT_VFORK) {
+        unsigned long child_pid;
+        if(0 == ptrace(PTRACE_GETEVENTMSG, pid, 0, &child_pid))
+          t->vfork_child = (pid_t)child_pid;
+      }
+      resume(pid, 0);
+    } else if(sig == SIGSTOP && t->state == STATE_NEW) {
+      // New child starts stopped
+      t->state = STATE_RUNNING;
+      resume(pid, 0);
+    } else if(t->state == STATE_MMAP || t->state == STATE_VFORK_DONE || t->state == STATE_MUNMAP) {
+      // Keep tracing syscalls to restore registers after injected one
+      ptrace(PTRACE_SYSCALL, pid, 0, sig);
+    } else {
+      resume(pid, sig);
+    }
+  }
+
+  return exit_code;
+}
@@ -0,0 +1,181 @@
+/*
+ * Copyright 2022 Yury Gribov
+ *
+ * Use of this source code is governed by MIT license that can be
+ * found in the LICENSE.txt file.
+ */
+
+// Shows live statistics of running Pregrind session (PREGRIND_STATS=1).
+// With -1 prints a single report after first interval.
+//
+// Usage: pregrind-top [-1] [-n SECONDS] [-k TOP] [STATE_DIR]
+
+#include "stats.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+
+static const Stats *map_stats(const char *dir) {
+  char path[4096];
+  snprintf(path, sizeof(path), "%s/" STATS_NAME ".%d", dir, (int)getuid());
+
+  int fd = open(path, O_RDONLY);
+  if(fd < 0) {
+    fprintf(stderr, "pregrind-top: failed to open %s: %s\n", path, strerror(errno));
+    exit(1);
+  }
+
+  void *p = mmap(0, sizeof(Stats), PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if(p == MAP_FAILED) {
+    fprintf(stderr, "pregrind-top: failed to mmap %s: %s\n", path, strerror(errno));
+    exit(1);
+  }
+
+  const Stats *s = p;
+  if(s->header.magic != STATS_MAGIC) {
+    fprintf(stderr, "pregrind-top: %s was created by different version of Pregrind\n", path);
+    exit(1);
+  }
+
+  return s;
+}
+
+typedef struct {
+  const StatsBinary *b;
+  uint64_t count;
+  uint64_t instrumented;
+} Row;
+
+static int compare_rows(const void *a, const void *b) {
+  const Row *l = a, *r = b;
+  if(l->instrumented != r->instrumented)
+    return l->instrumented < r->instrumented ? 1 : -1;
+  if(l->count != r->count)
+    return l->count < r->count ? 1 : -1;
+  return 0;
+}
+
+// Returns upper bound of bucket which contains given percentile
+static uint64_t percentile(const uint64_t *hist, double p) {
+  uint64_t total = 0;
+  unsigned i;
+  for(i = 0; i < STATS_HIST_SIZE; ++i)
+    total += hist[i];
+  if(!total)
+    return 0;
+
+  uint64_t seen = 0;
+  for(i = 0; i < STATS_HIST_SIZE; ++i) {
+    seen += hist[i];
+    if(seen >= p * total)
+      break;
+  }
+  return i >= 63 ? UINT64_MAX : 2ull << i;
+}
+
+static void show(const Stats *cur, const Stats *prev, double dt, unsigned top) {
+  unsigned i;
+
+  printf("intercepted (total, per second):\n");
+  for(i = 0; i < API_MAX; ++i) {
+    if(cur->intercepted[i])
+      printf("  %-14s %10llu %10.1f\n", api_name(i), (unsigned long long)cur->intercepted[i],
+             (cur->intercepted[i] - prev->intercepted[i]) / dt);
+  }
+
+  printf("instrumented:    %10llu %10.1f\n", (unsigned long long)cur->instrumented,
+         (cur->instrumented - prev->instrumented) / dt);
+  printf("live:            %10lld\n", (long long)cur->live);
+
+  printf("skipped:\n");
+  for(i = 0; i < REASON_MAX; ++i) {
+    if(cur->skipped[i])
+      printf("  %-14s %10llu %10.1f\n", reason_name(i), (unsigned long long)cur->skipped[i],
+             (cur->skipped[i] - prev->skipped[i]) / dt);
+  }
+
+  printf("decision time: p50 < %llu ns, p90 < %llu ns, p99 < %llu ns\n",
+         (unsigned long long)percentile(cur->decide_hist, 0.5),
+         (unsigned long long)percentile(cur->decide_hist, 0.9),
+         (unsigned long long)percentile(cur->decide_hist, 0.99));
+
+  // Binaries which were most active during last interval
+  static Row rows[STATS_NUM_BINARIES];
+  unsigned num_rows = 0;
+  for(i = 0; i < STATS_NUM_BINARIES; ++i) {
+    const StatsBinary *b = &cur->binaries[i], *pb = &prev->binaries[i];
+    if(!b->key || !__atomic_load_n(&b->ready, __ATOMIC_ACQUIRE))
+      continue;
+    Row *r = &rows[num_rows++];
+    r->b = b;
+    r->count = b->count - (pb->key == b->key ? pb->count : 0);
+    r->instrumented = b->instrumented - (pb->key == b->key ? pb->instrumented : 0);
+  }
+  qsort(rows, num_rows, sizeof(Row), compare_rows);
+
+  printf("\n%10s %10s %10s %10s  %s\n", "execs/s", "instr/s", "execs", "instr", "binary");
+  for(i = 0; i < num_rows && i < top; ++i) {
+    const Row *r = &rows[i];
+    printf("%10.1f %10.1f %10llu %10llu  %.*s\n", r->count / dt, r->instrumented / dt,
+           (unsigned long long)r->b->count, (unsigned long long)r->b->instrumented,
+           STATS_PATH_SIZE, r->b->path);
+  }
+}
+
+int main(int argc, char *argv[]) {
+  int once = 0;
+  unsigned interval = 2, top = 20;
+
+  int opt;
+  while((opt = getopt(argc, argv, "1n:k:h")) != -1) {
+    switch(opt) {
+    case '1':
+      once = 1;
+      break;
+    case 'n':
+      interval = atoi(optarg);
+      break;
+    case 'k':
+      top = atoi(optarg);
+      break;
+    default:
+      fprintf(stderr, "Usage: pregrind-top [-1] [-n SECONDS] [-k TOP] [STATE_DIR]\n");
+      return opt == 'h' ? 0 : 1;
+    }
+  }
+
+  const char *dir = optind < argc ? argv[optind] : getenv("PREGRIND_STATE_DIR");
+  if(!dir)
+    dir = getenv("PREGRIND_LOG_PATH");
+  if(!dir) {
+    fprintf(stderr, "pregrind-top: state directory not specified\n");
+    return 1;
+  }
+
+  const Stats *stats = map_stats(dir);
+
+  static Stats prev, cur;
+  memcpy(&prev, stats, sizeof(Stats));
+
+  if(!interval)
+    interval = 1;
+
+  while(1) {
+    sleep(interval);
+    memcpy(&cur, stats, sizeof(Stats));
+    if(!once)
+      printf("\033[H\033[J");
+    show(&cur, &prev, interval, top);
+    fflush(stdout);
+    if(once)
+      return 0;
+    memcpy(&prev, &cur, sizeof(Stats));
+  }
+}